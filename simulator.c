@@ -1,122 +1,19 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <SDL3/SDL.h>
 #include <SDL3/SDL_render.h>
+#include "trafficsim.h"
 
-#define LEFT_TURN_THRESHOLD 310.0  // The threshold for making the left turn
-#define TURN_DISTANCE 50.0        // Distance to move after making the left turn
-#define TURN_ANGLE 90             // The angle of the left turn
-#define PRIORITY_LANE_THRESHOLD 10 // Number of vehicles to activate priority lane
-#define DISTANCE_BETWEEN_VEHICLES 40.0
-#define MAX_NUMBER_OF_VEHICLES 7
-
-const int WIDTH = 800, HEIGHT = 800;
-
-typedef struct {
-    int x, y;   // Position on screen
-    int state;  // 0 = Red, 1 = Green
-} TrafficLight;
-
-typedef struct {
-    float x, y;   // Position of vehicle
-    float speed;
-    int road;  
-    int lane;     // Lane index (0 = AL1, 1 = AL2, 2 = AL3, etc.)
-    int hasTurnedLeft;  // Flag to track if the vehicle has turned left
-} Vehicle;
-
-void renderVehicle(SDL_Renderer *renderer, Vehicle vehicle);
-void renderTrafficLight(SDL_Renderer *renderer, TrafficLight light);
-
-// Queue node
-typedef struct Node {
-    Vehicle vehicle;
-    struct Node* next;
-    struct Node* prev;
-} Node;
-
-// Queue structure
-typedef struct {
-    Node* front;
-    Node* rear;
-    int count; // To track the number of vehicles in the queue
-} Queue;
-
-void initQueue(Queue* q) {
-    q->front = q->rear = NULL;
-    q->count = 0;
-}
-
-int isQueueEmpty(Queue* q) {
-    return q->front == NULL;
-}
-
-int isQueueFull(Queue* q) {
-    return q->count == MAX_NUMBER_OF_VEHICLES;
-}
-
-void enqueue(Queue* q, Vehicle v) {
-    if (!isQueueFull(q)) {
-        Node* newNode = (Node*)malloc(sizeof(Node));
-        newNode->vehicle = v;
-        newNode->next = NULL;
-        if (q->rear == NULL) {
-            q->front = q->rear = newNode;
-        } else {
-            q->rear->next = newNode;
-            newNode->prev = q->rear;
-            q->rear = newNode;
-        }
-        q->count++;  // Increment vehicle count
-    } 
-    else {
-        return;
-    }
-}
-
-void dequeue(Queue* q) {
-    if (q->front == NULL) return;
-    Node* temp = q->front;
-    q->front = q->front->next;
-    if (q->front == NULL) q->rear = NULL;
-    free(temp);
-    q->count--;  // Decrement vehicle count
-}
-
-// Function to read vehicles from .txt file and update queue
-void updateVehicleQueueFromFile(Queue* q, const char *filename) {
-    FILE *fp = fopen(filename, "r");
-    if (!fp) {
-        printf("Error opening %s for reading.\n", filename);
-        return;
-    }
-
-    char line[1000000];
-    while (fgets(line, sizeof(line), fp)) {
-        Vehicle v;
-        if (sscanf(line, "%d,%d,%f,%f,%f", &v.road, &v.lane, &v.x, &v.y, &v.speed) == 5) {
-            if (v.lane == 2) {
-                enqueue(&q[1], v);
-            }
-            else if (v.lane == 3) {
-                enqueue(&q[2], v);
-            }
-        }
-    }
-    fclose(fp);
-
-    // Clear the file after reading the vehicles
-    fp = fopen(filename, "w");
-    if (!fp) {
-        printf("Error opening %s for writing.\n", filename);
-        return;
-    }
-    fclose(fp);
-}
-
-// / Rest of your code (queue functions, etc.)
+#define SIM_TICK_NS (SDL_NS_PER_SECOND / TRAFFICSIM_TICKS_PER_SECOND)   // Length of one tick
+#define MAX_CATCHUP_NS (250 * SDL_NS_PER_MS)  // Drop backlog beyond this after a stall
+#define TIME_SCALE_MAX 0                      // Time scale value meaning "as fast as possible"
+#define MAX_SPEED_FRAME_NS (15 * SDL_NS_PER_MS) // Real time spent ticking per frame at max speed
+#define REWIND_MEMORY_MB 64                   // Default memory kept for rewinding the window
+#define REWIND_STEP_MS 10000                  // Simulated time Backspace goes back
+#define TRACE_SEED 1                          // Seed of deterministic runs that do not give --seed
 
-void renderTrafficLight(SDL_Renderer *renderer, TrafficLight light) {
+void renderTrafficLight(SDL_Renderer *renderer, TrafficSimLight light) {
     // Draw the traffic light box
     SDL_SetRenderDrawColor(renderer, 50, 50, 50, 255); // Dark gray for the box
     SDL_FRect box = {(float)light.x, (float)light.y, 30.0f, 80.0f}; // Use SDL_FRect
@@ -128,8 +25,10 @@ void renderTrafficLight(SDL_Renderer *renderer, TrafficLight light) {
     SDL_RenderFillRect(renderer, &stand);
 
     // Draw the lights (circles)
-    if (light.state) {
+    if (light.state == 1) {
         SDL_SetRenderDrawColor(renderer, 0, 255, 0, 255); // Green light
+    } else if (light.state == 2) {
+        SDL_SetRenderDrawColor(renderer, 255, 191, 0, 255); // Amber light
     } else {
         SDL_SetRenderDrawColor(renderer, 255, 0, 0, 255); // Red light
     }
@@ -147,7 +46,7 @@ void renderTrafficLight(SDL_Renderer *renderer, TrafficLight light) {
         }
     }
 }
-void renderVehicle(SDL_Renderer *renderer, Vehicle vehicle) {
+void renderVehicle(SDL_Renderer *renderer, TrafficSimVehicle vehicle) {
     // Main body of the vehicle (car)
     SDL_SetRenderDrawColor(renderer, 0, 0, 255, 255); // Blue for vehicle body
     SDL_FRect rect = {vehicle.x, vehicle.y, 30.0f, 20.0f}; // Use SDL_FRect
@@ -178,379 +77,508 @@ void renderVehicle(SDL_Renderer *renderer, Vehicle vehicle) {
     SDL_RenderFillRect(renderer, &wheel4);
 }
 
+// Draw the junction as the library last reported it
+void renderSimulation(SDL_Renderer *renderer, const TrafficSimVehicle *vehicles, int vehicleCount,
+                      const TrafficSimLight lights[4]) {
+    SDL_SetRenderDrawColor(renderer, 34, 139, 34, 255); // Grass background
+    SDL_RenderClear(renderer);
+
+    // Draw roads and lane markings
+    SDL_SetRenderDrawColor(renderer, 50, 50, 50, 255); // Gray for roads
+    SDL_FRect horizontalRoad = {0.0f, 300.0f, 800.0f, 200.0f};
+    SDL_RenderFillRect(renderer, &horizontalRoad);
+    SDL_FRect verticalRoad = {300.0f, 0.0f, 200.0f, 800.0f};
+    SDL_RenderFillRect(renderer, &verticalRoad);
+
+    // --- Draw Lane Markings ---
+    SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255); // White for lane markings
+    for (int i = 1; i <= 2; i++) {
+        float laneY = 300.0f + (i * 200.0f / 3);
+        SDL_FRect leftLane = {0.0f, laneY, 300.0f, 2.0f};
+        SDL_RenderFillRect(renderer, &leftLane);
+        SDL_FRect rightLane = {500.0f, laneY, 300.0f, 2.0f};
+        SDL_RenderFillRect(renderer, &rightLane);
+    }
+    for (int i = 1; i <= 2; i++) {
+        float laneX = 300.0f + (i * 200.0f / 3);
+        SDL_FRect upperLane = {laneX, 0.0f, 2.0f, 300.0f};
+        SDL_RenderFillRect(renderer, &upperLane);
+        SDL_FRect lowerLane = {laneX, 500.0f, 2.0f, 300.0f};
+        SDL_RenderFillRect(renderer, &lowerLane);
+    }
+
+    // --- Draw the Priority Lane (Dashed Yellow Line) ---
+    SDL_SetRenderDrawColor(renderer, 255, 255, 0, 255); // Yellow color for dashed line
+    float priorityLaneX = 366.67f + 33.33f;
+    for (float y = 0.0f; y < 300.0f; y += 40.0f) {
+        SDL_FRect dash = {priorityLaneX, y, 5.0f, 20.0f};
+        SDL_RenderFillRect(renderer, &dash);
+    }
+
+    // Draw every queued vehicle
+    for (int i = 0; i < vehicleCount; i++) {
+        renderVehicle(renderer, vehicles[i]);
+    }
+
+    // Render all traffic lights
+    for (int i = 0; i < 4; i++) {
+        renderTrafficLight(renderer, lights[i]);
+    }
+}
+
+// Parse a --speed value: 1, 10, 100 or "max". Returns -1 if invalid.
+int parseTimeScale(const char *text) {
+    if (strcmp(text, "max") == 0) {
+        return TIME_SCALE_MAX;
+    }
+    int scale = atoi(text);
+    return scale > 0 ? scale : -1;
+}
+
+// Show the time scale and simulated clock in the window title
+void updateWindowTitle(SDL_Window *window, const TrafficSim *ts, int timeScale, int paused) {
+    char title[128];
+    char scale[16];
+    if (timeScale == TIME_SCALE_MAX) {
+        snprintf(scale, sizeof(scale), "max");
+    }
+    else {
+        snprintf(scale, sizeof(scale), "%dx", timeScale);
+    }
+    Uint64 seconds = trafficSimGetTick(ts) / TRAFFICSIM_TICKS_PER_SECOND;
+    int replaying = trafficSimIsReplaying(ts);
+    snprintf(title, sizeof(title), "Traffic Simulation - %s%s%s - %02llu:%02llu:%02llu", scale,
+             paused ? " (paused)" : "", replaying ? " (rewound)" : "", (unsigned long long)(seconds / 3600),
+             (unsigned long long)(seconds / 60 % 60), (unsigned long long)(seconds % 60));
+    SDL_SetWindowTitle(window, title);
+}
+
+void printUsage(const char *program) {
+    TrafficSimConfig defaults;
+    trafficSimDefaultConfig(&defaults);
+    printf("Usage: %s [options]\n", program);
+    printf("  --headless         Run without a window and print summary statistics\n");
+    printf("  --duration <s>     Simulated seconds to run in headless mode (default 3600)\n");
+    printf("  --generate         Use the built-in vehicle generator instead of RoadX.txt\n");
+    printf("  --seed <n>         Seed for the built-in vehicle generator\n");
+    printf("  --spawn-interval <s> Simulated seconds between built-in generator batches (default %g)\n",
+           defaults.spawnSeconds);
+    printf("  --green <s>        Longest green in simulated seconds (default %g)\n",
+           defaults.greenSeconds);
+    printf("  --min-green <s>    Shortest green (default %g)\n", defaults.minGreenSeconds);
+    printf("  --service-time <s> Green time per waiting vehicle; 0 keeps every green at --green\n");
+    printf("                     (default %g)\n", defaults.serviceSeconds);
+    printf("  --amber <s>        Amber after each green (default %g)\n", defaults.amberSeconds);
+    printf("  --all-red <s>      Every light red between amber and the next green (default %g)\n",
+           defaults.allRedSeconds);
+    printf("  --priority-threshold <n> Lane A2 vehicles above which road A takes priority (default %d)\n",
+           defaults.priorityThreshold);
+    printf("  --threads <n>      Worker threads for the per-road update (0 = all cores, default 1)\n");
+    printf("  --lane-capacity <n> Vehicles a lane holds before arrivals are rejected (default %d)\n",
+           defaults.laneCapacity);
+    printf("  --follow <model>   Car-following model: simple or idm (default simple)\n");
+    printf("  --reservations     Vehicles book space-time cells of the junction box (implies idm)\n");
+    printf("  --audit            Count overlapping vehicles every tick using a spatial grid\n");
+    printf("  --kernel <name>    Lane-advance kernel: scalar, sse or avx2 (default: best available)\n");
+    printf("  --engine <name>    tick (fixed steps), event (discrete events, simple queue model)\n");
+    printf("                     or ctm (cell transmission model, no individual vehicles)\n");
+    printf("  --grid <c>x<r>     Headless: simulate a grid of c x r junctions instead of one\n");
+    printf("  --network <file>   Headless: simulate the junction network described in file\n");
+    printf("  --scaling          With --grid or --network: time 1, 2, 4 .. all threads and compare\n");
+    printf("  --routes           With --grid or --network: send each vehicle to a random exit by the\n");
+    printf("                     shortest route instead of turning at random\n");
+    printf("  --distributed <r>/<n> With --grid or --network: run share r of n processes (r = 0 .. n-1)\n");
+    printf("  --peers <list>     host:port of every process, comma separated (default 127.0.0.1:%d+r)\n",
+           TRAFFICSIM_NETWORK_BASE_PORT);
+    printf("  --deterministic    Built-in generator, seed %d unless --seed is given, per-tick checksums\n",
+           TRACE_SEED);
+    printf("  --trace <file>     Write the checksum after every tick to file (implies --deterministic)\n");
+    printf("  --compare <file>   Check every tick against a trace file and stop at the first\n");
+    printf("                     difference (implies --deterministic)\n");
+    printf("  --load <file>      Start from a checkpoint instead of empty roads\n");
+    printf("  --save <file>      Write a checkpoint at the end of a headless run or when the window closes\n");
+    printf("  --sweep <spec>     Headless: one run per configuration of green, threshold, spawn,\n");
+    printf("                     capacity and service, e.g. green=10:40:5,threshold=5:15\n");
+    printf("                     (name=low:high[:step])\n");
+    printf("  --sweep-random <n> Draw n configurations at random from the --sweep ranges instead\n");
+    printf("  --sweep-out <file> CSV file for the sweep results (default sweep.csv)\n");
+    printf("  --ensemble <n>     Headless: up to n replications from independent random streams,\n");
+    printf("                     stopping once every 95%% confidence interval is within --ci\n");
+    printf("  --ci <percent>     Target confidence interval half-width, percent of the mean (default 1)\n");
+    printf("  --what-if <s>      After a headless run, compare changing the light now, in 5, 10 or 15 s\n");
+    printf("                     and as planned, each run s seconds ahead from a fork of the final state\n");
+    printf("  --speed <n|max>    Simulated seconds per real second in the window (default 1)\n");
+    printf("  --rewind-memory <MB> Memory the window keeps for rewinding (0 = off, default %d)\n",
+           REWIND_MEMORY_MB);
+    printf("Keys: 1/2/3/4 = 1x/10x/100x/max, Space = pause, Right or . = single step while paused,\n");
+    printf("      Left or , = step back while paused, Backspace = back %d s\n", REWIND_STEP_MS / 1000);
+}
+
 int main(int argc, char *argv[]) {
+    TrafficSimConfig config;
+    trafficSimDefaultConfig(&config);
+    config.arrivals = TRAFFICSIM_ARRIVALS_LANE_FILES;
+    TrafficSimNetworkConfig network;
+    trafficSimDefaultNetworkConfig(&network);
+
+    int headless = 0;
+    double duration = 3600.0;
+    int timeScale = 1;  // Simulation ticks run per tick of real time, or TIME_SCALE_MAX
+    const char *kernel = NULL;
+    const char *engineName = "tick";
+    int spawnGiven = 0;
+    int seedGiven = 0;
+    int deterministic = 0;
+    const char *loadFile = NULL;
+    const char *saveFile = NULL;
+    int rewindMemory = REWIND_MEMORY_MB;
+    double whatIf = 0.0;
+    const char *sweepText = NULL;
+    const char *sweepFile = "sweep.csv";
+    int sweepRandom = 0;
+    int ensembleRuns = 0;
+    double ciPercent = 1.0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--headless") == 0) {
+            headless = 1;
+        }
+        else if (strcmp(argv[i], "--duration") == 0 && i + 1 < argc) {
+            duration = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--generate") == 0) {
+            config.arrivals = TRAFFICSIM_ARRIVALS_GENERATOR;
+        }
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            config.seed = strtoull(argv[++i], NULL, 10);
+            seedGiven = 1;
+        }
+        else if (strcmp(argv[i], "--spawn-interval") == 0 && i + 1 < argc && atof(argv[i + 1]) > 0.0) {
+            config.spawnSeconds = atof(argv[++i]);
+            spawnGiven = 1;
+        }
+        else if (strcmp(argv[i], "--green") == 0 && i + 1 < argc && atof(argv[i + 1]) > 0.0) {
+            config.greenSeconds = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--min-green") == 0 && i + 1 < argc && atof(argv[i + 1]) >= 0.0) {
+            config.minGreenSeconds = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--service-time") == 0 && i + 1 < argc && atof(argv[i + 1]) >= 0.0) {
+            config.serviceSeconds = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--amber") == 0 && i + 1 < argc && atof(argv[i + 1]) >= 0.0) {
+            config.amberSeconds = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--all-red") == 0 && i + 1 < argc && atof(argv[i + 1]) >= 0.0) {
+            config.allRedSeconds = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--priority-threshold") == 0 && i + 1 < argc && atoi(argv[i + 1]) >= 0) {
+            config.priorityThreshold = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            config.threads = atoi(argv[++i]);
+            if (config.threads <= 0) config.threads = SDL_GetNumLogicalCPUCores();
+        }
+        else if (strcmp(argv[i], "--lane-capacity") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            config.laneCapacity = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--follow") == 0 && i + 1 < argc &&
+                 (strcmp(argv[i + 1], "simple") == 0 || strcmp(argv[i + 1], "idm") == 0)) {
+            config.followModel = strcmp(argv[++i], "idm") == 0 ? TRAFFICSIM_FOLLOW_IDM : TRAFFICSIM_FOLLOW_SIMPLE;
+        }
+        else if (strcmp(argv[i], "--reservations") == 0) {
+            config.reservations = 1;
+        }
+        else if (strcmp(argv[i], "--audit") == 0) {
+            config.audit = 1;
+        }
+        else if (strcmp(argv[i], "--kernel") == 0 && i + 1 < argc) {
+            kernel = argv[++i];
+        }
+        else if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc &&
+                 (strcmp(argv[i + 1], "tick") == 0 || strcmp(argv[i + 1], "event") == 0 ||
+                  strcmp(argv[i + 1], "ctm") == 0)) {
+            engineName = argv[++i];
+        }
+        else if (strcmp(argv[i], "--grid") == 0 && i + 1 < argc &&
+                 sscanf(argv[i + 1], "%dx%d", &network.columns, &network.rows) == 2 &&
+                 network.columns > 0 && network.rows > 0) {
+            i++;
+        }
+        else if (strcmp(argv[i], "--network") == 0 && i + 1 < argc) {
+            network.file = argv[++i];
+        }
+        else if (strcmp(argv[i], "--scaling") == 0) {
+            network.scaling = 1;
+        }
+        else if (strcmp(argv[i], "--routes") == 0) {
+            network.routes = 1;
+        }
+        else if (strcmp(argv[i], "--distributed") == 0 && i + 1 < argc &&
+                 sscanf(argv[i + 1], "%d/%d", &network.rank, &network.ranks) == 2 &&
+                 network.rank >= 0 && network.rank < network.ranks) {
+            i++;
+        }
+        else if (strcmp(argv[i], "--peers") == 0 && i + 1 < argc) {
+            network.peers = argv[++i];
+        }
+        else if (strcmp(argv[i], "--deterministic") == 0) {
+            deterministic = 1;
+        }
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            config.traceFile = argv[++i];
+            deterministic = 1;
+        }
+        else if (strcmp(argv[i], "--compare") == 0 && i + 1 < argc) {
+            config.compareFile = argv[++i];
+            deterministic = 1;
+        }
+        else if (strcmp(argv[i], "--load") == 0 && i + 1 < argc) {
+            loadFile = argv[++i];
+        }
+        else if (strcmp(argv[i], "--save") == 0 && i + 1 < argc) {
+            saveFile = argv[++i];
+        }
+        else if (strcmp(argv[i], "--speed") == 0 && i + 1 < argc && parseTimeScale(argv[i + 1]) >= 0) {
+            timeScale = parseTimeScale(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--sweep") == 0 && i + 1 < argc) {
+            sweepText = argv[++i];
+        }
+        else if (strcmp(argv[i], "--sweep-random") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            sweepRandom = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--sweep-out") == 0 && i + 1 < argc) {
+            sweepFile = argv[++i];
+        }
+        else if (strcmp(argv[i], "--ensemble") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            ensembleRuns = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--ci") == 0 && i + 1 < argc && atof(argv[i + 1]) > 0.0) {
+            ciPercent = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--what-if") == 0 && i + 1 < argc && atof(argv[i + 1]) > 0.0) {
+            whatIf = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--rewind-memory") == 0 && i + 1 < argc && atoi(argv[i + 1]) >= 0) {
+            rewindMemory = atoi(argv[++i]);
+        }
+        else {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (config.priorityThreshold >= config.laneCapacity && !sweepText && network.columns == 0 && !network.file) {
+        printf("Warning: lane A2 holds at most %d vehicles, so --priority-threshold %d never gives road A priority\n",
+               config.laneCapacity, config.priorityThreshold);
+    }
+
+    // Networks always run headless with their own model of every junction
+    if (network.columns > 0 || network.file) {
+        network.seed = config.seed;
+        network.threads = config.threads;
+        if (spawnGiven) {
+            network.entrySeconds = config.spawnSeconds;
+        }
+        printf("Seed:                %llu\n", (unsigned long long)network.seed);
+        if (network.ranks > 1 && (network.scaling || network.threads != 1 || network.routes)) {
+            // One thread per process; run more processes to use more cores
+            printf("--scaling, --threads and --routes are ignored by distributed runs.\n");
+        }
+        return trafficSimRunNetwork(&network, duration);
+    }
+
+    if (deterministic) {
+        // Lane files depend on when another process wrote them, so only the seeded
+        // generator gives the same arrivals every run
+        if (!seedGiven) config.seed = TRACE_SEED;
+        config.arrivals = TRAFFICSIM_ARRIVALS_GENERATOR;
+        config.checksums = 1;
+    }
+
+    const char *kernelInUse = trafficSimSelectKernel(kernel);
+    if (kernel && strcmp(kernel, kernelInUse) != 0) {
+        printf("Lane kernel %s is not available, using %s.\n", kernel, kernelInUse);
+    }
+
+    if (strcmp(engineName, "tick") != 0) {
+        // Neither engine moves individual vehicles tick by tick; the tick-only options do nothing
+        if (config.followModel != TRAFFICSIM_FOLLOW_SIMPLE || config.reservations || config.audit) {
+            printf("--follow, --reservations and --audit are ignored by the %s engine.\n", engineName);
+        }
+        config.engine = strcmp(engineName, "event") == 0 ? TRAFFICSIM_ENGINE_EVENT : TRAFFICSIM_ENGINE_CTM;
+    }
+
+    // Headless runs never touch the video subsystem and always generate their own traffic
+    if (headless) {
+        config.arrivals = TRAFFICSIM_ARRIVALS_GENERATOR;
+    }
+    else {
+        config.rewindMemoryMB = rewindMemory;
+    }
+    TrafficSim *ts = trafficSimCreate(&config);
+    if (!ts) return 1;
+
+    if (loadFile) {
+        const char *engineNames[3] = {"tick", "event", "ctm"};
+        Uint64 loadStart = SDL_GetTicksNS();
+        if (!trafficSimLoad(ts, loadFile)) {
+            trafficSimDestroy(ts);
+            return 1;
+        }
+        engineName = engineNames[trafficSimGetEngine(ts)];
+        printf("Checkpoint:          %s at %.1f s, loaded in %.3f ms\n", loadFile,
+               (double)trafficSimGetTick(ts) / TRAFFICSIM_TICKS_PER_SECOND,
+               (double)(SDL_GetTicksNS() - loadStart) / SDL_NS_PER_MS);
+    }
+
+    if (headless) {
+        if (!loadFile) {
+            printf("Seed:                %llu\n", (unsigned long long)config.seed);
+        }
+        printf("Engine:              %s\n", engineName);
+        printf("Lane kernel:         %s\n", kernelInUse);
+        int result;
+        if (sweepText || sweepRandom) {
+            // Every parameter not named stays at the value set on the command line
+            printf("Threads:             %d\n", config.threads);
+            result = trafficSimRunSweep(ts, sweepText, sweepRandom, duration, sweepFile);
+        }
+        else if (ensembleRuns > 0) {
+            printf("Threads:             %d\n", config.threads);
+            result = trafficSimRunEnsemble(ts, ensembleRuns, ciPercent / 100.0, duration);
+        }
+        else {
+            // As fast as possible for a fixed simulated duration
+            TrafficSimMetrics metrics;
+            Uint64 startTime = SDL_GetTicksNS();
+            trafficSimStep(ts, (Uint64)(duration * TRAFFICSIM_TICKS_PER_SECOND));
+            trafficSimPrintSummary(ts, (double)(SDL_GetTicksNS() - startTime) / SDL_NS_PER_SECOND);
+            trafficSimGetMetrics(ts, &metrics);
+            result = metrics.divergedTick ? 1 : 0;
+            if (whatIf > 0.0 && result == 0) {
+                trafficSimRunWhatIf(ts, whatIf);
+            }
+            if (saveFile && !trafficSimSave(ts, saveFile)) {
+                result = 1;
+            }
+        }
+        trafficSimDestroy(ts);
+        return result;
+    }
+
     if (!SDL_Init(SDL_INIT_VIDEO)) {
         printf("SDL Initialization failed: %s\n", SDL_GetError());
+        trafficSimDestroy(ts);
         return 1;
     }
     SDL_Window *window = SDL_CreateWindow("Traffic Simulation", 800, 800, 0);
     SDL_Renderer *renderer = SDL_CreateRenderer(window, NULL);
     if (!window || !renderer) {
         printf("Initialization failed: %s\n", SDL_GetError());
+        trafficSimDestroy(ts);
         SDL_Quit();
         return 1;
     }
 
-    // Initialize traffic lights for 4 directions
-    TrafficLight lights[4] = {
-        {265, 210, 0}, // Top-left
-        {505, 210, 1}, // Top-right
-        {265, 510, 0}, // Bottom-left
-        {505, 510, 0}  // Bottom-right
-    };
-
-    Uint32 lastSwitchTime = SDL_GetTicks();
-    int currentGreen = 1;
-    Queue vehicleQueueA[3], vehicleQueueB[3], vehicleQueueC[3], vehicleQueueD[3];
-    for (int i = 0; i < 3; i++) {
-        initQueue(&vehicleQueueA[i]);
-        initQueue(&vehicleQueueB[i]);
-        initQueue(&vehicleQueueC[i]);
-        initQueue(&vehicleQueueD[i]);
-    }
-
     SDL_Event event;
     int running = 1;
-    static Uint32 lastUpdateTime = 0;  // Add this to update the vehicle queue at intervals
+    int paused = 0;
+    int stepRequested = 0;
+    Uint64 previousTime = SDL_GetTicksNS();
+    Uint64 accumulator = 0;  // Scaled real time not yet consumed by simulation ticks
+    Uint64 rewindStep = (Uint64)REWIND_STEP_MS * TRAFFICSIM_TICKS_PER_SECOND / 1000;
+    Uint64 titleSecond = (Uint64)-1;
+    int titleChanged = 1;
+    int vehicleCapacity = 64;
+    TrafficSimVehicle *vehicles = (TrafficSimVehicle *)malloc(vehicleCapacity * sizeof(TrafficSimVehicle));
+    TrafficSimLight lights[4];
 
     // Main loop (focus on vehicle movement and queue management)
     while (running) {
         while (SDL_PollEvent(&event)) {
             if (event.type == SDL_EVENT_QUIT) running = 0;
-        }
-
-        // Switch the traffic light every 2 seconds
-        // TODO: Need to change this logic later.
-        if (SDL_GetTicks() - lastSwitchTime > 20000) {
-            lights[currentGreen].state = 0;  // Set current green light to red
-            currentGreen = (currentGreen + 1) % 4;  // Move to the next light
-            lights[currentGreen].state = 1;  // Set new light to green
-            lastSwitchTime = SDL_GetTicks();
-        }
-
-        updateVehicleQueueFromFile(vehicleQueueA, "RoadA.txt");
-        updateVehicleQueueFromFile(vehicleQueueB, "RoadB.txt");
-        updateVehicleQueueFromFile(vehicleQueueC, "RoadC.txt");
-        updateVehicleQueueFromFile(vehicleQueueD, "RoadD.txt");
-        lastUpdateTime = SDL_GetTicks();
-
-        // Rendering section
-        SDL_SetRenderDrawColor(renderer, 34, 139, 34, 255); // Grass background
-        SDL_RenderClear(renderer);
-
-        // Draw roads and lane markings 
-        SDL_SetRenderDrawColor(renderer, 50, 50, 50, 255); // Gray for roads
-        SDL_FRect horizontalRoad = {0.0f, 300.0f, 800.0f, 200.0f};
-        SDL_RenderFillRect(renderer, &horizontalRoad);
-        SDL_FRect verticalRoad = {300.0f, 0.0f, 200.0f, 800.0f};
-        SDL_RenderFillRect(renderer, &verticalRoad);
-
-        // --- Draw Lane Markings ---
-        SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255); // White for lane markings
-        for (int i = 1; i <= 2; i++) {
-            float laneY = 300.0f + (i * 200.0f / 3);
-            SDL_FRect leftLane = {0.0f, laneY, 300.0f, 2.0f};
-            SDL_RenderFillRect(renderer, &leftLane);
-            SDL_FRect rightLane = {500.0f, laneY, 300.0f, 2.0f};
-            SDL_RenderFillRect(renderer, &rightLane);
-        }
-        for (int i = 1; i <= 2; i++) {
-            float laneX = 300.0f + (i * 200.0f / 3);
-            SDL_FRect upperLane = {laneX, 0.0f, 2.0f, 300.0f};
-            SDL_RenderFillRect(renderer, &upperLane);
-            SDL_FRect lowerLane = {laneX, 500.0f, 2.0f, 300.0f};
-            SDL_RenderFillRect(renderer, &lowerLane);
-        }
-
-        // --- Draw the Priority Lane (Dashed Yellow Line) ---
-        SDL_SetRenderDrawColor(renderer, 255, 255, 0, 255); // Yellow color for dashed line
-        float priorityLaneX = 366.67f + 33.33f;
-        for (float y = 0.0f; y < 300.0f; y += 40.0f) {
-            SDL_FRect dash = {priorityLaneX, y, 5.0f, 20.0f};
-            SDL_RenderFillRect(renderer, &dash);
-        }
-
-
-        // --- Vehicle Queue Processing and Rendering ---
-        Node* temp;
-
-        // Process vehicles from queueA (Road A)
-        for (int i = 0; i < 3; i++) {
-            temp = vehicleQueueA[i].front;
-            while (temp) {
-                if (temp->vehicle.lane == 2) {  // AL2 (second lane)
-                    if (temp == vehicleQueueA[i].front) {
-                        if (temp->vehicle.y < 290) {
-                            temp->vehicle.y += temp->vehicle.speed;
-                        }
-                    }
-                    else {
-                        if (temp->vehicle.y < (temp->prev->vehicle.y) - DISTANCE_BETWEEN_VEHICLES) {
-                            temp->vehicle.y += temp->vehicle.speed;
-                        }
-                    }
-                    if (lights[0].state == 1) {  // Green Light for Road A
-                        if (temp == vehicleQueueA[i].front) {
-                            // Move upto the junction.
-                            if (temp->vehicle.y <= 450) {
-                                temp->vehicle.y += temp->vehicle.speed;
-                            }
-                            else {
-                                if (temp->vehicle.x <= 450) {
-                                    temp->vehicle.x += temp->vehicle.speed;
-                                }
-                                else {
-                                    if (temp->vehicle.y <= 830) {
-                                        temp->vehicle.y += temp->vehicle.speed;
-                                    }
-                                }
-                            }
-                        }
-                        else {
-                            if (temp->vehicle.y <= (temp->prev->vehicle.y) - DISTANCE_BETWEEN_VEHICLES) {
-                                temp->vehicle.y += temp->vehicle.speed;
-                                
-                            }
-                            temp->vehicle.x = temp->prev->vehicle.x;
-                            // else {
-                            //     if (temp->vehicle.x <= (temp->prev->vehicle.x) - DISTANCE_BETWEEN_VEHICLES) {
-                            //         temp->vehicle.x += temp->vehicle.speed;
-                            //     }
-                            //     else {
-                            //         if (temp->vehicle.y <= (temp->prev->vehicle.y) + DISTANCE_BETWEEN_VEHICLES) {
-                            //             temp->vehicle.y += temp->vehicle.speed;
-                            //         }
-                            //     }
-                            // }
-                        }
-                    }
-                } 
-                else if (temp->vehicle.lane == 3) {  // AL3 (third lane)
-                    // Free lane, always allow left turn
-                    if (temp->vehicle.y < LEFT_TURN_THRESHOLD) {
-                        temp->vehicle.y += temp->vehicle.speed;  // Move straight
-                    } else {
-                        temp->vehicle.x += temp->vehicle.speed;  // Move right
-                        // if (temp->vehicle.x >= 800) {
-                        //     dequeue(&vehicleQueueA);
-                        // }
-                    }
+            if (event.type == SDL_EVENT_KEY_DOWN) {
+                Uint64 tick = trafficSimGetTick(ts);
+                switch (event.key.key) {
+                    case SDLK_1: timeScale = 1; break;
+                    case SDLK_2: timeScale = 10; break;
+                    case SDLK_3: timeScale = 100; break;
+                    case SDLK_4: timeScale = TIME_SCALE_MAX; break;
+                    case SDLK_SPACE: paused = !paused; break;
+                    case SDLK_RIGHT:
+                    case SDLK_PERIOD: stepRequested = 1; break;
+                    case SDLK_LEFT:
+                    case SDLK_COMMA:
+                        if (paused && tick > 0) trafficSimRewind(ts, tick - 1);
+                        break;
+                    case SDLK_BACKSPACE:
+                        trafficSimRewind(ts, tick - SDL_min(tick, rewindStep));
+                        break;
+                    default: break;
                 }
-                renderVehicle(renderer, temp->vehicle);
-                temp = temp->next;
+                titleChanged = 1;
             }
         }
 
-        // Process vehicles from queueB (Road B)
-        for (int i = 0; i < 3; i++) {
-            temp = vehicleQueueB[i].front;
-            while (temp) {
-                if (temp->vehicle.lane == 2) {  // BL2 (second lane)
-                    if (temp == vehicleQueueB[i].front) {
-                        if (temp->vehicle.x > 480) {
-                            temp->vehicle.x -= temp->vehicle.speed;
-                        }
-                    }
-                    else {
-                        if (temp->vehicle.x > (temp->prev->vehicle.x) + DISTANCE_BETWEEN_VEHICLES) {
-                            temp->vehicle.x -= temp->vehicle.speed;
-                        }
-                    }
-                    if (lights[1].state == 1) {  // Green Light for Road B
-                        if (temp == vehicleQueueB[i].front) {
-                            // Move upto the junction.
-                            if (temp->vehicle.x >= 350) {
-                                temp->vehicle.x -= temp->vehicle.speed;
-                            }
-                            else {
-                                if (temp->vehicle.y <= 450) {
-                                    temp->vehicle.y += temp->vehicle.speed;
-                                }
-                                else {
-                                    if (temp->vehicle.x >= -30) {
-                                        temp->vehicle.x -= temp->vehicle.speed;
-                                    }
-                                }
-                            }
-                        }
-                        else {
-                            if (temp->vehicle.x >= (temp->prev->vehicle.x) + DISTANCE_BETWEEN_VEHICLES) {
-                                temp->vehicle.x -= temp->vehicle.speed;
-                                
-                            }
-                            temp->vehicle.y = temp->prev->vehicle.y;
-                            // else {
-                            //     if (temp->vehicle.y <= (temp->prev->vehicle.y) - DISTANCE_BETWEEN_VEHICLES) {
-                            //         temp->vehicle.y += temp->vehicle.speed;
-                            //     }
-                            //     else {
-                            //         if (temp->vehicle.x >= (temp->prev->vehicle.x) - DISTANCE_BETWEEN_VEHICLES) {
-                            //             temp->vehicle.x -= temp->vehicle.speed;
-                            //         }
-                            //     }
-                            // }
-                        }
-                    }
-                } else if (temp->vehicle.lane == 3) {  // BL3 (third lane)
-                    // Free lane, always allow left turn
-                    if (temp->vehicle.x > 460) {
-                        temp->vehicle.x -= temp->vehicle.speed;  // Move straight
-                    }
-                    else {
-                        temp->vehicle.y += temp->vehicle.speed;  // Move down
-                        // if (temp->vehicle.y > 800) {
-                        //     dequeue(&vehicleQueueB);
-                        // }
-                    }
-                }
+        Uint64 now = SDL_GetTicksNS();
+        Uint64 elapsed = now - previousTime;
+        previousTime = now;
 
-                renderVehicle(renderer, temp->vehicle);
-                temp = temp->next;
+        if (paused) {
+            // Frozen clock; only explicit single steps advance the simulation
+            accumulator = 0;
+            if (stepRequested) {
+                trafficSimAdvance(ts, 1);
             }
         }
-
-        // Process vehicles from queueC (Road C)
-        for (int i = 0; i < 3; i++) {
-            temp = vehicleQueueC[i].front;
-            while (temp) {
-                if (temp->vehicle.lane == 2) {  // CL2 (second lane)
-                    if (temp == vehicleQueueC[i].front) {
-                        if (temp->vehicle.y > 500) {
-                            temp->vehicle.y -= temp->vehicle.speed;
-                        }
-                    }
-                    else {
-                        if (temp->vehicle.y > (temp->prev->vehicle.y) + DISTANCE_BETWEEN_VEHICLES) {
-                            temp->vehicle.y -= temp->vehicle.speed;
-                        }
-                    }
-                    if (lights[2].state == 1) {  // Green Light for Road C
-                        if (temp == vehicleQueueC[i].front) {
-                            if (temp->vehicle.y >= 350) {
-                                temp->vehicle.y -= temp->vehicle.speed;
-                            }
-                            else {
-                                if (temp->vehicle.x >= 320) {
-                                    temp->vehicle.x -= temp->vehicle.speed;
-                                }
-                                else {
-                                    if (temp->vehicle.y >= -30) {
-                                        temp->vehicle.y -= temp->vehicle.speed;
-                                    }
-                                }
-                            }
-                        }
-                        else {
-                            if (temp->vehicle.y >= (temp->prev->vehicle.y) + DISTANCE_BETWEEN_VEHICLES) {
-                                temp->vehicle.y -= temp->vehicle.speed;
-                                
-                            }
-                            temp->vehicle.x = temp->prev->vehicle.x;
-                            // else {
-                            //     if (temp->vehicle.x >= (temp->prev->vehicle.x) + DISTANCE_BETWEEN_VEHICLES) {
-                            //         temp->vehicle.x -= temp->vehicle.speed;
-                            //     }
-                            //     else {
-                            //         if (temp->vehicle.y >= (temp->prev->vehicle.y) - DISTANCE_BETWEEN_VEHICLES) {
-                            //             temp->vehicle.y -= temp->vehicle.speed;
-                            //         }
-                            //     }
-                            // }
-                        }
-                    }
-                } else if (temp->vehicle.lane == 3) {  // CL3 (third lane)
-                    // Free lane, always allow left turn
-                    if (temp->vehicle.y > 460) {
-                        temp->vehicle.y -= temp->vehicle.speed;  // Move straight
-                    } else {
-                        temp->vehicle.x -= temp->vehicle.speed;  // Move left
-                        // if (temp->vehicle.x < -20) {
-                        //     dequeue(&vehicleQueueC);
-                        // }
-                    }
-                }
-
-                renderVehicle(renderer, temp->vehicle);
-                temp = temp->next;
-            }
+        else if (timeScale == TIME_SCALE_MAX) {
+            // Tick for a fixed slice of real time, then show the final state
+            do {
+                trafficSimAdvance(ts, (Uint64)-1);
+            } while (SDL_GetTicksNS() - now < MAX_SPEED_FRAME_NS);
+            previousTime = SDL_GetTicksNS();
         }
-
-        // Process vehicles from queueD (Road D)
-        for (int i = 0; i < 3; i++) {
-            temp = vehicleQueueD[i].front;
-            while (temp) {
-                if (temp->vehicle.lane == 2) {  // DL2 (second lane)
-                    if (temp == vehicleQueueD[i].front) {
-                        if (temp->vehicle.x < 290) {
-                            temp->vehicle.x += temp->vehicle.speed;
-                        }
-                    }
-                    else {
-                        if (temp->vehicle.x < (temp->prev->vehicle.x) - DISTANCE_BETWEEN_VEHICLES) {
-                            temp->vehicle.x += temp->vehicle.speed;
-                        }
-                    }
-                    if (lights[3].state == 1) {  // Green Light for Road D
-                        if (temp == vehicleQueueD[i].front) {
-                            if (temp->vehicle.x <= 450) {
-                                temp->vehicle.x += temp->vehicle.speed;
-                            }
-                            else {
-                                if (temp->vehicle.y >= 350) {
-                                    temp->vehicle.y -= temp->vehicle.speed;
-                                }
-                                else {
-                                    if (temp->vehicle.x <= 830) {
-                                        temp->vehicle.x += temp->vehicle.speed;
-                                    }
-                                }
-                            }
-                        }
-                        else {
-                            if (temp->vehicle.x <= (temp->prev->vehicle.x) - DISTANCE_BETWEEN_VEHICLES) {
-                                temp->vehicle.x += temp->vehicle.speed;
-                            }
-                            temp->vehicle.y = temp->prev->vehicle.y;
-                            // else {
-                            //     if (temp->vehicle.y >= (temp->prev->vehicle.y) + DISTANCE_BETWEEN_VEHICLES) {
-                            //         temp->vehicle.y -= temp->vehicle.speed;
-                            //     }
-                            //     else {
-                            //         if (temp->vehicle.x <= (temp->prev->vehicle.x) + DISTANCE_BETWEEN_VEHICLES) {
-                            //             temp->vehicle.x += temp->vehicle.speed;
-                            //         }
-                            //     }
-                            // }
-                        }
-                    }
-                } else if (temp->vehicle.lane == 3) {  // DL3 (third lane)
-                    // Free lane, always allow left turn
-                    if (temp->vehicle.x < 330) {
-                        temp->vehicle.x += temp->vehicle.speed;  // Move straight
-                    } else {
-                        temp->vehicle.y -= temp->vehicle.speed;  // Move up
-                        // if (temp->vehicle.y < -20) {
-                        //     dequeue(&vehicleQueueD);
-                        // }
-                    }
-                }
-
-                renderVehicle(renderer, temp->vehicle);
-                temp = temp->next;
+        else {
+            // Run as many fixed ticks as the scaled elapsed real time covers. Idle stretches
+            // are covered in one jump; the clock still keeps to the scale.
+            accumulator += elapsed * (Uint64)timeScale;
+            if (accumulator > MAX_CATCHUP_NS * (Uint64)timeScale) {
+                accumulator = MAX_CATCHUP_NS * (Uint64)timeScale;
+            }
+            while (accumulator >= SIM_TICK_NS) {
+                accumulator -= trafficSimAdvance(ts, accumulator / SIM_TICK_NS) * SIM_TICK_NS;
             }
         }
+        stepRequested = 0;
 
-        // Render all traffic lights
-        for (int i = 0; i < 4; i++) {
-            renderTrafficLight(renderer, lights[i]);
+        Uint64 second = trafficSimGetTick(ts) / TRAFFICSIM_TICKS_PER_SECOND;
+        if (titleChanged || second != titleSecond) {
+            updateWindowTitle(window, ts, timeScale, paused);
+            titleSecond = second;
+            titleChanged = 0;
         }
 
+        int vehicleCount = trafficSimGetVehicles(ts, vehicles, vehicleCapacity);
+        if (vehicleCount > vehicleCapacity) {
+            vehicleCapacity = vehicleCount * 2;
+            vehicles = (TrafficSimVehicle *)realloc(vehicles, vehicleCapacity * sizeof(TrafficSimVehicle));
+            vehicleCount = trafficSimGetVehicles(ts, vehicles, vehicleCapacity);
+        }
+        trafficSimGetLights(ts, lights);
+        renderSimulation(renderer, vehicles, vehicleCount, lights);
         SDL_RenderPresent(renderer);
     }
 
+    if (saveFile) {
+        trafficSimSave(ts, saveFile);
+    }
+
     // Cleanup
+    free(vehicles);
+    trafficSimDestroy(ts);
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
     SDL_Quit();
     return 0;
-}
\ No newline at end of file
+}
@@ -68,7 +68,7 @@ void generateVehicles(const char *laneFile, int vehicleCount, int road) {
                 break;
         }
 
-        float speed = 0.09;
+        float speed = 90.0f; // Pixels per simulated second
         fprintf(fp, "%d,%d,%.2f,%.2f,%.2f\n", road, lane, x, y, speed);
     }
 
@@ -0,0 +1,5363 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+typedef SOCKET NetSocket;
+#define closeNetSocket closesocket
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <signal.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+typedef int NetSocket;
+#define INVALID_SOCKET (-1)
+#define closeNetSocket close
+#endif
+#include <SDL3/SDL.h>
+#include <SDL3/SDL_intrin.h>
+#include "trafficsim.h"
+
+#define LEFT_TURN_THRESHOLD 310.0  // The threshold for making the left turn
+#define TURN_DISTANCE 50.0        // Distance to move after making the left turn
+#define TURN_ANGLE 90             // The angle of the left turn
+#define PRIORITY_LANE_THRESHOLD 10 // Number of vehicles to activate priority lane
+#define PRIORITY_LANE_RELEASE 5    // Number of vehicles below which the priority lane gives up priority
+#define PRIORITY_ROAD 0            // Road A: its lane 2 is the priority lane
+#define DISTANCE_BETWEEN_VEHICLES 40.0
+#define MAX_NUMBER_OF_VEHICLES 15 // Default lane capacity; must exceed the priority threshold
+
+#define SIM_TICKS_PER_SECOND TRAFFICSIM_TICKS_PER_SECOND         // Fixed simulation rate
+#define SIM_DT (1.0f / SIM_TICKS_PER_SECOND)                     // Seconds advanced per tick
+#define LIGHT_SWITCH_INTERVAL_MS 20000        // Default longest green (every green with fixed timing)
+#define MIN_GREEN_MS 5000                     // Default shortest green under adaptive timing
+#define SERVICE_TIME_MS 2000                  // Default green time per waiting vehicle (0 = fixed timing)
+#define AMBER_MS 3000                         // Default amber after each green
+#define ALL_RED_MS 1000                       // Default all-red interval before the next green
+#define ARRIVAL_POLL_INTERVAL_MS 100          // Simulated time between lane file polls
+#define SPAWN_INTERVAL_MS 3000                // Built-in generator: time between batches
+#define SPAWN_BATCH_MAX 3                     // Built-in generator: vehicles per batch (1..max)
+#define VEHICLE_SPEED 90.0f                   // Built-in generator: pixels per second
+#define EXIT_MARGIN 20.0f                     // Distance past the screen edge where vehicles leave
+#define TRAVEL_TIME_BINS 1024                 // One-second bins of time in system; the last is open
+#define REWIND_KEYFRAME_MS 5000               // Simulated time between rewind keyframes
+
+// Intelligent Driver Model parameters (pixels and seconds); length + minimum gap
+// equals DISTANCE_BETWEEN_VEHICLES, so both models queue with the same spacing
+#define VEHICLE_LENGTH 30.0f           // Front-to-rear length used for gaps
+#define IDM_MIN_GAP 10.0f              // s0: gap kept when standing
+#define IDM_TIME_HEADWAY 1.2f          // T: desired time gap to the leader
+#define IDM_MAX_ACCELERATION 60.0f     // a: pixels per second squared
+#define IDM_COMFORT_DECELERATION 90.0f // b: pixels per second squared
+#define IDM_FREE_ROAD 1.0e9f           // Obstacle distance meaning "nothing ahead"
+#define IDM_BLOCK 64                   // Vehicles per batch in idmLane()
+#define IDM_SETTLE_SPEED 0.5f          // Slower than this, within IDM_SETTLE_GAP of the
+#define IDM_SETTLE_GAP 0.5f            // standing gap, a queued vehicle is put to sleep
+
+// Junction box reservations: the box is split into square cells, and time into slots
+#define JUNCTION_LEFT 300.0f           // Junction box position and size on screen
+#define JUNCTION_TOP 300.0f
+#define JUNCTION_SIZE 200.0f
+#define RESERVATION_GRID 8             // Cells per side of the box
+#define RESERVATION_CELLS (RESERVATION_GRID * RESERVATION_GRID)
+#define RESERVATION_SLOT_TICKS 2       // Ticks per time slot
+#define RESERVATION_HORIZON 512        // Slots booked ahead (about 17 s)
+#define RESERVATION_PAD_SLOTS 1        // Extra slots held before and after each use of a cell
+#define RESERVATION_REQUEST_DISTANCE 60.0f // Distance before the box where vehicles ask for a slot
+
+// Spatial grid used for proximity queries over the whole world (screen plus exit margins)
+#define SPATIAL_CELL_SIZE 40.0f        // Should be at least the usual query radius
+#define SPATIAL_ORIGIN -100.0f         // World covered: [ORIGIN, ORIGIN + EXTENT) on both axes
+#define SPATIAL_EXTENT 1000.0f
+
+#define FOLLOW_SIMPLE TRAFFICSIM_FOLLOW_SIMPLE  // Move at full speed while the gap exceeds DISTANCE_BETWEEN_VEHICLES
+#define FOLLOW_IDM TRAFFICSIM_FOLLOW_IDM        // Intelligent Driver Model along each lane's route
+
+static const int WIDTH = 800, HEIGHT = 800;
+
+typedef struct {
+    int x, y;   // Position on screen
+    int state;  // 0 = Red, 1 = Green, 2 = Amber (stop as on red)
+} TrafficLight;
+
+typedef struct {
+    float x, y;   // Position of vehicle
+    float speed;  // Pixels per simulated second
+    int road;  
+    int lane;     // Lane index (0 = AL1, 1 = AL2, 2 = AL3, etc.)
+    int hasTurnedLeft;  // Flag to track if the vehicle has turned left
+    Uint64 arrivalTick; // Simulation tick at which the vehicle joined its queue
+    float distance;     // Distance travelled along the lane's route (IDM)
+    float velocity;     // Current speed in pixels per second (IDM)
+    Uint32 id;          // Unique per run; owner tag in the reservation table
+    int committed;      // Holds a junction reservation and is driving to it
+} Vehicle;
+
+// Waypoints a lane's vehicles follow through the junction
+typedef struct {
+    float x, y;
+} Waypoint;
+
+typedef struct {
+    Waypoint points[4];
+    int count;
+    float stopLine;  // Route distance where vehicles wait on red (-IDM_FREE_ROAD = never)
+} Route;
+
+// Routes for lane 2 and lane 3 of roads A-D, matching the turns made by updateRoadA..D
+static const Route routes[4][2] = {
+    { { {{385, 0}, {385, 450}, {450, 450}, {450, 850}}, 4, 290 },     // AL2
+      { {{450, 0}, {450, 310}, {850, 310}}, 3, -IDM_FREE_ROAD } },     // AL3
+    { { {{750, 385}, {350, 385}, {350, 450}, {-50, 450}}, 4, 270 },   // BL2
+      { {{750, 450}, {460, 450}, {460, 850}}, 3, -IDM_FREE_ROAD } },   // BL3
+    { { {{385, 750}, {385, 350}, {320, 350}, {320, -50}}, 4, 250 },   // CL2
+      { {{320, 750}, {320, 460}, {-50, 460}}, 3, -IDM_FREE_ROAD } },   // CL3
+    { { {{25, 385}, {450, 385}, {450, 350}, {850, 350}}, 4, 265 },    // DL2
+      { {{25, 320}, {330, 320}, {330, -50}}, 3, -IDM_FREE_ROAD } },    // DL3
+};
+
+// Distance along the route's first leg of a point near it (used for new arrivals)
+static float projectOntoRoute(const Route *route, float x, float y) {
+    float dx = route->points[1].x - route->points[0].x;
+    float dy = route->points[1].y - route->points[0].y;
+    float length = sqrtf(dx * dx + dy * dy);
+    return ((x - route->points[0].x) * dx + (y - route->points[0].y) * dy) / length;
+}
+
+// Screen position of the point at the given distance along the route
+static void placeOnRoute(const Route *route, float distance, float *x, float *y) {
+    for (int i = 1; i < route->count; i++) {
+        float dx = route->points[i].x - route->points[i - 1].x;
+        float dy = route->points[i].y - route->points[i - 1].y;
+        float length = fabsf(dx) + fabsf(dy);  // Legs are axis-aligned
+        if (distance <= length || i == route->count - 1) {
+            *x = route->points[i - 1].x + dx * distance / length;
+            *y = route->points[i - 1].y + dy * distance / length;
+            return;
+        }
+        distance -= length;
+    }
+}
+
+// Route distance at which removeExitedVehicles() drops a vehicle, found a pixel at a time
+static float routeExitDistance(const Route *route) {
+    float x = 0.0f, y = 0.0f;
+    float s = 0.0f;
+    for (;; s += 1.0f) {
+        placeOnRoute(route, s, &x, &y);
+        if (x < -EXIT_MARGIN || x > WIDTH + EXIT_MARGIN || y < -EXIT_MARGIN || y > HEIGHT + EXIT_MARGIN) {
+            return s;
+        }
+    }
+}
+
+// Queue structure: vehicles are kept front to rear in contiguous arrays, one per
+// field, starting at index head, so a whole lane can be processed as vectors
+typedef struct {
+    float *x, *y;          // Positions
+    float *speed;          // Pixels per simulated second
+    Uint64 *arrivalTick;   // Simulation tick at which each vehicle joined
+    float *distance;       // Distance along the lane's route (IDM)
+    float *velocity;       // Current speed (IDM)
+    Uint32 *id;            // Vehicle ids
+    Uint8 *committed;      // 1 while driving through the junction on a reservation
+    int head;              // Array index of the front vehicle
+    int count;             // To track the number of vehicles in the queue
+    int capacity;          // Slots allocated in each array
+    int limit;             // Vehicles allowed before the lane counts as full
+    int asleep;            // Front vehicles at rest behind a red light, skipped each tick
+    int crossed;           // Lane 2: front vehicles past the stop line, kept until off screen
+} Queue;
+
+static void initQueue(Queue* q) {
+    q->x = q->y = q->speed = NULL;
+    q->arrivalTick = NULL;
+    q->distance = q->velocity = NULL;
+    q->id = NULL;
+    q->committed = NULL;
+    q->head = 0;
+    q->count = 0;
+    q->capacity = 0;
+    q->limit = MAX_NUMBER_OF_VEHICLES;
+    q->asleep = 0;
+    q->crossed = 0;
+}
+
+static void freeQueue(Queue* q) {
+    free(q->x);
+    free(q->y);
+    free(q->speed);
+    free(q->arrivalTick);
+    free(q->distance);
+    free(q->velocity);
+    free(q->id);
+    free(q->committed);
+    initQueue(q);
+}
+
+static int isQueueFull(Queue* q) {
+    return q->count >= q->limit;
+}
+
+// Make room for one more vehicle at the rear: slide the queue back to index 0
+// when at least half the arrays are dead space, otherwise double them
+static void reserveQueueSlot(Queue* q) {
+    if (q->head + q->count < q->capacity) return;
+
+    if (q->head > 0 && q->head >= q->count) {
+        memmove(q->x, q->x + q->head, q->count * sizeof(float));
+        memmove(q->y, q->y + q->head, q->count * sizeof(float));
+        memmove(q->speed, q->speed + q->head, q->count * sizeof(float));
+        memmove(q->arrivalTick, q->arrivalTick + q->head, q->count * sizeof(Uint64));
+        memmove(q->distance, q->distance + q->head, q->count * sizeof(float));
+        memmove(q->velocity, q->velocity + q->head, q->count * sizeof(float));
+        memmove(q->id, q->id + q->head, q->count * sizeof(Uint32));
+        memmove(q->committed, q->committed + q->head, q->count * sizeof(Uint8));
+        q->head = 0;
+        return;
+    }
+
+    q->capacity = q->capacity ? q->capacity * 2 : 8;
+    q->x = (float*)realloc(q->x, q->capacity * sizeof(float));
+    q->y = (float*)realloc(q->y, q->capacity * sizeof(float));
+    q->speed = (float*)realloc(q->speed, q->capacity * sizeof(float));
+    q->arrivalTick = (Uint64*)realloc(q->arrivalTick, q->capacity * sizeof(Uint64));
+    q->distance = (float*)realloc(q->distance, q->capacity * sizeof(float));
+    q->velocity = (float*)realloc(q->velocity, q->capacity * sizeof(float));
+    q->id = (Uint32*)realloc(q->id, q->capacity * sizeof(Uint32));
+    q->committed = (Uint8*)realloc(q->committed, q->capacity * sizeof(Uint8));
+}
+
+static void enqueue(Queue* q, Vehicle v) {
+    if (!isQueueFull(q)) {
+        reserveQueueSlot(q);
+        int rear = q->head + q->count;
+        q->x[rear] = v.x;
+        q->y[rear] = v.y;
+        q->speed[rear] = v.speed;
+        q->arrivalTick[rear] = v.arrivalTick;
+        q->distance[rear] = v.distance;
+        q->velocity[rear] = v.velocity;
+        q->id[rear] = v.id;
+        q->committed[rear] = (Uint8)v.committed;
+        q->count++;  // Increment vehicle count
+    }
+}
+
+// Make dst an independent copy of src, front vehicle at index 0
+static void copyQueue(Queue *dst, const Queue *src) {
+    int h = src->head, n = src->count;
+    initQueue(dst);
+    dst->limit = src->limit;
+    dst->asleep = src->asleep;
+    dst->crossed = src->crossed;
+    while (dst->count < n) {
+        reserveQueueSlot(dst);
+        dst->count++;
+    }
+    if (n == 0) return;
+    memcpy(dst->x, src->x + h, n * sizeof(float));
+    memcpy(dst->y, src->y + h, n * sizeof(float));
+    memcpy(dst->speed, src->speed + h, n * sizeof(float));
+    memcpy(dst->arrivalTick, src->arrivalTick + h, n * sizeof(Uint64));
+    memcpy(dst->distance, src->distance + h, n * sizeof(float));
+    memcpy(dst->velocity, src->velocity + h, n * sizeof(float));
+    memcpy(dst->id, src->id + h, n * sizeof(Uint32));
+    memcpy(dst->committed, src->committed + h, n * sizeof(Uint8));
+}
+
+// Lane-advance kernel. Vehicle i moves dir * speed * dt along the lane if dir * pos[i]
+// is below its limit: frontLimit for vehicle 0, otherwise dir * pos[i - 1] - gap.
+// Every vehicle sees its leader's position from before the call, which is what lets
+// the SIMD versions work on whole blocks; blocks run back to front so no leader is
+// written before its follower has read it.
+typedef void (*LaneAdvanceKernel)(float *pos, const float *speed, int n, float dir,
+                                  float frontLimit, float gap, float dt);
+
+static void advanceLaneScalar(float *pos, const float *speed, int n, float dir,
+                       float frontLimit, float gap, float dt) {
+    for (int i = n - 1; i >= 0; i--) {
+        float limit = (i == 0) ? frontLimit : dir * pos[i - 1] - gap;
+        if (dir * pos[i] < limit) {
+            pos[i] += dir * speed[i] * dt;
+        }
+    }
+}
+
+#ifdef SDL_SSE_INTRINSICS
+static SDL_TARGETING("sse") void advanceLaneSSE(float *pos, const float *speed, int n, float dir,
+                                         float frontLimit, float gap, float dt) {
+    const __m128 vdir = _mm_set1_ps(dir);
+    const __m128 vgap = _mm_set1_ps(gap);
+    const __m128 vdt = _mm_set1_ps(dt);
+    int i = n - 4;
+    for (; i >= 1; i -= 4) {
+        __m128 p = _mm_loadu_ps(pos + i);
+        __m128 limit = _mm_sub_ps(_mm_mul_ps(vdir, _mm_loadu_ps(pos + i - 1)), vgap);
+        __m128 move = _mm_cmplt_ps(_mm_mul_ps(vdir, p), limit);
+        __m128 step = _mm_mul_ps(_mm_mul_ps(vdir, _mm_loadu_ps(speed + i)), vdt);
+        _mm_storeu_ps(pos + i, _mm_add_ps(p, _mm_and_ps(move, step)));
+    }
+    advanceLaneScalar(pos, speed, i + 4, dir, frontLimit, gap, dt);
+}
+#endif
+
+#ifdef SDL_AVX2_INTRINSICS
+static SDL_TARGETING("avx2") void advanceLaneAVX2(float *pos, const float *speed, int n, float dir,
+                                           float frontLimit, float gap, float dt) {
+    const __m256 vdir = _mm256_set1_ps(dir);
+    const __m256 vgap = _mm256_set1_ps(gap);
+    const __m256 vdt = _mm256_set1_ps(dt);
+    int i = n - 8;
+    for (; i >= 1; i -= 8) {
+        __m256 p = _mm256_loadu_ps(pos + i);
+        __m256 limit = _mm256_sub_ps(_mm256_mul_ps(vdir, _mm256_loadu_ps(pos + i - 1)), vgap);
+        __m256 move = _mm256_cmp_ps(_mm256_mul_ps(vdir, p), limit, _CMP_LT_OQ);
+        __m256 step = _mm256_mul_ps(_mm256_mul_ps(vdir, _mm256_loadu_ps(speed + i)), vdt);
+        _mm256_storeu_ps(pos + i, _mm256_add_ps(p, _mm256_and_ps(move, step)));
+    }
+    advanceLaneScalar(pos, speed, i + 8, dir, frontLimit, gap, dt);
+}
+#endif
+
+static LaneAdvanceKernel advanceLane = advanceLaneScalar;
+
+// Pick the widest lane-advance kernel the CPU supports, or the one named by
+// --kernel ("scalar", "sse", "avx2"). Returns the name of the kernel in use.
+static const char *selectLaneKernel(const char *requested) {
+    int any = (requested == NULL);
+#ifdef SDL_AVX2_INTRINSICS
+    if ((any || strcmp(requested, "avx2") == 0) && SDL_HasAVX2()) {
+        advanceLane = advanceLaneAVX2;
+        return "avx2";
+    }
+#endif
+#ifdef SDL_SSE_INTRINSICS
+    if ((any || strcmp(requested, "sse") == 0) && SDL_HasSSE()) {
+        advanceLane = advanceLaneSSE;
+        return "sse";
+    }
+#endif
+    advanceLane = advanceLaneScalar;
+    return "scalar";
+}
+
+// IDM acceleration on an empty road
+static inline float idmFreeAcceleration(float velocity, float desired) {
+    float ratio = velocity / desired;
+    float ratio2 = ratio * ratio;
+    return IDM_MAX_ACCELERATION * (1.0f - ratio2 * ratio2);
+}
+
+// Advance one vehicle by one tick under acceleration a, stopping rather than reversing
+static inline void integrateMotion(float *distance, float *velocity, float a, float dt) {
+    float v = *velocity + a * dt;
+    if (v < 0.0f) {
+        // Comes to a stop within this tick
+        *distance -= 0.5f * *velocity * *velocity / a;
+        *velocity = 0.0f;
+    }
+    else {
+        *distance += 0.5f * (*velocity + v) * dt;
+        *velocity = v;
+    }
+}
+
+// Advance lane 2 of a road. On red the first lane->asleep vehicles are at rest behind the
+// stop line and are skipped; vehicles that come to rest behind them join the sleeping
+// platoon. Anything else (green, or canSleep == 0) wakes the whole lane.
+static void advanceWaitingLane(Queue *lane, float *pos, const float *speed, float dir, float frontLimit,
+                        float gap, int canSleep, float dt) {
+    int n = lane->count;
+    int k = canSleep ? lane->asleep : 0;
+    float limit = (k == 0) ? frontLimit : dir * pos[k - 1] - gap;
+    advanceLane(pos + k, speed + k, n - k, dir, limit, gap, dt);
+    if (!canSleep) {
+        lane->asleep = 0;
+        return;
+    }
+    while (k < n && dir * pos[k] >= ((k == 0) ? frontLimit : dir * pos[k - 1] - gap)) {
+        k++;
+    }
+    lane->asleep = k;
+}
+
+// Intelligent Driver Model for one lane. distance/velocity/desired hold route position,
+// speed and desired speed from front to rear. Each vehicle follows the rear of the vehicle
+// ahead (for the first one, an obstacle at leadDistance moving at leadVelocity, or nothing
+// if leadDistance is IDM_FREE_ROAD); any vehicle not yet past stopLine also treats the line
+// as a standing obstacle.
+// Committed vehicles hold a junction reservation and drive the free-road profile it was
+// booked with, ignoring both. Accelerations for a block are computed from the state at the
+// start of the tick before the block is integrated, and blocks run back to front, so every
+// vehicle reacts to its leader's old state.
+static void idmLane(float *distance, float *velocity, const float *desired, const Uint8 *committed,
+             int n, float leadDistance, float leadVelocity, float stopLine, float dt) {
+    const float brakingTerm = 2.0f * sqrtf(IDM_MAX_ACCELERATION * IDM_COMFORT_DECELERATION);
+    float accel[IDM_BLOCK];
+
+    for (int end = n; end > 0; end -= IDM_BLOCK) {
+        int start = end > IDM_BLOCK ? end - IDM_BLOCK : 0;
+
+        for (int i = start; i < end; i++) {
+            if (committed[i]) {
+                accel[i - start] = idmFreeAcceleration(velocity[i], desired[i]);
+                continue;
+            }
+            float leadPos = (i == 0) ? leadDistance : distance[i - 1] - VEHICLE_LENGTH;
+            float leadVel = (i == 0) ? (leadDistance < IDM_FREE_ROAD ? leadVelocity : velocity[i]) : velocity[i - 1];
+            if (distance[i] <= stopLine && stopLine + IDM_MIN_GAP < leadPos) {
+                leadPos = stopLine + IDM_MIN_GAP;
+                leadVel = 0.0f;
+            }
+            float gap = fmaxf(leadPos - distance[i], 0.1f);
+            float v = velocity[i];
+            float desiredGap = IDM_MIN_GAP + fmaxf(0.0f, v * IDM_TIME_HEADWAY + v * (v - leadVel) / brakingTerm);
+            float ratio = v / desired[i];
+            float ratio2 = ratio * ratio;
+            float gapRatio = desiredGap / gap;
+            accel[i - start] = IDM_MAX_ACCELERATION * (1.0f - ratio2 * ratio2 - gapRatio * gapRatio);
+        }
+
+        for (int i = start; i < end; i++) {
+            integrateMotion(&distance[i], &velocity[i], accel[i - start], dt);
+        }
+    }
+}
+
+// Extend the sleeping platoon at the front of an IDM lane. IDM only approaches the standing
+// gap asymptotically, so a vehicle behind a sleeping one (or the stop line) that is nearly
+// stopped and nearly at that gap is stopped outright and joins. Returns the new count.
+static int settleQueuedVehicles(const float *distance, float *velocity, const Uint8 *committed,
+                         int n, int asleep, float stopLine) {
+    int k = asleep;
+    while (k < n && velocity[k] < IDM_SETTLE_SPEED && !committed[k]) {
+        float leadPos = (k == 0) ? IDM_FREE_ROAD : distance[k - 1] - VEHICLE_LENGTH;
+        if (distance[k] <= stopLine && stopLine + IDM_MIN_GAP < leadPos) {
+            leadPos = stopLine + IDM_MIN_GAP;
+        }
+        if (leadPos - distance[k] > IDM_MIN_GAP + IDM_SETTLE_GAP) break;
+        velocity[k] = 0.0f;
+        k++;
+    }
+    return k;
+}
+
+// Space-time reservations for the junction box. Each cell has a ring of time slots; an
+// entry counts only while its slot number matches, so old bookings expire by themselves.
+typedef struct {
+    Uint32 owner[RESERVATION_CELLS][RESERVATION_HORIZON]; // Vehicle id holding the cell
+    Uint32 slot[RESERVATION_CELLS][RESERVATION_HORIZON];  // Absolute slot the entry is for
+    float boxEntry[4][2];  // Route distance where each lane's vehicles reach the box
+    float boxExit[4][2];   // Route distance where they have fully left it
+    SDL_AtomicInt refs;    // Simulations sharing the table; forks copy it before booking
+} ReservationTable;
+
+// Call fn(table, cell, ...) for each box cell under a vehicle drawn at (x, y); returns 0
+// as soon as fn does
+static int forEachCellUnder(float x, float y, int (*fn)(ReservationTable *, int, Uint32, Uint32),
+                     ReservationTable *table, Uint32 slot, Uint32 id) {
+    int left = (int)floorf((x - JUNCTION_LEFT) / (JUNCTION_SIZE / RESERVATION_GRID));
+    int right = (int)floorf((x + 30.0f - JUNCTION_LEFT) / (JUNCTION_SIZE / RESERVATION_GRID));
+    int top = (int)floorf((y - JUNCTION_TOP) / (JUNCTION_SIZE / RESERVATION_GRID));
+    int bottom = (int)floorf((y + 20.0f - JUNCTION_TOP) / (JUNCTION_SIZE / RESERVATION_GRID));
+    if (left < 0) left = 0;
+    if (top < 0) top = 0;
+    if (right > RESERVATION_GRID - 1) right = RESERVATION_GRID - 1;
+    if (bottom > RESERVATION_GRID - 1) bottom = RESERVATION_GRID - 1;
+    for (int cy = top; cy <= bottom; cy++) {
+        for (int cx = left; cx <= right; cx++) {
+            if (!fn(table, cy * RESERVATION_GRID + cx, slot, id)) return 0;
+        }
+    }
+    return 1;
+}
+
+// O(1): is the cell booked by someone other than id during the slot?
+static int isCellFree(ReservationTable *table, int cell, Uint32 slot, Uint32 id) {
+    int k = slot % RESERVATION_HORIZON;
+    return table->slot[cell][k] != slot || table->owner[cell][k] == id;
+}
+
+static int bookCell(ReservationTable *table, int cell, Uint32 slot, Uint32 id) {
+    int k = slot % RESERVATION_HORIZON;
+    table->slot[cell][k] = slot;
+    table->owner[cell][k] = id;
+    return 1;
+}
+
+static int vehicleInBox(float x, float y) {
+    return x + 30.0f >= JUNCTION_LEFT && x <= JUNCTION_LEFT + JUNCTION_SIZE &&
+           y + 20.0f >= JUNCTION_TOP && y <= JUNCTION_TOP + JUNCTION_SIZE;
+}
+
+static ReservationTable *createReservationTable(void) {
+    ReservationTable *table = (ReservationTable *)calloc(1, sizeof(ReservationTable));
+    // Slot 0 entries must not look current at tick 0
+    for (int c = 0; c < RESERVATION_CELLS; c++) {
+        for (int k = 0; k < RESERVATION_HORIZON; k++) {
+            table->slot[c][k] = (Uint32)-1;
+        }
+    }
+    // Find where each route enters and leaves the box, to the nearest pixel
+    for (int road = 0; road < 4; road++) {
+        for (int l = 0; l < 2; l++) {
+            const Route *route = &routes[road][l];
+            float length = 0.0f;
+            for (int i = 1; i < route->count; i++) {
+                length += fabsf(route->points[i].x - route->points[i - 1].x) +
+                          fabsf(route->points[i].y - route->points[i - 1].y);
+            }
+            table->boxEntry[road][l] = IDM_FREE_ROAD;
+            table->boxExit[road][l] = 0.0f;
+            for (float s = 0.0f; s <= length; s += 1.0f) {
+                float x, y;
+                placeOnRoute(route, s, &x, &y);
+                if (vehicleInBox(x, y)) {
+                    if (table->boxEntry[road][l] == IDM_FREE_ROAD) table->boxEntry[road][l] = s;
+                    table->boxExit[road][l] = s;
+                }
+            }
+        }
+    }
+    SDL_SetAtomicInt(&table->refs, 1);
+    return table;
+}
+
+static ReservationTable *shareReservationTable(ReservationTable *table) {
+    SDL_AddAtomicInt(&table->refs, 1);
+    return table;
+}
+
+static void releaseReservationTable(ReservationTable *table) {
+    if (table && SDL_AddAtomicInt(&table->refs, -1) == 1) {
+        free(table);
+    }
+}
+
+// Try to book every cell the vehicle will cover on its way through the box, assuming it
+// drives the free-road profile from its current state starting this tick. Books nothing
+// and returns 0 if any cell is taken.
+static int tryReserveCrossing(ReservationTable *table, int road, int l, float distance, float velocity,
+                       float desired, Uint32 id, Uint64 tick) {
+    const Route *route = &routes[road][l];
+    float exit = table->boxExit[road][l];
+
+    for (int pass = 0; pass < 2; pass++) {
+        int (*fn)(ReservationTable *, int, Uint32, Uint32) = pass == 0 ? isCellFree : bookCell;
+        float s = distance;
+        float v = velocity;
+        Uint64 t = tick;
+        while (s <= exit) {
+            if ((t - tick) / RESERVATION_SLOT_TICKS >= RESERVATION_HORIZON - 2 * RESERVATION_PAD_SLOTS) {
+                return 0;  // Crossing would not finish inside the booking horizon
+            }
+            float x, y;
+            placeOnRoute(route, s, &x, &y);
+            if (vehicleInBox(x, y)) {
+                Uint32 slot = (Uint32)(t / RESERVATION_SLOT_TICKS);
+                for (Uint32 p = slot - RESERVATION_PAD_SLOTS; p != slot + RESERVATION_PAD_SLOTS + 1; p++) {
+                    if (!forEachCellUnder(x, y, fn, table, p, id)) return 0;
+                }
+            }
+            integrateMotion(&s, &v, idmFreeAcceleration(v, desired), SIM_DT);
+            t++;
+        }
+    }
+    return 1;
+}
+
+// Uniform grid over the world, rebuilt from scratch with a counting sort. Points in cell c
+// are entries[cellStart[c] .. cellStart[c + 1]); positions outside the world go to the
+// nearest border cell. Each point carries a tag chosen by the caller.
+typedef struct {
+    int columns;       // Cells per side
+    int *cellStart;    // columns * columns + 1 offsets into entries
+    int *entries;      // Point indices grouped by cell
+    int *cellOf;       // Cell of each point (scratch for the build)
+    float *x, *y;      // Point positions
+    Uint32 *tag;
+    int count;
+    int capacity;
+    int *neighbours;       // Results of the audit's radius queries
+    int neighbourCapacity;
+} SpatialGrid;
+
+static SpatialGrid *createSpatialGrid(void) {
+    SpatialGrid *grid = (SpatialGrid *)calloc(1, sizeof(SpatialGrid));
+    grid->columns = (int)ceilf(SPATIAL_EXTENT / SPATIAL_CELL_SIZE);
+    grid->cellStart = (int *)calloc(grid->columns * grid->columns + 1, sizeof(int));
+    return grid;
+}
+
+static void destroySpatialGrid(SpatialGrid *grid) {
+    if (!grid) return;
+    free(grid->cellStart);
+    free(grid->entries);
+    free(grid->cellOf);
+    free(grid->x);
+    free(grid->y);
+    free(grid->tag);
+    free(grid->neighbours);
+    free(grid);
+}
+
+static int spatialCellIndex(const SpatialGrid *grid, float x, float y) {
+    int cx = (int)floorf((x - SPATIAL_ORIGIN) / SPATIAL_CELL_SIZE);
+    int cy = (int)floorf((y - SPATIAL_ORIGIN) / SPATIAL_CELL_SIZE);
+    cx = cx < 0 ? 0 : (cx >= grid->columns ? grid->columns - 1 : cx);
+    cy = cy < 0 ? 0 : (cy >= grid->columns ? grid->columns - 1 : cy);
+    return cy * grid->columns + cx;
+}
+
+// Start a rebuild: forget all points
+static void clearSpatialGrid(SpatialGrid *grid) {
+    grid->count = 0;
+}
+
+static void addSpatialPoint(SpatialGrid *grid, float x, float y, Uint32 tag) {
+    if (grid->count == grid->capacity) {
+        grid->capacity = grid->capacity ? grid->capacity * 2 : 64;
+        grid->entries = (int *)realloc(grid->entries, grid->capacity * sizeof(int));
+        grid->cellOf = (int *)realloc(grid->cellOf, grid->capacity * sizeof(int));
+        grid->x = (float *)realloc(grid->x, grid->capacity * sizeof(float));
+        grid->y = (float *)realloc(grid->y, grid->capacity * sizeof(float));
+        grid->tag = (Uint32 *)realloc(grid->tag, grid->capacity * sizeof(Uint32));
+    }
+    grid->x[grid->count] = x;
+    grid->y[grid->count] = y;
+    grid->tag[grid->count] = tag;
+    grid->count++;
+}
+
+// Finish a rebuild: bucket the points by cell in O(points + cells)
+static void buildSpatialGrid(SpatialGrid *grid) {
+    int cells = grid->columns * grid->columns;
+    memset(grid->cellStart, 0, (cells + 1) * sizeof(int));
+    for (int i = 0; i < grid->count; i++) {
+        grid->cellOf[i] = spatialCellIndex(grid, grid->x[i], grid->y[i]);
+        grid->cellStart[grid->cellOf[i]]++;
+    }
+    // After the prefix sum cellStart[c] is one past the end of cell c; filling backwards
+    // moves it to the start and keeps each cell's points in insertion order
+    for (int c = 1; c < cells; c++) {
+        grid->cellStart[c] += grid->cellStart[c - 1];
+    }
+    grid->cellStart[cells] = grid->count;
+    for (int i = grid->count - 1; i >= 0; i--) {
+        grid->entries[--grid->cellStart[grid->cellOf[i]]] = i;
+    }
+}
+
+// Is any point in the grid cell containing (x, y)? The audit needs only radius queries;
+// this one is for detectors that watch a fixed spot.
+static SDL_UNUSED int isSpatialCellOccupied(const SpatialGrid *grid, float x, float y) {
+    int c = spatialCellIndex(grid, x, y);
+    return grid->cellStart[c + 1] > grid->cellStart[c];
+}
+
+// Collect up to maxResults point indices within radius of (x, y). Returns how many points
+// are within radius, which may be more than maxResults; retry with room for all of them.
+static int querySpatialRadius(const SpatialGrid *grid, float x, float y, float radius, int *results, int maxResults) {
+    int found = 0;
+    int left = spatialCellIndex(grid, x - radius, y) % grid->columns;
+    int right = spatialCellIndex(grid, x + radius, y) % grid->columns;
+    int top = spatialCellIndex(grid, x, y - radius) / grid->columns;
+    int bottom = spatialCellIndex(grid, x, y + radius) / grid->columns;
+    for (int cy = top; cy <= bottom; cy++) {
+        for (int cx = left; cx <= right; cx++) {
+            int c = cy * grid->columns + cx;
+            for (int e = grid->cellStart[c]; e < grid->cellStart[c + 1]; e++) {
+                int i = grid->entries[e];
+                float dx = grid->x[i] - x;
+                float dy = grid->y[i] - y;
+                if (dx * dx + dy * dy <= radius * radius) {
+                    if (found < maxResults) results[found] = i;
+                    found++;
+                }
+            }
+        }
+    }
+    return found;
+}
+
+// Task run by the thread pool: index is in [0, count)
+typedef void (*ParallelTask)(void *context, int index);
+
+// Persistent worker threads that split a batch of independent tasks with the caller
+typedef struct {
+    SDL_Thread **threads;
+    int threadCount;        // Workers besides the calling thread
+    SDL_Mutex *mutex;
+    SDL_Condition *workReady;
+    SDL_Condition *workDone;
+    ParallelTask task;
+    void *context;
+    int taskCount;
+    SDL_AtomicInt nextTask; // Next task index to hand out
+    int activeWorkers;      // Workers still busy with the current batch
+    Uint64 generation;      // Incremented for each batch
+    int shutdown;
+} ThreadPool;
+
+// Claim and run tasks from the current batch until none are left
+static void runPendingTasks(ThreadPool *pool) {
+    int index;
+    while ((index = SDL_AddAtomicInt(&pool->nextTask, 1)) < pool->taskCount) {
+        pool->task(pool->context, index);
+    }
+}
+
+static int threadPoolWorker(void *data) {
+    ThreadPool *pool = (ThreadPool *)data;
+    Uint64 seenGeneration = 0;
+
+    SDL_LockMutex(pool->mutex);
+    while (1) {
+        while (pool->generation == seenGeneration && !pool->shutdown) {
+            SDL_WaitCondition(pool->workReady, pool->mutex);
+        }
+        if (pool->shutdown) break;
+        seenGeneration = pool->generation;
+        SDL_UnlockMutex(pool->mutex);
+
+        runPendingTasks(pool);
+
+        SDL_LockMutex(pool->mutex);
+        if (--pool->activeWorkers == 0) {
+            SDL_SignalCondition(pool->workDone);
+        }
+    }
+    SDL_UnlockMutex(pool->mutex);
+    return 0;
+}
+
+// Start a pool with threadCount workers in total (including the caller); NULL if threadCount <= 1
+static ThreadPool *createThreadPool(int threadCount) {
+    if (threadCount <= 1) return NULL;
+
+    ThreadPool *pool = (ThreadPool *)calloc(1, sizeof(ThreadPool));
+    pool->threadCount = threadCount - 1;
+    pool->threads = (SDL_Thread **)calloc(pool->threadCount, sizeof(SDL_Thread *));
+    pool->mutex = SDL_CreateMutex();
+    pool->workReady = SDL_CreateCondition();
+    pool->workDone = SDL_CreateCondition();
+    for (int i = 0; i < pool->threadCount; i++) {
+        pool->threads[i] = SDL_CreateThread(threadPoolWorker, "sim-worker", pool);
+    }
+    return pool;
+}
+
+static void destroyThreadPool(ThreadPool *pool) {
+    if (!pool) return;
+    SDL_LockMutex(pool->mutex);
+    pool->shutdown = 1;
+    SDL_BroadcastCondition(pool->workReady);
+    SDL_UnlockMutex(pool->mutex);
+    for (int i = 0; i < pool->threadCount; i++) {
+        SDL_WaitThread(pool->threads[i], NULL);
+    }
+    SDL_DestroyCondition(pool->workDone);
+    SDL_DestroyCondition(pool->workReady);
+    SDL_DestroyMutex(pool->mutex);
+    free(pool->threads);
+    free(pool);
+}
+
+// Run task(context, 0..count-1) across the pool and wait for all of them.
+// Tasks must write disjoint data; a NULL pool runs them in order on this thread.
+static void runParallel(ThreadPool *pool, ParallelTask task, void *context, int count) {
+    if (!pool || count <= 1) {
+        for (int i = 0; i < count; i++) {
+            task(context, i);
+        }
+        return;
+    }
+
+    SDL_LockMutex(pool->mutex);
+    pool->task = task;
+    pool->context = context;
+    pool->taskCount = count;
+    SDL_SetAtomicInt(&pool->nextTask, 0);
+    pool->activeWorkers = pool->threadCount;
+    pool->generation++;
+    SDL_BroadcastCondition(pool->workReady);
+    SDL_UnlockMutex(pool->mutex);
+
+    runPendingTasks(pool);
+
+    SDL_LockMutex(pool->mutex);
+    while (pool->activeWorkers > 0) {
+        SDL_WaitCondition(pool->workDone, pool->mutex);
+    }
+    SDL_UnlockMutex(pool->mutex);
+}
+
+// Convert simulated milliseconds to whole ticks of the fixed clock
+static Uint64 msToTicks(Uint64 ms) {
+    return ms * SIM_TICKS_PER_SECOND / 1000;
+}
+
+// Indexed binary min-heap over item ids 0..capacity-1. position[] maps an id to its
+// slot in heap[], so a pending item can be re-keyed or removed in O(log n).
+typedef struct {
+    int *heap;        // Item ids; heap[0] has the smallest key
+    int *position;    // Index of each id in heap, -1 when not queued
+    double *key;
+    Uint64 *order;    // Tie-break for equal keys: smaller order first
+    int size;
+    int capacity;
+} IndexedHeap;
+
+static void initHeap(IndexedHeap *h) {
+    h->heap = NULL;
+    h->position = NULL;
+    h->key = NULL;
+    h->order = NULL;
+    h->size = 0;
+    h->capacity = 0;
+}
+
+static void freeHeap(IndexedHeap *h) {
+    free(h->heap);
+    free(h->position);
+    free(h->key);
+    free(h->order);
+    initHeap(h);
+}
+
+// Make room for ids up to capacity - 1
+static void growHeap(IndexedHeap *h, int capacity) {
+    if (capacity <= h->capacity) return;
+    h->heap = (int *)realloc(h->heap, capacity * sizeof(int));
+    h->position = (int *)realloc(h->position, capacity * sizeof(int));
+    h->key = (double *)realloc(h->key, capacity * sizeof(double));
+    h->order = (Uint64 *)realloc(h->order, capacity * sizeof(Uint64));
+    for (int id = h->capacity; id < capacity; id++) {
+        h->position[id] = -1;
+    }
+    h->capacity = capacity;
+}
+
+static inline int heapLess(const IndexedHeap *h, int a, int b) {
+    if (h->key[a] != h->key[b]) return h->key[a] < h->key[b];
+    return h->order[a] < h->order[b];
+}
+
+static inline void heapPlace(IndexedHeap *h, int i, int id) {
+    h->heap[i] = id;
+    h->position[id] = i;
+}
+
+static void siftHeapUp(IndexedHeap *h, int i) {
+    int id = h->heap[i];
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!heapLess(h, id, h->heap[parent])) break;
+        heapPlace(h, i, h->heap[parent]);
+        i = parent;
+    }
+    heapPlace(h, i, id);
+}
+
+static void siftHeapDown(IndexedHeap *h, int i) {
+    int id = h->heap[i];
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= h->size) break;
+        if (child + 1 < h->size && heapLess(h, h->heap[child + 1], h->heap[child])) child++;
+        if (!heapLess(h, h->heap[child], id)) break;
+        heapPlace(h, i, h->heap[child]);
+        i = child;
+    }
+    heapPlace(h, i, id);
+}
+
+static int isInHeap(const IndexedHeap *h, int id) {
+    return id < h->capacity && h->position[id] >= 0;
+}
+
+// Insert id, or move it if it is already queued
+static void setHeapKey(IndexedHeap *h, int id, double key, Uint64 order) {
+    if (isInHeap(h, id)) {
+        h->key[id] = key;
+        h->order[id] = order;
+        siftHeapUp(h, h->position[id]);
+        siftHeapDown(h, h->position[id]);
+        return;
+    }
+    h->key[id] = key;
+    h->order[id] = order;
+    heapPlace(h, h->size++, id);
+    siftHeapUp(h, h->size - 1);
+}
+
+static void removeFromHeap(IndexedHeap *h, int id) {
+    if (!isInHeap(h, id)) return;
+    int i = h->position[id];
+    int last = h->heap[--h->size];
+    h->position[id] = -1;
+    if (i == h->size) return;
+    heapPlace(h, i, last);
+    siftHeapUp(h, i);
+    siftHeapDown(h, h->position[last]);
+}
+
+// Smallest id, or -1 if the heap is empty
+static int heapTop(const IndexedHeap *h) {
+    return h->size > 0 ? h->heap[0] : -1;
+}
+
+static int popHeap(IndexedHeap *h) {
+    int id = heapTop(h);
+    if (id >= 0) removeFromHeap(h, id);
+    return id;
+}
+
+// Lane scheduler: decides which signalled lane gets the next green. Every lane sits in an
+// indexed heap keyed on the tick it last turned green less weight ticks per vehicle
+// waiting, so a lane moves up both as its queue grows and as it waits; with no weight the
+// lanes take turns. A queue change re-keys one lane in O(log n), and picking the next lane
+// is O(1). One lane may be a priority lane: it takes every green once its queue exceeds a
+// high mark and keeps them until the queue drops below a low mark, so it does not flap
+// on and off around a single threshold.
+typedef struct {
+    IndexedHeap heap;       // Lanes; heap.order breaks ties in the order lanes were served
+    int *waiting;           // Vehicles queued on each lane, as last reported
+    Uint64 *servedTick;     // Tick each lane last turned green
+    Uint64 nextOrder;
+    double weight;          // Ticks of waiting one queued vehicle is worth
+    int laneCount;
+    int priorityLane;       // -1 = none
+    int priorityActive;     // 1 while the priority lane holds priority
+} LaneScheduler;
+
+static inline double laneKey(const LaneScheduler *s, int lane) {
+    return (double)s->servedTick[lane] - s->waiting[lane] * s->weight;
+}
+
+static void initLaneScheduler(LaneScheduler *s, int laneCount, int priorityLane, double weight) {
+    initHeap(&s->heap);
+    growHeap(&s->heap, laneCount);
+    s->waiting = (int *)calloc(laneCount, sizeof(int));
+    s->servedTick = (Uint64 *)calloc(laneCount, sizeof(Uint64));
+    s->nextOrder = 0;
+    s->weight = weight;
+    s->laneCount = laneCount;
+    s->priorityLane = priorityLane;
+    s->priorityActive = 0;
+    for (int lane = 0; lane < laneCount; lane++) {
+        setHeapKey(&s->heap, lane, laneKey(s, lane), s->nextOrder++);
+    }
+}
+
+static void freeLaneScheduler(LaneScheduler *s) {
+    freeHeap(&s->heap);
+    free(s->waiting);
+    free(s->servedTick);
+    s->waiting = NULL;
+    s->servedTick = NULL;
+    s->laneCount = 0;
+}
+
+static void copyLaneScheduler(LaneScheduler *s, const LaneScheduler *src) {
+    *s = *src;
+    initHeap(&s->heap);
+    growHeap(&s->heap, src->laneCount);
+    memcpy(s->heap.heap, src->heap.heap, src->laneCount * sizeof(int));
+    memcpy(s->heap.position, src->heap.position, src->laneCount * sizeof(int));
+    memcpy(s->heap.key, src->heap.key, src->laneCount * sizeof(double));
+    memcpy(s->heap.order, src->heap.order, src->laneCount * sizeof(Uint64));
+    s->heap.size = src->heap.size;
+    s->waiting = (int *)malloc(src->laneCount * sizeof(int));
+    s->servedTick = (Uint64 *)malloc(src->laneCount * sizeof(Uint64));
+    memcpy(s->waiting, src->waiting, src->laneCount * sizeof(int));
+    memcpy(s->servedTick, src->servedTick, src->laneCount * sizeof(Uint64));
+}
+
+// Key every lane again from scratch, after the weight or the saved state has changed
+static void rebuildLaneHeap(LaneScheduler *s) {
+    s->heap.size = 0;
+    for (int lane = 0; lane < s->laneCount; lane++) {
+        s->heap.position[lane] = -1;
+    }
+    for (int lane = 0; lane < s->laneCount; lane++) {
+        setHeapKey(&s->heap, lane, laneKey(s, lane), s->heap.order[lane]);
+    }
+}
+
+static void setLaneWeight(LaneScheduler *s, double weight) {
+    if (weight == s->weight) return;
+    s->weight = weight;
+    rebuildLaneHeap(s);
+}
+
+// Report how many vehicles are queued on a lane; free unless the count changed
+static void noteLaneQueue(LaneScheduler *s, int lane, int waiting) {
+    if (s->waiting[lane] == waiting) return;
+    s->waiting[lane] = waiting;
+    setHeapKey(&s->heap, lane, laneKey(s, lane), s->heap.order[lane]);
+}
+
+// Apply the priority lane's hysteresis to its latest queue. Returns 1 when it has just
+// taken priority.
+static int updateLanePriority(LaneScheduler *s, int high, int low) {
+    if (s->priorityLane < 0) return 0;
+    int waiting = s->waiting[s->priorityLane];
+    if (!s->priorityActive && waiting > high) {
+        s->priorityActive = 1;
+        return 1;
+    }
+    if (s->priorityActive && waiting < low) {
+        s->priorityActive = 0;
+    }
+    return 0;
+}
+
+// Lane that should get the next green
+static int nextLane(const LaneScheduler *s) {
+    return s->priorityActive ? s->priorityLane : heapTop(&s->heap);
+}
+
+static void markLaneServed(LaneScheduler *s, int lane, Uint64 tick) {
+    s->servedTick[lane] = tick;
+    setHeapKey(&s->heap, lane, laneKey(s, lane), s->nextOrder++);
+}
+
+// Discrete-event engine. Every entity owns at most one pending event, so the event id
+// says what happens: the arrival source, the light cycle, one departure per approach,
+// then one exit per vehicle slot.
+#define EVENT_ARRIVALS 0
+#define EVENT_SIGNAL 1
+#define EVENT_DEPARTURE 2    // + road index 0..3
+#define EVENT_EXIT 6         // + vehicle slot
+
+// A vehicle moves at constant speed along its route except while held at the stop line,
+// so its position at any tick follows from when it was admitted and when it left the line
+typedef struct {
+    Vehicle vehicle;        // Road, lane, speed, id and arrival tick as admitted
+    double admitted;        // Tick the vehicle appeared at its start position
+    float startDistance;    // Route distance at admission
+    double lineTime;        // Earliest tick at the stop line, no sooner than the vehicle ahead
+    double departTime;      // Tick it crossed departDistance at full speed (< 0 = still held)
+    float departDistance;
+    int next;               // Free list link, -1 while in use
+    int inUse;
+} EventVehicle;
+
+typedef struct {
+    IndexedHeap queue;      // Pending events keyed on tick (fractional)
+    Uint64 nextOrder;       // Events at the same tick run in scheduling order
+    double now;             // Tick of the event being handled
+    EventVehicle *vehicles;
+    int vehicleCapacity;
+    int freeVehicle;        // Head of the free slot list, -1 if none
+    int *line[4];           // Lane 2 vehicles not yet past the stop line, front first (ring)
+    int lineHead[4], lineCount[4], lineCapacity[4];
+    double nextDeparture[4]; // Earliest tick the next held vehicle may leave the line
+    int lastDeparted[4];    // Slot of the latest vehicle to leave each stop line, -1 if gone
+    int laneCount[4][2];    // Vehicles on each lane until they leave the screen
+    float exitDistance[4][2]; // Route distance at which a vehicle counts as gone
+} EventEngine;
+
+static EventEngine *createEventEngine(void) {
+    EventEngine *engine = (EventEngine *)calloc(1, sizeof(EventEngine));
+    initHeap(&engine->queue);
+    growHeap(&engine->queue, EVENT_EXIT);
+    engine->freeVehicle = -1;
+    for (int road = 0; road < 4; road++) {
+        engine->lastDeparted[road] = -1;
+    }
+
+    for (int road = 0; road < 4; road++) {
+        for (int l = 0; l < 2; l++) {
+            engine->exitDistance[road][l] = routeExitDistance(&routes[road][l]);
+        }
+    }
+    return engine;
+}
+
+static void destroyEventEngine(EventEngine *engine) {
+    if (!engine) return;
+    freeHeap(&engine->queue);
+    free(engine->vehicles);
+    for (int road = 0; road < 4; road++) {
+        free(engine->line[road]);
+    }
+    free(engine);
+}
+
+static EventEngine *copyEventEngine(const EventEngine *src) {
+    EventEngine *engine = (EventEngine *)malloc(sizeof(EventEngine));
+    *engine = *src;
+    initHeap(&engine->queue);
+    growHeap(&engine->queue, src->queue.capacity);
+    memcpy(engine->queue.heap, src->queue.heap, src->queue.capacity * sizeof(int));
+    memcpy(engine->queue.position, src->queue.position, src->queue.capacity * sizeof(int));
+    memcpy(engine->queue.key, src->queue.key, src->queue.capacity * sizeof(double));
+    memcpy(engine->queue.order, src->queue.order, src->queue.capacity * sizeof(Uint64));
+    engine->queue.size = src->queue.size;
+    engine->vehicles = (EventVehicle *)malloc(SDL_max(src->vehicleCapacity, 1) * sizeof(EventVehicle));
+    if (src->vehicleCapacity > 0) {
+        memcpy(engine->vehicles, src->vehicles, src->vehicleCapacity * sizeof(EventVehicle));
+    }
+    for (int road = 0; road < 4; road++) {
+        engine->line[road] = (int *)malloc(SDL_max(src->lineCapacity[road], 1) * sizeof(int));
+        if (src->lineCapacity[road] > 0) {
+            memcpy(engine->line[road], src->line[road], src->lineCapacity[road] * sizeof(int));
+        }
+    }
+    return engine;
+}
+
+static void scheduleEvent(EventEngine *engine, int event, double tick) {
+    setHeapKey(&engine->queue, event, tick, engine->nextOrder++);
+}
+
+// Take a free vehicle slot, doubling the pool (and the exit events) when none is left
+static int allocateEventVehicle(EventEngine *engine) {
+    if (engine->freeVehicle < 0) {
+        int oldCapacity = engine->vehicleCapacity;
+        int newCapacity = oldCapacity ? oldCapacity * 2 : 64;
+        engine->vehicles = (EventVehicle *)realloc(engine->vehicles, newCapacity * sizeof(EventVehicle));
+        for (int i = newCapacity - 1; i >= oldCapacity; i--) {
+            engine->vehicles[i].inUse = 0;
+            engine->vehicles[i].next = engine->freeVehicle;
+            engine->freeVehicle = i;
+        }
+        engine->vehicleCapacity = newCapacity;
+        growHeap(&engine->queue, EVENT_EXIT + newCapacity);
+    }
+    int slot = engine->freeVehicle;
+    engine->freeVehicle = engine->vehicles[slot].next;
+    engine->vehicles[slot].next = -1;
+    engine->vehicles[slot].inUse = 1;
+    return slot;
+}
+
+static void releaseEventVehicle(EventEngine *engine, int slot) {
+    engine->vehicles[slot].inUse = 0;
+    engine->vehicles[slot].next = engine->freeVehicle;
+    engine->freeVehicle = slot;
+}
+
+static void pushLine(EventEngine *engine, int road, int slot) {
+    if (engine->lineCount[road] == engine->lineCapacity[road]) {
+        // Grow the ring, unwrapping it so the front is at index 0 again
+        int oldCapacity = engine->lineCapacity[road];
+        int newCapacity = oldCapacity ? oldCapacity * 2 : 16;
+        int *items = (int *)malloc(newCapacity * sizeof(int));
+        for (int i = 0; i < engine->lineCount[road]; i++) {
+            items[i] = engine->line[road][(engine->lineHead[road] + i) % oldCapacity];
+        }
+        free(engine->line[road]);
+        engine->line[road] = items;
+        engine->lineHead[road] = 0;
+        engine->lineCapacity[road] = newCapacity;
+    }
+    int tail = (engine->lineHead[road] + engine->lineCount[road]) % engine->lineCapacity[road];
+    engine->line[road][tail] = slot;
+    engine->lineCount[road]++;
+}
+
+// Slot of the i-th held vehicle on a road, front first
+static int lineAt(const EventEngine *engine, int road, int i) {
+    return engine->line[road][(engine->lineHead[road] + i) % engine->lineCapacity[road]];
+}
+
+static void popLine(EventEngine *engine, int road) {
+    engine->lineHead[road] = (engine->lineHead[road] + 1) % engine->lineCapacity[road];
+    engine->lineCount[road]--;
+}
+
+// Route distance of a vehicle at the given tick. Held vehicles stop at the line, or
+// DISTANCE_BETWEEN_VEHICLES behind the vehicle ahead (cap carries that limit down the line).
+static float eventVehicleDistance(const EventVehicle *ev, double tick, float *cap) {
+    float perTick = ev->vehicle.speed / SIM_TICKS_PER_SECOND;
+    if (ev->departTime >= 0.0) {
+        return ev->departDistance + perTick * (float)(tick - ev->departTime);
+    }
+    float s = ev->startDistance + perTick * (float)(tick - ev->admitted);
+    if (s > *cap) s = *cap;
+    *cap = s - DISTANCE_BETWEEN_VEHICLES;
+    return s;
+}
+
+// Cell transmission model (Daganzo). A lane is cut into cells one free-flow update long;
+// each update moves min(sending, receiving) vehicles across every cell boundary, with a
+// triangular fundamental diagram. Occupancies are fractional.
+#define CTM_STEP_TICKS 30                                                  // Ticks per update
+#define CTM_CELL_LENGTH (VEHICLE_SPEED * CTM_STEP_TICKS / SIM_TICKS_PER_SECOND) // Free-flow distance per update
+#define CTM_JAM_VEHICLES (CTM_CELL_LENGTH / DISTANCE_BETWEEN_VEHICLES)    // Vehicles in a jammed cell
+#define CTM_WAVE_RATIO 0.5f                                                // Backward wave / free-flow speed
+#define CTM_CAPACITY (CTM_JAM_VEHICLES * CTM_WAVE_RATIO / (1.0f + CTM_WAVE_RATIO)) // Vehicles per update through a boundary
+
+typedef struct {
+    float *vehicles;      // Occupancy of each cell, upstream first
+    int cells;
+    float startDistance;  // Route distance of the upstream end
+} CtmLink;
+
+// Lanes of the junction as CTM links. Lane 2 is split at the stop line, where the signal
+// decides the flow; lane 3 runs straight off the screen.
+typedef struct {
+    CtmLink approach[4];    // Lane 2 from the spawn point to the stop line
+    CtmLink crossing[4];    // Lane 2 from the stop line off the screen
+    CtmLink freeLane[4];    // Lane 3 from the spawn point off the screen
+    float backlog[4][2];    // Admitted vehicles still waiting to enter their lane's first cell
+    float leaving;          // Vehicles through the screen edge not yet counted as departed
+} CtmJunction;
+
+static void initCtmLink(CtmLink *link, float startDistance, float endDistance) {
+    link->cells = (int)ceilf((endDistance - startDistance) / CTM_CELL_LENGTH);
+    if (link->cells < 1) link->cells = 1;
+    link->vehicles = (float *)calloc(link->cells, sizeof(float));
+    link->startDistance = startDistance;
+}
+
+static inline float ctmSending(float vehicles) {
+    return SDL_min(vehicles, CTM_CAPACITY);
+}
+
+static inline float ctmReceiving(float vehicles) {
+    return SDL_min(CTM_CAPACITY, CTM_WAVE_RATIO * (CTM_JAM_VEHICLES - vehicles));
+}
+
+// Vehicles the link can pass downstream / accept upstream in the next update
+static float ctmLinkSending(const CtmLink *link) {
+    return ctmSending(link->vehicles[link->cells - 1]);
+}
+
+static float ctmLinkReceiving(const CtmLink *link) {
+    return ctmReceiving(link->vehicles[0]);
+}
+
+// One update with the boundary flows already decided. Walking downstream to upstream
+// lets every internal flow be computed from occupancies that have not changed yet.
+static void advanceCtmLink(CtmLink *link, float inflow, float outflow) {
+    float *n = link->vehicles;
+    float downstream = outflow;
+    for (int i = link->cells - 1; i >= 0; i--) {
+        float upstream = (i == 0) ? inflow : SDL_min(ctmSending(n[i - 1]), ctmReceiving(n[i]));
+        n[i] += upstream - downstream;
+        downstream = upstream;
+    }
+}
+
+static float ctmLinkVehicles(const CtmLink *link) {
+    float total = 0.0f;
+    for (int i = 0; i < link->cells; i++) {
+        total += link->vehicles[i];
+    }
+    return total;
+}
+
+static CtmJunction *createCtmJunction(void) {
+    CtmJunction *ctm = (CtmJunction *)calloc(1, sizeof(CtmJunction));
+    for (int road = 0; road < 4; road++) {
+        float stopLine = routes[road][0].stopLine;
+        initCtmLink(&ctm->approach[road], 0.0f, stopLine);
+        initCtmLink(&ctm->crossing[road], stopLine, routeExitDistance(&routes[road][0]));
+        initCtmLink(&ctm->freeLane[road], 0.0f, routeExitDistance(&routes[road][1]));
+    }
+    return ctm;
+}
+
+static void destroyCtmJunction(CtmJunction *ctm) {
+    if (!ctm) return;
+    for (int road = 0; road < 4; road++) {
+        free(ctm->approach[road].vehicles);
+        free(ctm->crossing[road].vehicles);
+        free(ctm->freeLane[road].vehicles);
+    }
+    free(ctm);
+}
+
+static CtmJunction *copyCtmJunction(const CtmJunction *src) {
+    CtmJunction *ctm = (CtmJunction *)malloc(sizeof(CtmJunction));
+    *ctm = *src;
+    for (int road = 0; road < 4; road++) {
+        CtmLink *links[3] = {&ctm->approach[road], &ctm->crossing[road], &ctm->freeLane[road]};
+        for (int l = 0; l < 3; l++) {
+            float *vehicles = (float *)malloc(links[l]->cells * sizeof(float));
+            memcpy(vehicles, links[l]->vehicles, links[l]->cells * sizeof(float));
+            links[l]->vehicles = vehicles;
+        }
+    }
+    return ctm;
+}
+
+// Vehicles on a lane (0 = lane 2, 1 = lane 3), including those waiting to enter it
+static float ctmLaneVehicles(const CtmJunction *ctm, int road, int l) {
+    if (l == 0) {
+        return ctm->backlog[road][0] + ctmLinkVehicles(&ctm->approach[road]) + ctmLinkVehicles(&ctm->crossing[road]);
+    }
+    return ctm->backlog[road][1] + ctmLinkVehicles(&ctm->freeLane[road]);
+}
+
+// Running totals reported at the end of a headless run
+typedef struct {
+    Uint64 arrived;          // Vehicles admitted to a lane queue
+    Uint64 rejected;         // Vehicles dropped because their lane was full
+    Uint64 departed;         // Vehicles that drove off the screen
+    double totalTravelTime;  // Sum of simulated seconds from arrival to departure
+    int maxQueueLength;      // Longest lane queue seen
+    Uint64 reservationDenials; // Junction crossing requests refused because of a conflict
+    Uint64 overlapPairs;     // Audit: pairs of vehicle bodies overlapping, summed over ticks
+    Uint64 crossLaneOverlaps; // Audit: the subset between vehicles of different lanes
+    Uint32 travelTimeCounts[TRAVEL_TIME_BINS]; // Departures by whole seconds in the system (not CTM)
+} SimulationStats;
+
+static void recordDeparture(SimulationStats *stats, double seconds) {
+    stats->departed++;
+    stats->totalTravelTime += seconds;
+    stats->travelTimeCounts[SDL_min((int)seconds, TRAVEL_TIME_BINS - 1)]++;
+}
+
+// Time in system below which a fraction p of departures fall, interpolated within a bin
+static double travelTimePercentile(const SimulationStats *stats, double p) {
+    Uint64 total = 0;
+    for (int i = 0; i < TRAVEL_TIME_BINS; i++) {
+        total += stats->travelTimeCounts[i];
+    }
+    if (total == 0) return 0.0;
+    double rank = p * (double)total, below = 0.0;
+    for (int i = 0; i < TRAVEL_TIME_BINS; i++) {
+        double count = stats->travelTimeCounts[i];
+        if (count > 0 && below + count >= rank) {
+            return i + (rank - below) / count;
+        }
+        below += count;
+    }
+    return TRAVEL_TIME_BINS;
+}
+
+// Deterministic runs fold the state after every tick into a rolling checksum, and can
+// write the checksums to a trace or compare them with a reference trace
+typedef struct {
+    Uint64 checksum;        // Rolling checksum of every tick up to tick
+    Uint64 tick;            // Last tick folded in
+    FILE *out;              // Trace being written, or NULL
+    FILE *reference;        // Trace being compared with, or NULL
+    Uint64 divergedTick;    // First tick that differs from the reference, 0 if none
+} ChecksumTrace;
+
+static ChecksumTrace *createChecksumTrace(const char *outFile, const char *referenceFile) {
+    ChecksumTrace *trace = (ChecksumTrace *)calloc(1, sizeof(ChecksumTrace));
+    trace->checksum = 14695981039346656037ULL;
+    if (outFile && !(trace->out = fopen(outFile, "w"))) {
+        printf("Error opening %s for writing.\n", outFile);
+    }
+    else if (referenceFile && !(trace->reference = fopen(referenceFile, "r"))) {
+        printf("Error opening %s for reading.\n", referenceFile);
+    }
+    else {
+        return trace;
+    }
+    if (trace->out) fclose(trace->out);
+    free(trace);
+    return NULL;
+}
+
+static void destroyChecksumTrace(ChecksumTrace *trace) {
+    if (!trace) return;
+    if (trace->out) fclose(trace->out);
+    if (trace->reference) fclose(trace->reference);
+    free(trace);
+}
+
+// The window keeps recent history for rewinding: a keyframe (an in-memory checkpoint)
+// every few simulated seconds, and in between only the vehicles read from the lane files,
+// the one input that re-running from a keyframe does not reproduce by itself
+typedef struct {
+    Uint64 tick;
+    Uint8 *data;            // Checkpoint image, see writeSimulationState()
+    size_t size;
+} Keyframe;
+
+typedef struct {
+    Uint64 tick;            // Tick the lane files were read at, or the vehicle was injected at
+    int road;               // Road whose file the vehicle came from
+    int injected;           // 1 = trafficSimInject(), admitted before its tick was stepped
+    Vehicle vehicle;
+} LoggedArrival;
+
+typedef struct {
+    Keyframe *keyframes;    // Oldest first
+    int keyframeCount, keyframeCapacity;
+    LoggedArrival *arrivals; // Oldest first
+    int arrivalCount, arrivalCapacity;
+    int replayIndex;        // Next arrival to replay after a rewind
+    int replayEnd;          // Arrivals logged before the last rewind; later ones are live
+    Uint64 interval;        // Ticks between keyframes
+    Uint64 liveTick;        // Furthest tick reached; arrivals before it come from the log
+    size_t budget, used;    // Bytes allowed and held by keyframes and arrivals
+} RewindBuffer;
+
+static RewindBuffer *createRewindBuffer(Uint64 interval, size_t budget) {
+    RewindBuffer *rb = (RewindBuffer *)calloc(1, sizeof(RewindBuffer));
+    rb->interval = interval > 0 ? interval : 1;
+    rb->budget = budget;
+    return rb;
+}
+
+static void destroyRewindBuffer(RewindBuffer *rb) {
+    if (!rb) return;
+    for (int i = 0; i < rb->keyframeCount; i++) {
+        free(rb->keyframes[i].data);
+    }
+    free(rb->keyframes);
+    free(rb->arrivals);
+    free(rb);
+}
+
+// Signal cycle: each road in turn is green for a time sized to its queue, then amber, then
+// every light is red while the junction box clears
+#define SIGNAL_GREEN 0
+#define SIGNAL_AMBER 1
+#define SIGNAL_ALL_RED 2
+
+// Complete state of the junction, advanced only by stepSimulation()
+typedef struct {
+    TrafficLight lights[4];
+    int currentGreen;
+    Queue vehicleQueueA[3], vehicleQueueB[3], vehicleQueueC[3], vehicleQueueD[3];
+    Uint64 tick;            // Simulated time, in ticks since start
+    Uint64 lastSwitchTick;  // Tick of the last light change
+    int signalPhase;        // SIGNAL_GREEN, SIGNAL_AMBER or SIGNAL_ALL_RED for currentGreen's road
+    Uint64 phaseTicks;      // Length of the current phase, fixed when it starts
+    Uint64 greenTicks;      // Longest green; every green when serviceTicks is 0
+    Uint64 minGreenTicks;   // Shortest green under adaptive timing
+    Uint64 serviceTicks;    // Green time per waiting vehicle (0 = fixed timing)
+    Uint64 amberTicks;      // Amber after each green
+    Uint64 allRedTicks;     // Every light red between amber and the next green
+    int priorityThreshold;  // Lane 2 vehicles on road A above which A takes every green
+    LaneScheduler lanes;    // Lane 2 of each road, for choosing the next green
+    Uint64 lastPollTick;    // Tick of the last lane file poll
+    int useLaneFiles;       // 1 = read RoadX.txt, 0 = built-in generator
+    Uint64 nextSpawnTick;   // Built-in generator: tick of the next batch
+    Uint64 spawnInterval;   // Built-in generator: ticks between batches
+    Uint64 rngState;        // Built-in generator: SDL_rand_r() state
+    ThreadPool *pool;       // Workers for the per-road phase (NULL = serial)
+    int followModel;        // FOLLOW_SIMPLE or FOLLOW_IDM
+    ReservationTable *reservations; // Junction box bookings (IDM only, NULL = lights only)
+    Uint32 nextVehicleId;
+    SpatialGrid *grid;      // Rebuilt every tick when auditing collisions (NULL = off)
+    EventEngine *events;    // Discrete-event engine (NULL = fixed ticks)
+    CtmJunction *ctm;       // Cell transmission model in place of vehicles (NULL = off)
+    ChecksumTrace *trace;   // Per-tick checksums in deterministic mode (NULL = off)
+    RewindBuffer *rewind;   // Window history for rewinding (NULL = off)
+    SimulationStats stats;
+} Simulation;
+
+static void initSimulation(Simulation *sim) {
+    // Initialize traffic lights for 4 directions
+    TrafficLight lights[4] = {
+        {265, 210, 0}, // Top-left
+        {505, 210, 1}, // Top-right
+        {265, 510, 0}, // Bottom-left
+        {505, 510, 0}  // Bottom-right
+    };
+    for (int i = 0; i < 4; i++) {
+        sim->lights[i] = lights[i];
+    }
+    sim->currentGreen = 1;
+    for (int i = 0; i < 3; i++) {
+        initQueue(&sim->vehicleQueueA[i]);
+        initQueue(&sim->vehicleQueueB[i]);
+        initQueue(&sim->vehicleQueueC[i]);
+        initQueue(&sim->vehicleQueueD[i]);
+    }
+    sim->tick = 0;
+    sim->lastSwitchTick = 0;
+    sim->signalPhase = SIGNAL_GREEN;
+    sim->greenTicks = msToTicks(LIGHT_SWITCH_INTERVAL_MS);
+    sim->minGreenTicks = msToTicks(MIN_GREEN_MS);
+    sim->serviceTicks = msToTicks(SERVICE_TIME_MS);
+    sim->amberTicks = msToTicks(AMBER_MS);
+    sim->allRedTicks = msToTicks(ALL_RED_MS);
+    sim->phaseTicks = sim->minGreenTicks;  // Nothing is waiting yet
+    sim->priorityThreshold = PRIORITY_LANE_THRESHOLD;
+    initLaneScheduler(&sim->lanes, 4, PRIORITY_ROAD, (double)sim->serviceTicks);
+    for (int i = 1; i <= 4; i++) {
+        markLaneServed(&sim->lanes, (sim->currentGreen + i) % 4, 0);  // Turns run on from road B
+    }
+    sim->lastPollTick = 0;
+    sim->useLaneFiles = 1;
+    sim->nextSpawnTick = 0;
+    sim->spawnInterval = msToTicks(SPAWN_INTERVAL_MS);
+    sim->rngState = 0;
+    sim->pool = NULL;
+    sim->followModel = FOLLOW_SIMPLE;
+    sim->reservations = NULL;
+    sim->nextVehicleId = 1;
+    sim->grid = NULL;
+    sim->events = NULL;
+    sim->ctm = NULL;
+    sim->trace = NULL;
+    sim->rewind = NULL;
+    SDL_zero(sim->stats);
+}
+
+// Free every queued vehicle
+static void freeSimulation(Simulation *sim) {
+    for (int i = 0; i < 3; i++) {
+        freeQueue(&sim->vehicleQueueA[i]);
+        freeQueue(&sim->vehicleQueueB[i]);
+        freeQueue(&sim->vehicleQueueC[i]);
+        freeQueue(&sim->vehicleQueueD[i]);
+    }
+    releaseReservationTable(sim->reservations);
+    sim->reservations = NULL;
+    destroySpatialGrid(sim->grid);
+    sim->grid = NULL;
+    destroyEventEngine(sim->events);
+    sim->events = NULL;
+    destroyCtmJunction(sim->ctm);
+    sim->ctm = NULL;
+    destroyChecksumTrace(sim->trace);
+    sim->trace = NULL;
+    destroyRewindBuffer(sim->rewind);
+    sim->rewind = NULL;
+    freeLaneScheduler(&sim->lanes);
+}
+
+// Start child as a copy of parent that can be advanced and freed on its own, for trying
+// out what-if futures. Lanes hold a handful of vehicles and are copied; the 256 KB
+// reservation table is shared until either side books a cell. A fork runs serially,
+// without audit, trace or rewind history, and never reads the lane files: its arrivals
+// come from the built-in generator, from the same state in every fork of one parent.
+static void forkSimulation(Simulation *child, const Simulation *parent) {
+    *child = *parent;  // Lights, clock, generator state and statistics
+    const Queue *from[4] = {parent->vehicleQueueA, parent->vehicleQueueB, parent->vehicleQueueC, parent->vehicleQueueD};
+    Queue *to[4] = {child->vehicleQueueA, child->vehicleQueueB, child->vehicleQueueC, child->vehicleQueueD};
+    for (int road = 0; road < 4; road++) {
+        for (int i = 0; i < 3; i++) {
+            copyQueue(&to[road][i], &from[road][i]);
+        }
+    }
+    child->reservations = parent->reservations ? shareReservationTable(parent->reservations) : NULL;
+    child->events = parent->events ? copyEventEngine(parent->events) : NULL;
+    child->ctm = parent->ctm ? copyCtmJunction(parent->ctm) : NULL;
+    copyLaneScheduler(&child->lanes, &parent->lanes);
+    child->useLaneFiles = 0;
+    child->pool = NULL;
+    child->grid = NULL;
+    child->trace = NULL;
+    child->rewind = NULL;
+}
+
+// Let every lane hold up to capacity vehicles before arrivals are rejected
+static void setLaneCapacity(Simulation *sim, int capacity) {
+    for (int i = 0; i < 3; i++) {
+        sim->vehicleQueueA[i].limit = capacity;
+        sim->vehicleQueueB[i].limit = capacity;
+        sim->vehicleQueueC[i].limit = capacity;
+        sim->vehicleQueueD[i].limit = capacity;
+    }
+}
+
+// Tick at which the current signal phase ends
+static Uint64 nextSignalTick(const Simulation *sim) {
+    return sim->lastSwitchTick + sim->phaseTicks;
+}
+
+// Hand the simulation to the discrete-event engine from the current tick on
+static void enableEventEngine(Simulation *sim) {
+    if (sim->events) return;
+    sim->events = createEventEngine();
+    scheduleEvent(sim->events, EVENT_SIGNAL, (double)nextSignalTick(sim));
+    scheduleEvent(sim->events, EVENT_ARRIVALS, (double)sim->tick);
+}
+
+// Book the tick at which a moving vehicle drives off the screen
+static void scheduleExit(EventEngine *engine, int slot) {
+    const EventVehicle *ev = &engine->vehicles[slot];
+    float perTick = ev->vehicle.speed / SIM_TICKS_PER_SECOND;
+    if (perTick <= 0.0f) return;  // Parked for good
+    float remaining = engine->exitDistance[ev->vehicle.road - 1][ev->vehicle.lane - 2] - ev->departDistance;
+    double tick = ev->departTime + (remaining > 0.0f ? remaining / perTick : 0.0f);
+    scheduleEvent(engine, EVENT_EXIT + slot, SDL_max(tick, engine->now));
+}
+
+// Let the front of a road's held line go as soon as it is at the line, the light is
+// green and the previous vehicle has cleared DISTANCE_BETWEEN_VEHICLES
+static void scheduleDeparture(Simulation *sim, int road) {
+    EventEngine *engine = sim->events;
+    if (sim->lights[road].state != 1 || engine->lineCount[road] == 0) return;
+    const EventVehicle *front = &engine->vehicles[lineAt(engine, road, 0)];
+    double tick = SDL_max(front->lineTime, engine->nextDeparture[road]);
+    scheduleEvent(engine, EVENT_DEPARTURE + road, SDL_max(tick, engine->now));
+}
+
+// Event-engine counterpart of admitVehicle(): nothing moves until an event needs it
+static void admitEventVehicle(Simulation *sim, Vehicle v, int limit) {
+    EventEngine *engine = sim->events;
+    int road = v.road - 1;
+    int l = v.lane - 2;
+    if (road < 0 || road > 3) return;
+    if (engine->laneCount[road][l] >= limit) {
+        sim->stats.rejected++;
+        return;
+    }
+    const Route *route = &routes[road][l];
+    v.arrivalTick = sim->tick;
+    v.distance = projectOntoRoute(route, v.x, v.y);
+    v.velocity = v.speed;
+    v.id = sim->nextVehicleId++;
+    v.committed = 0;
+
+    int slot = allocateEventVehicle(engine);
+    EventVehicle *ev = &engine->vehicles[slot];
+    float perTick = v.speed / SIM_TICKS_PER_SECOND;
+    ev->vehicle = v;
+    ev->admitted = engine->now;
+    ev->startDistance = v.distance;
+    if (v.lane == 2 && v.distance < route->stopLine) {
+        // Held until scheduleDeparture() lets it go; it cannot reach the line before the vehicle ahead
+        ev->lineTime = perTick > 0.0f ? ev->admitted + (route->stopLine - v.distance) / perTick : INFINITY;
+        if (engine->lineCount[road] > 0) {
+            const EventVehicle *back = &engine->vehicles[lineAt(engine, road, engine->lineCount[road] - 1)];
+            ev->lineTime = SDL_max(ev->lineTime, back->lineTime);
+        }
+        ev->departTime = -1.0;
+        pushLine(engine, road, slot);
+        if (engine->lineCount[road] == 1) {
+            scheduleDeparture(sim, road);
+        }
+    }
+    else {
+        ev->departTime = ev->admitted;
+        ev->departDistance = v.distance;
+        scheduleExit(engine, slot);
+    }
+
+    engine->laneCount[road][l]++;
+    sim->stats.arrived++;
+    if (engine->laneCount[road][l] > sim->stats.maxQueueLength) {
+        sim->stats.maxQueueLength = engine->laneCount[road][l];
+    }
+}
+
+// Micro to meso boundary: a vehicle becomes one unit of demand at the upstream end of its lane
+static void admitCtmVehicle(Simulation *sim, Vehicle v, int limit) {
+    int road = v.road - 1;
+    int l = v.lane - 2;
+    if (road < 0 || road > 3) return;
+    float onLane = ctmLaneVehicles(sim->ctm, road, l);
+    if (onLane + 0.5f >= limit) {
+        sim->stats.rejected++;
+        return;
+    }
+    sim->ctm->backlog[road][l] += 1.0f;
+    sim->stats.arrived++;
+    if ((int)(onLane + 1.5f) > sim->stats.maxQueueLength) {
+        sim->stats.maxQueueLength = (int)(onLane + 1.5f);
+    }
+}
+
+// Queue a vehicle on its lane (lane 2 -> q[1], lane 3 -> q[2]) and count it
+static void admitVehicle(Simulation *sim, Queue *q, Vehicle v) {
+    Queue *lane;
+    if (v.lane == 2) {
+        lane = &q[1];
+    }
+    else if (v.lane == 3) {
+        lane = &q[2];
+    }
+    else {
+        return;
+    }
+    if (sim->events) {
+        admitEventVehicle(sim, v, lane->limit);
+        return;
+    }
+    if (sim->ctm) {
+        admitCtmVehicle(sim, v, lane->limit);
+        return;
+    }
+    if (isQueueFull(lane)) {
+        sim->stats.rejected++;
+        return;
+    }
+    v.arrivalTick = sim->tick;
+    if (v.road >= 1 && v.road <= 4) {
+        v.distance = projectOntoRoute(&routes[v.road - 1][v.lane - 2], v.x, v.y);
+    }
+    v.velocity = v.speed;
+    v.id = sim->nextVehicleId++;
+    v.committed = 0;
+    enqueue(lane, v);
+    sim->stats.arrived++;
+    if (lane->count > sim->stats.maxQueueLength) {
+        sim->stats.maxQueueLength = lane->count;
+    }
+}
+
+// Keep a vehicle read from a lane file or injected so that it can be admitted again after
+// a rewind
+static void logArrival(RewindBuffer *rb, Uint64 tick, int road, Vehicle v, int injected) {
+    if (rb->arrivalCount == rb->arrivalCapacity) {
+        rb->arrivalCapacity = rb->arrivalCapacity ? rb->arrivalCapacity * 2 : 64;
+        rb->arrivals = (LoggedArrival *)realloc(rb->arrivals, rb->arrivalCapacity * sizeof(LoggedArrival));
+    }
+    LoggedArrival *a = &rb->arrivals[rb->arrivalCount++];
+    a->tick = tick;
+    a->road = road;
+    a->injected = injected;
+    a->vehicle = v;
+    rb->used += sizeof(LoggedArrival);
+}
+
+// Function to read vehicles from .txt file and update queue
+static void updateVehicleQueueFromFile(Simulation *sim, int road, const char *filename) {
+    Queue *roadQueues[4] = {sim->vehicleQueueA, sim->vehicleQueueB, sim->vehicleQueueC, sim->vehicleQueueD};
+    FILE *fp = fopen(filename, "r");
+    if (!fp) {
+        printf("Error opening %s for reading.\n", filename);
+        return;
+    }
+
+    char line[1000000];
+    while (fgets(line, sizeof(line), fp)) {
+        Vehicle v = {0};
+        if (sscanf(line, "%d,%d,%f,%f,%f", &v.road, &v.lane, &v.x, &v.y, &v.speed) == 5) {
+            if (sim->rewind) {
+                logArrival(sim->rewind, sim->tick, road, v, 0);
+            }
+            admitVehicle(sim, roadQueues[road], v);
+        }
+    }
+    fclose(fp);
+
+    // Clear the file after reading the vehicles
+    fp = fopen(filename, "w");
+    if (!fp) {
+        printf("Error opening %s for writing.\n", filename);
+        return;
+    }
+    fclose(fp);
+}
+
+// Re-simulating after a rewind: admit the vehicles the lane files gave at this tick, or
+// those injected at it. Returns how many were replayed.
+static int replayArrivals(Simulation *sim, int injected) {
+    Queue *roadQueues[4] = {sim->vehicleQueueA, sim->vehicleQueueB, sim->vehicleQueueC, sim->vehicleQueueD};
+    RewindBuffer *rb = sim->rewind;
+    while (rb->replayIndex < rb->replayEnd && rb->arrivals[rb->replayIndex].tick < sim->tick) {
+        rb->replayIndex++;
+    }
+    int replayed = 0;
+    for (int i = rb->replayIndex; i < rb->replayEnd && rb->arrivals[i].tick == sim->tick; i++) {
+        const LoggedArrival *a = &rb->arrivals[i];
+        if (a->injected == injected) {
+            admitVehicle(sim, roadQueues[a->road], a->vehicle);
+            replayed++;
+        }
+    }
+    return replayed;
+}
+
+// Tick of the next injected vehicle still to replay, at or after tick; -1 if none
+static Uint64 nextInjectionTick(const RewindBuffer *rb, Uint64 tick) {
+    for (int i = rb->replayIndex; i < rb->replayEnd; i++) {
+        if (rb->arrivals[i].injected && rb->arrivals[i].tick >= tick) return rb->arrivals[i].tick;
+    }
+    return (Uint64)-1;
+}
+
+// Built-in equivalent of traffic_generator: a batch of vehicles on a random road
+static void spawnVehicles(Simulation *sim) {
+    Queue *roadQueues[4] = {sim->vehicleQueueA, sim->vehicleQueueB, sim->vehicleQueueC, sim->vehicleQueueD};
+    int road = SDL_rand_r(&sim->rngState, 4) + 1;
+    int count = SDL_rand_r(&sim->rngState, SPAWN_BATCH_MAX) + 1;
+
+    for (int i = 0; i < count; i++) {
+        Vehicle v = {0};
+        v.road = road;
+        v.lane = SDL_rand_r(&sim->rngState, 2) + 2; // Randomly choose Lane 2 or Lane 3
+        v.speed = VEHICLE_SPEED;
+
+        // Same starting positions as traffic_generator.c
+        switch (road) {
+            case 1: // Road A (top to bottom)
+                v.x = (v.lane == 3) ? 450.0f : 385.0f;
+                v.y = 0.0f;
+                break;
+            case 2: // Road B (right to left)
+                v.x = 750.0f;
+                v.y = (v.lane == 3) ? 450.0f : 385.0f;
+                break;
+            case 3: // Road C (bottom to top)
+                v.x = (v.lane == 3) ? 320.0f : 385.0f;
+                v.y = 750.0f;
+                break;
+            case 4: // Road D (left to right)
+                v.x = 25.0f;
+                v.y = (v.lane == 3) ? 320.0f : 385.0f;
+                break;
+        }
+        admitVehicle(sim, roadQueues[road - 1], v);
+    }
+}
+
+// Rebuild the spatial grid from every vehicle's centre and count overlapping bodies
+static void auditCollisions(Simulation *sim) {
+    Queue *roadQueues[4] = {sim->vehicleQueueA, sim->vehicleQueueB, sim->vehicleQueueC, sim->vehicleQueueD};
+    SpatialGrid *grid = sim->grid;
+
+    clearSpatialGrid(grid);
+    for (int road = 0; road < 4; road++) {
+        for (int i = 0; i < 3; i++) {
+            Queue *q = &roadQueues[road][i];
+            for (int k = q->head; k < q->head + q->count; k++) {
+                addSpatialPoint(grid, q->x[k] + 15.0f, q->y[k] + 10.0f, (Uint32)(road * 3 + i));
+            }
+        }
+    }
+    buildSpatialGrid(grid);
+
+    for (int i = 0; i < grid->count; i++) {
+        int found = querySpatialRadius(grid, grid->x[i], grid->y[i], SPATIAL_CELL_SIZE,
+                                       grid->neighbours, grid->neighbourCapacity);
+        if (found > grid->neighbourCapacity) {
+            // A pile-up: grow the buffer so no neighbour is dropped, then ask again
+            grid->neighbourCapacity = found * 2;
+            grid->neighbours = (int *)realloc(grid->neighbours, grid->neighbourCapacity * sizeof(int));
+            found = querySpatialRadius(grid, grid->x[i], grid->y[i], SPATIAL_CELL_SIZE,
+                                       grid->neighbours, grid->neighbourCapacity);
+        }
+        for (int n = 0; n < found; n++) {
+            int j = grid->neighbours[n];
+            if (j <= i) continue;  // Count each pair once
+            if (fabsf(grid->x[i] - grid->x[j]) < 30.0f && fabsf(grid->y[i] - grid->y[j]) < 20.0f) {
+                sim->stats.overlapPairs++;
+                if (grid->tag[i] != grid->tag[j]) sim->stats.crossLaneOverlaps++;
+            }
+        }
+    }
+}
+
+// Drop vehicles that have driven past the edge of the screen
+static void removeExitedVehicles(Simulation *sim) {
+    Queue *roadQueues[4] = {sim->vehicleQueueA, sim->vehicleQueueB, sim->vehicleQueueC, sim->vehicleQueueD};
+    for (int road = 0; road < 4; road++) {
+        for (int i = 0; i < 3; i++) {
+            // Compact the lane in place, keeping the order of the vehicles that stay
+            Queue *q = &roadQueues[road][i];
+            int kept = q->head, removedCrossed = 0;
+            for (int k = q->head; k < q->head + q->count; k++) {
+                if (q->x[k] < -EXIT_MARGIN || q->x[k] > WIDTH + EXIT_MARGIN ||
+                    q->y[k] < -EXIT_MARGIN || q->y[k] > HEIGHT + EXIT_MARGIN) {
+                    recordDeparture(&sim->stats, (double)(sim->tick - q->arrivalTick[k]) / SIM_TICKS_PER_SECOND);
+                    if (k - q->head < q->asleep) q->asleep = 0;
+                    if (k - q->head < q->crossed) removedCrossed++;
+                    continue;
+                }
+                q->x[kept] = q->x[k];
+                q->y[kept] = q->y[k];
+                q->speed[kept] = q->speed[k];
+                q->arrivalTick[kept] = q->arrivalTick[k];
+                q->distance[kept] = q->distance[k];
+                q->velocity[kept] = q->velocity[k];
+                q->id[kept] = q->id[k];
+                q->committed[kept] = q->committed[k];
+                kept++;
+            }
+            q->count = kept - q->head;
+            q->crossed -= removedCrossed;
+            if (q->count == 0) q->head = 0;
+        }
+    }
+}
+
+// Move the vehicles of Road A for one tick; touches only that road's queues
+static void updateRoadA(Queue *q, const TrafficLight *light, float dt) {
+    // AL2 (second lane): close up behind the leader, the front one stops at the line
+    Queue *lane = &q[1];
+    int n = lane->count;
+    float *x = lane->x + lane->head;
+    float *y = lane->y + lane->head;
+    float *speed = lane->speed + lane->head;
+    if (n > 0) {
+        advanceWaitingLane(lane, y, speed, 1.0f, 290.0f, DISTANCE_BETWEEN_VEHICLES,
+                           light->state != 1, dt);
+        if (light->state == 1) {  // Green Light for Road A
+            // Move upto the junction, then turn and leave.
+            if (y[0] <= 450) {
+                y[0] += speed[0] * dt;
+            }
+            else if (x[0] <= 450) {
+                x[0] += speed[0] * dt;
+            }
+            else if (y[0] <= 830) {
+                y[0] += speed[0] * dt;
+            }
+            // Followers keep closing up and stay in the front vehicle's track
+            advanceLane(y + 1, speed + 1, n - 1, 1.0f, y[0] - DISTANCE_BETWEEN_VEHICLES,
+                        DISTANCE_BETWEEN_VEHICLES, dt);
+            for (int i = 1; i < n; i++) {
+                x[i] = x[0];
+            }
+        }
+    }
+
+    // AL3 (third lane): free lane, always allow left turn
+    lane = &q[2];
+    x = lane->x + lane->head;
+    y = lane->y + lane->head;
+    speed = lane->speed + lane->head;
+    for (int i = 0; i < lane->count; i++) {
+        if (y[i] < LEFT_TURN_THRESHOLD) {
+            y[i] += speed[i] * dt;  // Move straight
+        } else {
+            x[i] += speed[i] * dt;  // Move right
+        }
+    }
+}
+
+// Move the vehicles of Road B for one tick; touches only that road's queues
+static void updateRoadB(Queue *q, const TrafficLight *light, float dt) {
+    // BL2 (second lane): close up behind the leader, the front one stops at the line
+    Queue *lane = &q[1];
+    int n = lane->count;
+    float *x = lane->x + lane->head;
+    float *y = lane->y + lane->head;
+    float *speed = lane->speed + lane->head;
+    if (n > 0) {
+        advanceWaitingLane(lane, x, speed, -1.0f, -480.0f, DISTANCE_BETWEEN_VEHICLES,
+                           light->state != 1, dt);
+        if (light->state == 1) {  // Green Light for Road B
+            // Move upto the junction, then turn and leave.
+            if (x[0] >= 350) {
+                x[0] -= speed[0] * dt;
+            }
+            else if (y[0] <= 450) {
+                y[0] += speed[0] * dt;
+            }
+            else if (x[0] >= -30) {
+                x[0] -= speed[0] * dt;
+            }
+            // Followers keep closing up and stay in the front vehicle's track
+            advanceLane(x + 1, speed + 1, n - 1, -1.0f, -x[0] - DISTANCE_BETWEEN_VEHICLES,
+                        DISTANCE_BETWEEN_VEHICLES, dt);
+            for (int i = 1; i < n; i++) {
+                y[i] = y[0];
+            }
+        }
+    }
+
+    // BL3 (third lane): free lane, always allow left turn
+    lane = &q[2];
+    x = lane->x + lane->head;
+    y = lane->y + lane->head;
+    speed = lane->speed + lane->head;
+    for (int i = 0; i < lane->count; i++) {
+        if (x[i] > 460) {
+            x[i] -= speed[i] * dt;  // Move straight
+        } else {
+            y[i] += speed[i] * dt;  // Move down
+        }
+    }
+}
+
+// Move the vehicles of Road C for one tick; touches only that road's queues
+static void updateRoadC(Queue *q, const TrafficLight *light, float dt) {
+    // CL2 (second lane): close up behind the leader, the front one stops at the line
+    Queue *lane = &q[1];
+    int n = lane->count;
+    float *x = lane->x + lane->head;
+    float *y = lane->y + lane->head;
+    float *speed = lane->speed + lane->head;
+    if (n > 0) {
+        advanceWaitingLane(lane, y, speed, -1.0f, -500.0f, DISTANCE_BETWEEN_VEHICLES,
+                           light->state != 1, dt);
+        if (light->state == 1) {  // Green Light for Road C
+            // Move upto the junction, then turn and leave.
+            if (y[0] >= 350) {
+                y[0] -= speed[0] * dt;
+            }
+            else if (x[0] >= 320) {
+                x[0] -= speed[0] * dt;
+            }
+            else if (y[0] >= -30) {
+                y[0] -= speed[0] * dt;
+            }
+            // Followers keep closing up and stay in the front vehicle's track
+            advanceLane(y + 1, speed + 1, n - 1, -1.0f, -y[0] - DISTANCE_BETWEEN_VEHICLES,
+                        DISTANCE_BETWEEN_VEHICLES, dt);
+            for (int i = 1; i < n; i++) {
+                x[i] = x[0];
+            }
+        }
+    }
+
+    // CL3 (third lane): free lane, always allow left turn
+    lane = &q[2];
+    x = lane->x + lane->head;
+    y = lane->y + lane->head;
+    speed = lane->speed + lane->head;
+    for (int i = 0; i < lane->count; i++) {
+        if (y[i] > 460) {
+            y[i] -= speed[i] * dt;  // Move straight
+        } else {
+            x[i] -= speed[i] * dt;  // Move left
+        }
+    }
+}
+
+// Move the vehicles of Road D for one tick; touches only that road's queues
+static void updateRoadD(Queue *q, const TrafficLight *light, float dt) {
+    // DL2 (second lane): close up behind the leader, the front one stops at the line
+    Queue *lane = &q[1];
+    int n = lane->count;
+    float *x = lane->x + lane->head;
+    float *y = lane->y + lane->head;
+    float *speed = lane->speed + lane->head;
+    if (n > 0) {
+        advanceWaitingLane(lane, x, speed, 1.0f, 290.0f, DISTANCE_BETWEEN_VEHICLES,
+                           light->state != 1, dt);
+        if (light->state == 1) {  // Green Light for Road D
+            // Move upto the junction, then turn and leave.
+            if (x[0] <= 450) {
+                x[0] += speed[0] * dt;
+            }
+            else if (y[0] >= 350) {
+                y[0] -= speed[0] * dt;
+            }
+            else if (x[0] <= 830) {
+                x[0] += speed[0] * dt;
+            }
+            // Followers keep closing up and stay in the front vehicle's track
+            advanceLane(x + 1, speed + 1, n - 1, 1.0f, x[0] - DISTANCE_BETWEEN_VEHICLES,
+                        DISTANCE_BETWEEN_VEHICLES, dt);
+            for (int i = 1; i < n; i++) {
+                y[i] = y[0];
+            }
+        }
+    }
+
+    // DL3 (third lane): free lane, always allow left turn
+    lane = &q[2];
+    x = lane->x + lane->head;
+    y = lane->y + lane->head;
+    speed = lane->speed + lane->head;
+    for (int i = 0; i < lane->count; i++) {
+        if (x[i] < 330) {
+            x[i] += speed[i] * dt;  // Move straight
+        } else {
+            y[i] -= speed[i] * dt;  // Move up
+        }
+    }
+}
+
+// Move the vehicles of one road under the Intelligent Driver Model: lane 2 stops at the
+// line on red, lane 3 is a free lane. Positions are derived from the route distance.
+// With a reservation table, vehicles without a booking also wait at the edge of the box.
+static void updateRoadIDM(Queue *q, const TrafficLight *light, int road, const ReservationTable *table, float dt) {
+    for (int l = 0; l < 2; l++) {
+        Queue *lane = &q[l + 1];
+        const Route *route = &routes[road][l];
+        int n = lane->count;
+        int k = lane->head;
+        float stopLine = (light->state == 1) ? -IDM_FREE_ROAD : route->stopLine;
+        if (table) {
+            stopLine = table->boxEntry[road][l];
+        }
+
+        // Lane 2 on red: vehicles standing in the queue sleep, only the tail is integrated
+        int asleep = (l == 0 && light->state != 1) ? lane->asleep : 0;
+        float leadDistance = asleep ? lane->distance[k + asleep - 1] - VEHICLE_LENGTH : IDM_FREE_ROAD;
+        k += asleep;
+        n -= asleep;
+        idmLane(lane->distance + k, lane->velocity + k, lane->speed + k, lane->committed + k, n,
+                leadDistance, 0.0f, stopLine, dt);
+        if (l == 0) {
+            lane->asleep = (light->state != 1) ? settleQueuedVehicles(lane->distance + lane->head,
+                lane->velocity + lane->head, lane->committed + lane->head, lane->count, asleep, stopLine) : 0;
+        }
+        for (int i = k; i < k + n; i++) {
+            placeOnRoute(route, lane->distance[i], &lane->x[i], &lane->y[i]);
+            if (table && lane->committed[i] && lane->distance[i] > table->boxExit[road][l]) {
+                lane->committed[i] = 0;  // Clear of the box; back to normal following
+            }
+        }
+    }
+}
+
+// Give sim a reservation table of its own before it books anything, if forks share it
+static void ownReservationTable(Simulation *sim) {
+    ReservationTable *table = sim->reservations;
+    if (SDL_GetAtomicInt(&table->refs) == 1) return;
+    ReservationTable *copy = (ReservationTable *)malloc(sizeof(ReservationTable));
+    memcpy(copy, table, sizeof(ReservationTable));
+    SDL_SetAtomicInt(&copy->refs, 1);
+    releaseReservationTable(table);
+    sim->reservations = copy;
+}
+
+// Serial junction phase: the first unbooked vehicle of each lane close to the box asks for
+// a crossing (lane 2 only on green). Roads and lanes are visited in a fixed order.
+static void resolveReservations(Simulation *sim) {
+    Queue *roadQueues[4] = {sim->vehicleQueueA, sim->vehicleQueueB, sim->vehicleQueueC, sim->vehicleQueueD};
+    for (int road = 0; road < 4; road++) {
+        for (int l = 0; l < 2; l++) {
+            Queue *lane = &roadQueues[road][l + 1];
+            if (l == 0 && sim->lights[road].state != 1) continue;
+            for (int i = lane->head; i < lane->head + lane->count; i++) {
+                if (lane->committed[i]) continue;
+                float entry = sim->reservations->boxEntry[road][l];
+                if (lane->distance[i] < entry && entry - lane->distance[i] <= RESERVATION_REQUEST_DISTANCE) {
+                    ownReservationTable(sim);
+                    if (tryReserveCrossing(sim->reservations, road, l, lane->distance[i], lane->velocity[i],
+                                           lane->speed[i], lane->id[i], sim->tick)) {
+                        lane->committed[i] = 1;
+                    }
+                    else {
+                        sim->stats.reservationDenials++;
+                    }
+                }
+                break;  // Only the first vehicle without a booking may ask
+            }
+        }
+    }
+}
+
+// Count lane 2 vehicles that have driven past the stop line. They leave the lane in order,
+// so only the first one still before the line is looked at. The simple model keeps
+// positions rather than route distances; every leg after the first moves further along it.
+static void countCrossedVehicles(Queue *lane, const Route *route, int idm) {
+    while (lane->crossed < lane->count) {
+        int k = lane->head + lane->crossed;
+        float distance = idm ? lane->distance[k] : projectOntoRoute(route, lane->x[k], lane->y[k]);
+        if (distance <= route->stopLine) break;
+        lane->crossed++;
+    }
+}
+
+// Thread pool task: advance one approach (0 = A .. 3 = D)
+static void updateRoadTask(void *context, int road) {
+    Simulation *sim = (Simulation *)context;
+    Queue *roadQueues[4] = {sim->vehicleQueueA, sim->vehicleQueueB, sim->vehicleQueueC, sim->vehicleQueueD};
+    const float dt = SIM_DT;
+    if (sim->followModel == FOLLOW_IDM) {
+        updateRoadIDM(roadQueues[road], &sim->lights[road], road, sim->reservations, dt);
+    }
+    else {
+        switch (road) {
+            case 0: updateRoadA(sim->vehicleQueueA, &sim->lights[0], dt); break;
+            case 1: updateRoadB(sim->vehicleQueueB, &sim->lights[1], dt); break;
+            case 2: updateRoadC(sim->vehicleQueueC, &sim->lights[2], dt); break;
+            case 3: updateRoadD(sim->vehicleQueueD, &sim->lights[3], dt); break;
+        }
+    }
+    countCrossedVehicles(&roadQueues[road][1], &routes[road][0], sim->followModel == FOLLOW_IDM);
+}
+
+// Vehicles in lane 2 of a road that have not yet passed the stop line, whichever engine
+// holds them. O(1) for every engine.
+static int waitingOnLane2(const Simulation *sim, int road) {
+    if (sim->events) {
+        return sim->events->lineCount[road];
+    }
+    if (sim->ctm) {
+        return (int)(sim->ctm->backlog[road][0] + ctmLinkVehicles(&sim->ctm->approach[road]));
+    }
+    const Queue *roadQueues[4] = {sim->vehicleQueueA, sim->vehicleQueueB, sim->vehicleQueueC, sim->vehicleQueueD};
+    return roadQueues[road][1].count - roadQueues[road][1].crossed;
+}
+
+// Length of the current phase. A green lasts T = |V| * t, where |V| is the average number
+// of vehicles waiting on the lanes it serves (here lane 2 of one road) and t the service
+// time per vehicle, kept between the shortest and longest green. With no service time
+// every green is the longest (fixed timing).
+static Uint64 signalPhaseTicks(const Simulation *sim) {
+    if (sim->signalPhase == SIGNAL_AMBER) return sim->amberTicks;
+    if (sim->signalPhase == SIGNAL_ALL_RED) return sim->allRedTicks;
+    if (sim->serviceTicks == 0) return sim->greenTicks;
+    Uint64 served = (Uint64)waitingOnLane2(sim, sim->currentGreen) * sim->serviceTicks;
+    Uint64 shortest = SDL_max(SDL_min(sim->minGreenTicks, sim->greenTicks), 1);
+    return SDL_clamp(served, shortest, sim->greenTicks);
+}
+
+// End the current phase: green turns amber, amber turns all red, and all red gives the
+// road chosen by the lane scheduler its green. While lane A2 holds priority its green runs
+// on phase after phase. Phases of zero length are passed straight through.
+static void switchLights(Simulation *sim) {
+    do {
+        if (sim->signalPhase == SIGNAL_GREEN && sim->lanes.priorityActive && sim->currentGreen == PRIORITY_ROAD) {
+            markLaneServed(&sim->lanes, sim->currentGreen, sim->tick);  // Keep the green
+        }
+        else if (sim->signalPhase == SIGNAL_GREEN) {
+            sim->lights[sim->currentGreen].state = 2;  // Set current green light to amber
+            sim->signalPhase = SIGNAL_AMBER;
+        }
+        else if (sim->signalPhase == SIGNAL_AMBER) {
+            sim->lights[sim->currentGreen].state = 0;  // Set current amber light to red
+            sim->signalPhase = SIGNAL_ALL_RED;
+        }
+        else {
+            sim->currentGreen = nextLane(&sim->lanes);  // Priority lane, else the most pressing
+            markLaneServed(&sim->lanes, sim->currentGreen, sim->tick);
+            sim->lights[sim->currentGreen].state = 1;  // Set new light to green
+            sim->signalPhase = SIGNAL_GREEN;
+        }
+        sim->phaseTicks = signalPhaseTicks(sim);
+    } while (sim->phaseTicks == 0);
+    sim->lastSwitchTick = sim->tick;
+}
+
+// Lane A2 has just taken priority: end another road's green once it has run the shortest
+// green, rather than making A2 wait out the whole of it
+static void preemptGreen(Simulation *sim) {
+    if (sim->signalPhase != SIGNAL_GREEN || sim->currentGreen == PRIORITY_ROAD) return;
+    Uint64 shortest = SDL_min(sim->minGreenTicks, sim->greenTicks);
+    sim->phaseTicks = SDL_min(SDL_max(sim->tick - sim->lastSwitchTick, shortest), sim->phaseTicks);
+    if (sim->events) {
+        scheduleEvent(sim->events, EVENT_SIGNAL, SDL_max((double)nextSignalTick(sim), sim->events->now));
+    }
+}
+
+// Pass the lane 2 queues to the scheduler and apply the A2 priority rule: priority above
+// priorityThreshold vehicles, released below PRIORITY_LANE_RELEASE (scaled with the
+// threshold). Run every tick and after every event that moves a queue; it costs O(log n)
+// for each lane whose queue changed and nothing otherwise.
+static void updateLaneScheduler(Simulation *sim) {
+    for (int road = 0; road < 4; road++) {
+        noteLaneQueue(&sim->lanes, road, waitingOnLane2(sim, road));
+    }
+    int release = SDL_max(sim->priorityThreshold * PRIORITY_LANE_RELEASE / PRIORITY_LANE_THRESHOLD, 1);
+    if (updateLanePriority(&sim->lanes, sim->priorityThreshold, release)) {
+        preemptGreen(sim);
+    }
+}
+
+// Work out the current phase's length again after the timing settings change. The phase
+// still counts from when it started, so it may be due at once.
+static void retimeSignal(Simulation *sim) {
+    setLaneWeight(&sim->lanes, (double)sim->serviceTicks);
+    sim->phaseTicks = signalPhaseTicks(sim);
+    if (sim->events) {
+        scheduleEvent(sim->events, EVENT_SIGNAL, (double)SDL_max(nextSignalTick(sim), sim->tick));
+    }
+}
+
+static void readLaneFiles(Simulation *sim) {
+    if (sim->rewind && sim->tick < sim->rewind->liveTick) {
+        replayArrivals(sim, 0);  // The files were read the first time through
+    }
+    else {
+        updateVehicleQueueFromFile(sim, 0, "RoadA.txt");
+        updateVehicleQueueFromFile(sim, 1, "RoadB.txt");
+        updateVehicleQueueFromFile(sim, 2, "RoadC.txt");
+        updateVehicleQueueFromFile(sim, 3, "RoadD.txt");
+    }
+    sim->lastPollTick = sim->tick;
+}
+
+// Release the front of a road's held line into the junction at full speed
+static void departFront(Simulation *sim, int road) {
+    EventEngine *engine = sim->events;
+    int slot = lineAt(engine, road, 0);
+    EventVehicle *ev = &engine->vehicles[slot];
+    popLine(engine, road);
+    ev->departTime = engine->now;
+    ev->departDistance = routes[road][0].stopLine;
+    engine->nextDeparture[road] = engine->now + DISTANCE_BETWEEN_VEHICLES / (ev->vehicle.speed / SIM_TICKS_PER_SECOND);
+    engine->lastDeparted[road] = slot;
+    scheduleExit(engine, slot);
+    scheduleDeparture(sim, road);
+}
+
+static void exitVehicle(Simulation *sim, int slot) {
+    EventEngine *engine = sim->events;
+    EventVehicle *ev = &engine->vehicles[slot];
+    int road = ev->vehicle.road - 1;
+    recordDeparture(&sim->stats, (engine->now - ev->admitted) / SIM_TICKS_PER_SECOND);
+    engine->laneCount[road][ev->vehicle.lane - 2]--;
+    if (engine->lastDeparted[road] == slot) engine->lastDeparted[road] = -1;
+    releaseEventVehicle(engine, slot);
+}
+
+// Handle every pending event before untilTick in time order, then leave the clock there.
+// Nothing is integrated in between, so an hour of traffic costs a few events per vehicle.
+static void runEvents(Simulation *sim, Uint64 untilTick) {
+    EventEngine *engine = sim->events;
+    for (;;) {
+        int event = heapTop(&engine->queue);
+        if (event < 0 || engine->queue.key[event] >= (double)untilTick) break;
+        popHeap(&engine->queue);
+        engine->now = engine->queue.key[event];
+        sim->tick = (Uint64)engine->now;
+
+        if (event == EVENT_ARRIVALS) {
+            if (sim->useLaneFiles) {
+                readLaneFiles(sim);
+                scheduleEvent(engine, EVENT_ARRIVALS, (double)(sim->tick + msToTicks(ARRIVAL_POLL_INTERVAL_MS)));
+            }
+            else {
+                spawnVehicles(sim);
+                sim->nextSpawnTick = sim->tick + sim->spawnInterval;
+                scheduleEvent(engine, EVENT_ARRIVALS, (double)sim->nextSpawnTick);
+            }
+            updateLaneScheduler(sim);
+        }
+        else if (event == EVENT_SIGNAL) {
+            removeFromHeap(&engine->queue, EVENT_DEPARTURE + sim->currentGreen);
+            switchLights(sim);
+            scheduleDeparture(sim, sim->currentGreen);  // Only once the light is green
+            scheduleEvent(engine, EVENT_SIGNAL, (double)nextSignalTick(sim));
+        }
+        else if (event < EVENT_EXIT) {
+            departFront(sim, event - EVENT_DEPARTURE);
+            updateLaneScheduler(sim);
+        }
+        else {
+            exitVehicle(sim, event - EVENT_EXIT);
+        }
+    }
+    engine->now = (double)untilTick;
+    sim->tick = untilTick;
+}
+
+static void placeEventVehicle(Queue *q, const EventVehicle *ev, float distance) {
+    Vehicle v = ev->vehicle;
+    v.distance = distance;
+    placeOnRoute(&routes[v.road - 1][v.lane - 2], distance, &v.x, &v.y);
+    enqueue(&q[v.lane - 1], v);
+}
+
+// Fill the lane queues with every vehicle's position at the current tick, for drawing or
+// reporting. Vehicles past their stop line come first, so lanes are not in driving order.
+static void materialiseEvents(Simulation *sim) {
+    EventEngine *engine = sim->events;
+    Queue *roadQueues[4] = {sim->vehicleQueueA, sim->vehicleQueueB, sim->vehicleQueueC, sim->vehicleQueueD};
+    double tick = (double)sim->tick;
+    for (int road = 0; road < 4; road++) {
+        for (int i = 0; i < 3; i++) {
+            roadQueues[road][i].head = 0;
+            roadQueues[road][i].count = 0;
+        }
+    }
+
+    for (int slot = 0; slot < engine->vehicleCapacity; slot++) {
+        const EventVehicle *ev = &engine->vehicles[slot];
+        if (ev->inUse && ev->departTime >= 0.0) {
+            float cap = IDM_FREE_ROAD;
+            placeEventVehicle(roadQueues[ev->vehicle.road - 1], ev, eventVehicleDistance(ev, tick, &cap));
+        }
+    }
+    for (int road = 0; road < 4; road++) {
+        // Held vehicles close up behind the stop line and behind whoever left it last
+        float cap = routes[road][0].stopLine;
+        if (engine->lastDeparted[road] >= 0) {
+            float free = IDM_FREE_ROAD;
+            float leader = eventVehicleDistance(&engine->vehicles[engine->lastDeparted[road]], tick, &free);
+            cap = SDL_min(cap, leader - DISTANCE_BETWEEN_VEHICLES);
+        }
+        for (int i = 0; i < engine->lineCount[road]; i++) {
+            const EventVehicle *ev = &engine->vehicles[lineAt(engine, road, i)];
+            placeEventVehicle(roadQueues[road], ev, eventVehicleDistance(ev, tick, &cap));
+        }
+    }
+}
+
+// One cell transmission update of the whole junction. Lane 2 only discharges across the
+// stop line on green; both lanes leave the screen into an unlimited sink.
+static void stepCtm(Simulation *sim) {
+    CtmJunction *ctm = sim->ctm;
+    float inSystem = 0.0f;
+    for (int road = 0; road < 4; road++) {
+        CtmLink *approach = &ctm->approach[road];
+        CtmLink *crossing = &ctm->crossing[road];
+        CtmLink *freeLane = &ctm->freeLane[road];
+
+        float enter = SDL_min(ctm->backlog[road][0], ctmLinkReceiving(approach));
+        float cross = (sim->lights[road].state == 1) ? SDL_min(ctmLinkSending(approach), ctmLinkReceiving(crossing)) : 0.0f;
+        float leave = ctmLinkSending(crossing);
+        ctm->backlog[road][0] -= enter;
+        advanceCtmLink(approach, enter, cross);
+        advanceCtmLink(crossing, cross, leave);
+        ctm->leaving += leave;
+
+        enter = SDL_min(ctm->backlog[road][1], ctmLinkReceiving(freeLane));
+        leave = ctmLinkSending(freeLane);
+        ctm->backlog[road][1] -= enter;
+        advanceCtmLink(freeLane, enter, leave);
+        ctm->leaving += leave;
+
+        inSystem += ctmLaneVehicles(ctm, road, 0) + ctmLaneVehicles(ctm, road, 1);
+    }
+
+    // Meso to micro boundary: whole vehicles leave the screen
+    while (ctm->leaving >= 1.0f) {
+        ctm->leaving -= 1.0f;
+        sim->stats.departed++;
+    }
+    // Little's law: the time spent in the system is the vehicle count integrated over time
+    sim->stats.totalTravelTime += (inSystem + ctm->leaving) * CTM_STEP_TICKS / SIM_TICKS_PER_SECOND;
+}
+
+// Put round(occupancy) vehicles, evenly spaced, into each cell of a link
+static void placeCtmLink(Queue *lane, const CtmLink *link, const Route *route) {
+    for (int i = link->cells - 1; i >= 0; i--) {
+        int count = (int)(link->vehicles[i] + 0.5f);
+        for (int j = count - 1; j >= 0; j--) {
+            Vehicle v = {0};
+            v.speed = VEHICLE_SPEED;
+            v.velocity = VEHICLE_SPEED;
+            v.distance = link->startDistance + (i + (j + 0.5f) / count) * CTM_CELL_LENGTH;
+            placeOnRoute(route, v.distance, &v.x, &v.y);
+            enqueue(lane, v);
+        }
+    }
+}
+
+// Fill the lane queues with vehicles matching the cell occupancies, front first, for drawing
+static void materialiseCtm(Simulation *sim) {
+    Queue *roadQueues[4] = {sim->vehicleQueueA, sim->vehicleQueueB, sim->vehicleQueueC, sim->vehicleQueueD};
+    for (int road = 0; road < 4; road++) {
+        for (int i = 0; i < 3; i++) {
+            roadQueues[road][i].head = 0;
+            roadQueues[road][i].count = 0;
+        }
+        placeCtmLink(&roadQueues[road][1], &sim->ctm->crossing[road], &routes[road][0]);
+        placeCtmLink(&roadQueues[road][1], &sim->ctm->approach[road], &routes[road][0]);
+        placeCtmLink(&roadQueues[road][2], &sim->ctm->freeLane[road], &routes[road][1]);
+    }
+}
+
+static inline Uint64 hashWord(Uint64 hash, Uint64 word) {
+    return (hash ^ word) * 1099511628211ULL;  // FNV-1a over 64-bit words
+}
+
+static inline Uint64 hashFloat(Uint64 hash, float value) {
+    Uint32 bits;
+    SDL_memcpy(&bits, &value, sizeof(bits));
+    return hashWord(hash, bits);
+}
+
+static inline Uint64 hashDouble(Uint64 hash, double value) {
+    Uint64 bits;
+    SDL_memcpy(&bits, &value, sizeof(bits));
+    return hashWord(hash, bits);
+}
+
+// Fingerprint of everything that decides what happens next, except the clock: lights,
+// generator, statistics and every vehicle bit for bit. For the event and cell engines the
+// lane queues are only a drawing of the engine's state, so the engine is hashed instead.
+// Reservation bookings are left out; they show up in the vehicles a tick later.
+static Uint64 hashSimulation(const Simulation *sim) {
+    Uint64 hash = 14695981039346656037ULL;
+    for (int i = 0; i < 4; i++) {
+        hash = hashWord(hash, (Uint64)sim->lights[i].state);
+    }
+    hash = hashWord(hash, (Uint64)sim->currentGreen);
+    hash = hashWord(hash, sim->lastSwitchTick);
+    hash = hashWord(hash, (Uint64)sim->signalPhase);
+    hash = hashWord(hash, sim->phaseTicks);
+    for (int lane = 0; lane < sim->lanes.laneCount; lane++) {
+        hash = hashWord(hash, sim->lanes.servedTick[lane]);
+        hash = hashWord(hash, sim->lanes.heap.order[lane]);
+    }
+    hash = hashWord(hash, (Uint64)sim->lanes.priorityActive);
+    hash = hashWord(hash, sim->lastPollTick);
+    hash = hashWord(hash, sim->nextSpawnTick);
+    hash = hashWord(hash, sim->rngState);
+    hash = hashWord(hash, sim->nextVehicleId);
+    const SimulationStats *st = &sim->stats;
+    hash = hashWord(hash, st->arrived);
+    hash = hashWord(hash, st->rejected);
+    hash = hashWord(hash, st->departed);
+    hash = hashDouble(hash, st->totalTravelTime);
+    hash = hashWord(hash, (Uint64)st->maxQueueLength);
+    hash = hashWord(hash, st->reservationDenials);
+    hash = hashWord(hash, st->overlapPairs);
+
+    if (sim->events) {
+        const EventEngine *engine = sim->events;
+        for (int i = 0; i < engine->vehicleCapacity; i++) {
+            const EventVehicle *ev = &engine->vehicles[i];
+            if (!ev->inUse) continue;
+            hash = hashWord(hash, ev->vehicle.id);
+            hash = hashDouble(hash, ev->admitted);
+            hash = hashDouble(hash, ev->lineTime);
+            hash = hashDouble(hash, ev->departTime);
+        }
+        for (int i = 0; i < engine->queue.size; i++) {
+            hash = hashWord(hash, (Uint64)engine->queue.heap[i]);
+            hash = hashDouble(hash, engine->queue.key[engine->queue.heap[i]]);
+        }
+        return hash;
+    }
+    if (sim->ctm) {
+        const CtmJunction *ctm = sim->ctm;
+        for (int road = 0; road < 4; road++) {
+            const CtmLink *links[3] = {&ctm->approach[road], &ctm->crossing[road], &ctm->freeLane[road]};
+            for (int l = 0; l < 3; l++) {
+                for (int c = 0; c < links[l]->cells; c++) {
+                    hash = hashFloat(hash, links[l]->vehicles[c]);
+                }
+            }
+            hash = hashFloat(hash, ctm->backlog[road][0]);
+            hash = hashFloat(hash, ctm->backlog[road][1]);
+        }
+        return hashFloat(hash, ctm->leaving);
+    }
+    const Queue *roadQueues[4] = {sim->vehicleQueueA, sim->vehicleQueueB, sim->vehicleQueueC, sim->vehicleQueueD};
+    for (int road = 0; road < 4; road++) {
+        for (int i = 0; i < 3; i++) {
+            const Queue *q = &roadQueues[road][i];
+            hash = hashWord(hash, (Uint64)q->count);
+            hash = hashWord(hash, (Uint64)q->asleep);
+            hash = hashWord(hash, (Uint64)q->crossed);
+            for (int k = q->head; k < q->head + q->count; k++) {
+                hash = hashFloat(hash, q->x[k]);
+                hash = hashFloat(hash, q->y[k]);
+                hash = hashFloat(hash, q->speed[k]);
+                hash = hashFloat(hash, q->distance[k]);
+                hash = hashFloat(hash, q->velocity[k]);
+                hash = hashWord(hash, q->arrivalTick[k]);
+                hash = hashWord(hash, (Uint64)q->id[k] << 8 | q->committed[k]);
+            }
+        }
+    }
+    return hash;
+}
+
+// Fold every tick the clock has passed since the last call into the rolling checksum.
+// Ticks skipped while idle leave the state unchanged, so they all share one state hash
+// and a run gives the same trace whether or not it skips.
+static void recordChecksums(Simulation *sim) {
+    ChecksumTrace *trace = sim->trace;
+    if (!trace || sim->tick <= trace->tick) return;
+    Uint64 state = hashSimulation(sim);
+    for (Uint64 t = trace->tick + 1; t <= sim->tick; t++) {
+        trace->checksum = hashWord(hashWord(trace->checksum, t), state);
+        if (trace->out) {
+            fprintf(trace->out, "%llu %016llx\n", (unsigned long long)t, (unsigned long long)trace->checksum);
+        }
+        if (trace->reference && !trace->divergedTick) {
+            unsigned long long refTick, refChecksum;
+            if (fscanf(trace->reference, "%llu %llx", &refTick, &refChecksum) != 2) {
+                printf("Reference trace ends before tick %llu.\n", (unsigned long long)t);
+                fclose(trace->reference);
+                trace->reference = NULL;
+            }
+            else if (refTick != t || refChecksum != trace->checksum) {
+                trace->divergedTick = t;
+                printf("Diverged from the reference at tick %llu (%.2f s): expected %016llx, got %016llx\n",
+                       (unsigned long long)t, (double)t / SIM_TICKS_PER_SECOND, refChecksum,
+                       (unsigned long long)trace->checksum);
+            }
+        }
+    }
+    trace->tick = sim->tick;
+}
+
+// True when no vehicle can move before the next light change or arrival: lane 3 is empty
+// and every lane 2 vehicle is asleep behind a red light
+static int isJunctionIdle(const Simulation *sim) {
+    const Queue *roadQueues[4] = {sim->vehicleQueueA, sim->vehicleQueueB, sim->vehicleQueueC, sim->vehicleQueueD};
+    for (int road = 0; road < 4; road++) {
+        const Queue *q = roadQueues[road];
+        if (q[1].count > q[1].asleep || q[2].count > 0) return 0;
+        if (sim->grid && q[1].count > 0) return 0;  // The audit counts standing vehicles every tick
+    }
+    if (sim->ctm) {
+        for (int road = 0; road < 4; road++) {
+            if (ctmLaneVehicles(sim->ctm, road, 0) > 0.0f || ctmLaneVehicles(sim->ctm, road, 1) > 0.0f) return 0;
+        }
+    }
+    return 1;
+}
+
+// If nothing is moving, jump the clock to the next tick at which a light changes or
+// arrivals are picked up, but no further than limitTick. Every tick skipped would have
+// done nothing, so the result is the same as stepping. Returns the ticks skipped.
+static Uint64 skipIdleTicks(Simulation *sim, Uint64 limitTick) {
+    if (sim->events || !isJunctionIdle(sim)) return 0;
+    Uint64 next = nextSignalTick(sim);
+    Uint64 arrival = sim->useLaneFiles ? sim->lastPollTick + msToTicks(ARRIVAL_POLL_INTERVAL_MS)
+                                       : sim->nextSpawnTick;
+    if (arrival < next) next = arrival;
+    if (sim->rewind) {
+        Uint64 injection = nextInjectionTick(sim->rewind, sim->tick);
+        if (injection < next) next = injection;
+    }
+    if (next > limitTick) next = limitTick;
+    if (next <= sim->tick) return 0;
+    Uint64 skipped = next - sim->tick;
+    sim->tick = next;
+    recordChecksums(sim);
+    return skipped;
+}
+
+// Advance the junction by one fixed tick of SIM_DT simulated seconds
+static void stepSimulation(Simulation *sim) {
+    // After a rewind, vehicles injected before this tick was first stepped come back first
+    if (sim->rewind && replayArrivals(sim, 1) > 0) {
+        updateLaneScheduler(sim);  // As trafficSimInject() did
+    }
+
+    if (sim->events) {
+        runEvents(sim, sim->tick + 1);
+        recordChecksums(sim);
+        return;
+    }
+
+    // Move the signal on when its phase is over; greens are sized to the queue they serve
+    updateLaneScheduler(sim);
+    if (sim->tick - sim->lastSwitchTick >= sim->phaseTicks) {
+        switchLights(sim);
+    }
+
+    // Pick up newly generated vehicles at a fixed simulated interval
+    if (sim->useLaneFiles) {
+        if (sim->tick - sim->lastPollTick >= msToTicks(ARRIVAL_POLL_INTERVAL_MS)) {
+            readLaneFiles(sim);
+        }
+    }
+    else if (sim->tick >= sim->nextSpawnTick) {
+        spawnVehicles(sim);
+        sim->nextSpawnTick = sim->tick + sim->spawnInterval;
+    }
+
+    if (sim->ctm) {
+        if (sim->tick % CTM_STEP_TICKS == 0) {
+            stepCtm(sim);
+        }
+        sim->tick++;
+        recordChecksums(sim);
+        return;
+    }
+
+    // Parallel phase: each approach only reads the lights and writes its own queues
+    runParallel(sim->pool, updateRoadTask, sim, 4);
+
+    // Serial phase: resolve the junction box and vehicles leaving it in a fixed road order
+    if (sim->reservations) {
+        resolveReservations(sim);
+    }
+    removeExitedVehicles(sim);
+    if (sim->grid) {
+        auditCollisions(sim);
+    }
+    sim->tick++;
+    recordChecksums(sim);
+}
+
+// Vehicles on the roads; event engine queues must have been materialised
+static int countQueuedVehicles(const Simulation *sim) {
+    int queued = 0;
+    for (int i = 0; i < 3; i++) {
+        queued += sim->vehicleQueueA[i].count + sim->vehicleQueueB[i].count +
+                  sim->vehicleQueueC[i].count + sim->vehicleQueueD[i].count;
+    }
+    if (sim->ctm) {
+        // Includes vehicles still waiting to enter, which are not drawn
+        float total = 0.0f;
+        for (int road = 0; road < 4; road++) {
+            total += ctmLaneVehicles(sim->ctm, road, 0) + ctmLaneVehicles(sim->ctm, road, 1);
+        }
+        queued = (int)(total + 0.5f);
+    }
+    return queued;
+}
+
+// Print the totals gathered by a headless run
+static void printSummary(const Simulation *sim, double wallSeconds) {
+    const SimulationStats *s = &sim->stats;
+    double simSeconds = (double)sim->tick / SIM_TICKS_PER_SECOND;
+    int queued = countQueuedVehicles(sim);
+
+    printf("Simulated time:      %.1f s (%llu ticks)\n", simSeconds, (unsigned long long)sim->tick);
+    printf("Wall-clock time:     %.3f s (%.0fx real time)\n", wallSeconds,
+           wallSeconds > 0.0 ? simSeconds / wallSeconds : 0.0);
+    printf("Vehicles arrived:    %llu\n", (unsigned long long)s->arrived);
+    printf("Vehicles rejected:   %llu (lane full)\n", (unsigned long long)s->rejected);
+    printf("Vehicles departed:   %llu (%.1f per hour)\n", (unsigned long long)s->departed,
+           simSeconds > 0.0 ? s->departed * 3600.0 / simSeconds : 0.0);
+    printf("Still queued:        %d\n", queued);
+    printf("Mean time in system: %.2f s\n", s->departed ? s->totalTravelTime / s->departed : 0.0);
+    if (!sim->ctm) {
+        printf("95th percentile:     %.2f s\n", travelTimePercentile(s, 0.95));
+    }
+    printf("Longest lane queue:  %d\n", s->maxQueueLength);
+    if (sim->reservations) {
+        printf("Junction denials:    %llu\n", (unsigned long long)s->reservationDenials);
+    }
+    if (sim->grid) {
+        printf("Overlapping pairs:   %llu vehicle-ticks (%llu between different lanes)\n",
+               (unsigned long long)s->overlapPairs, (unsigned long long)s->crossLaneOverlaps);
+    }
+    if (sim->trace) {
+        printf("Checksum:            %016llx\n", (unsigned long long)sim->trace->checksum);
+        if (sim->trace->divergedTick) {
+            printf("Reference:           diverged at tick %llu\n", (unsigned long long)sim->trace->divergedTick);
+        }
+        else if (sim->trace->reference) {
+            printf("Reference:           identical\n");
+        }
+    }
+}
+
+// Checkpoints: the whole junction state in one binary file, written in the in-memory layout
+// of this build so that loading is a bounds-checked copy out of a memory-mapped file.
+// Run options (arrival source, spawn interval, lane capacity, signal timing, audit) are not
+// saved; the engine, car-following model and reservations are, since the state depends on
+// them. The length of the signal phase under way and the lane scheduler's turns and
+// priority are part of the state.
+#define CHECKPOINT_MAGIC "TSIMCKPT"
+#define CHECKPOINT_VERSION 4
+#define CHECKPOINT_RESERVATIONS 1  // Parts present after the common state
+#define CHECKPOINT_EVENTS 2
+#define CHECKPOINT_CTM 4
+#define CHECKPOINT_MAX_VEHICLES (1 << 24)  // Sanity limit on counts read back
+
+typedef struct {
+    char magic[8];
+    Uint32 version;
+    Uint32 parts;             // CHECKPOINT_* flags
+    Uint32 sizes[4];          // Struct sizes of the writing build, which must match
+    Uint64 bodyHash;          // FNV-1a of every byte after the header
+    Uint64 stateHash;         // hashSimulation() when saved, checked after loading
+    Uint64 traceChecksum;     // Rolling checksum at the saved tick (deterministic runs)
+    Uint32 hasTrace;
+    Uint32 followModel;
+} CheckpointHeader;
+
+typedef struct {
+    FILE *fp;                 // File being written, or NULL to write to buffer
+    int ok;
+    Uint64 hash;              // Of the bytes written so far
+    Uint8 *buffer;            // In-memory image, grown as needed
+    size_t length, capacity;
+} CheckpointWriter;
+
+typedef struct {
+    const Uint8 *data;
+    size_t size, offset;
+    int ok;
+} CheckpointReader;
+
+// A read-only view of a whole file
+typedef struct {
+    const Uint8 *data;
+    size_t size;
+#ifdef _WIN32
+    HANDLE file, mapping;
+#endif
+} MappedFile;
+
+static int mapFile(MappedFile *map, const char *filename) {
+#ifdef _WIN32
+    LARGE_INTEGER size;
+    map->data = NULL;
+    map->mapping = NULL;
+    map->file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (map->file == INVALID_HANDLE_VALUE) return 0;
+    if (GetFileSizeEx(map->file, &size) && size.QuadPart > 0) {
+        map->size = (size_t)size.QuadPart;
+        map->mapping = CreateFileMappingA(map->file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (map->mapping) map->data = (const Uint8 *)MapViewOfFile(map->mapping, FILE_MAP_READ, 0, 0, 0);
+    }
+    if (!map->data) {
+        if (map->mapping) CloseHandle(map->mapping);
+        CloseHandle(map->file);
+        return 0;
+    }
+    return 1;
+#else
+    struct stat info;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return 0;
+    map->data = NULL;
+    if (fstat(fd, &info) == 0 && info.st_size > 0) {
+        map->size = (size_t)info.st_size;
+        void *data = mmap(NULL, map->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) map->data = (const Uint8 *)data;
+    }
+    close(fd);  // The mapping stays valid
+    return map->data != NULL;
+#endif
+}
+
+static void unmapFile(MappedFile *map) {
+#ifdef _WIN32
+    UnmapViewOfFile(map->data);
+    CloseHandle(map->mapping);
+    CloseHandle(map->file);
+#else
+    munmap((void *)map->data, map->size);
+#endif
+    map->data = NULL;
+}
+
+static Uint64 hashBytes(Uint64 hash, const void *data, size_t size) {
+    const Uint8 *bytes = (const Uint8 *)data;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+static void writeCheckpoint(CheckpointWriter *w, const void *data, size_t size) {
+    if (!w->ok || size == 0) return;
+    if (w->fp) {
+        if (fwrite(data, 1, size, w->fp) != size) w->ok = 0;
+    }
+    else {
+        if (w->length + size > w->capacity) {
+            w->capacity = SDL_max(w->capacity * 2, w->length + size);
+            w->buffer = (Uint8 *)realloc(w->buffer, w->capacity);
+        }
+        memcpy(w->buffer + w->length, data, size);
+        w->length += size;
+    }
+    w->hash = hashBytes(w->hash, data, size);
+}
+
+// Copy the next size bytes out of the file; past the end, fail and leave zeros
+static void readCheckpoint(CheckpointReader *r, void *data, size_t size) {
+    if (size == 0) return;
+    if (!r->ok || size > r->size - r->offset) {
+        r->ok = 0;
+        memset(data, 0, size);
+        return;
+    }
+    memcpy(data, r->data + r->offset, size);
+    r->offset += size;
+}
+
+// Whether count items of itemSize bytes are left to read, checked before allocating them
+static int checkpointHasRoom(const CheckpointReader *r, Sint64 count, size_t itemSize) {
+    return r->ok && count >= 0 && count <= CHECKPOINT_MAX_VEHICLES && (size_t)count * itemSize <= r->size - r->offset;
+}
+
+static void writeQueue(CheckpointWriter *w, const Queue *q) {
+    int h = q->head, n = q->count;
+    writeCheckpoint(w, &q->count, sizeof(int));
+    writeCheckpoint(w, &q->asleep, sizeof(int));
+    writeCheckpoint(w, &q->crossed, sizeof(int));
+    writeCheckpoint(w, q->x + h, n * sizeof(float));
+    writeCheckpoint(w, q->y + h, n * sizeof(float));
+    writeCheckpoint(w, q->speed + h, n * sizeof(float));
+    writeCheckpoint(w, q->arrivalTick + h, n * sizeof(Uint64));
+    writeCheckpoint(w, q->distance + h, n * sizeof(float));
+    writeCheckpoint(w, q->velocity + h, n * sizeof(float));
+    writeCheckpoint(w, q->id + h, n * sizeof(Uint32));
+    writeCheckpoint(w, q->committed + h, n * sizeof(Uint8));
+}
+
+static void readQueue(CheckpointReader *r, Queue *q) {
+    int n;
+    readCheckpoint(r, &n, sizeof(int));
+    readCheckpoint(r, &q->asleep, sizeof(int));
+    readCheckpoint(r, &q->crossed, sizeof(int));
+    q->head = 0;
+    q->count = 0;
+    if (!checkpointHasRoom(r, n, 5 * sizeof(float) + sizeof(Uint64) + sizeof(Uint32) + sizeof(Uint8))) {
+        r->ok = 0;
+        return;
+    }
+    while (q->count < n) {
+        reserveQueueSlot(q);
+        q->count++;
+    }
+    readCheckpoint(r, q->x, n * sizeof(float));
+    readCheckpoint(r, q->y, n * sizeof(float));
+    readCheckpoint(r, q->speed, n * sizeof(float));
+    readCheckpoint(r, q->arrivalTick, n * sizeof(Uint64));
+    readCheckpoint(r, q->distance, n * sizeof(float));
+    readCheckpoint(r, q->velocity, n * sizeof(float));
+    readCheckpoint(r, q->id, n * sizeof(Uint32));
+    readCheckpoint(r, q->committed, n * sizeof(Uint8));
+}
+
+static void fillCheckpointSizes(Uint32 sizes[4]) {
+    sizes[0] = sizeof(SimulationStats);
+    sizes[1] = sizeof(ReservationTable);
+    sizes[2] = sizeof(EventEngine);
+    sizes[3] = sizeof(EventVehicle);
+}
+
+// Write the complete state of sim, header first, to a file or a memory buffer
+static void writeSimulationState(const Simulation *sim, CheckpointWriter *w) {
+    CheckpointHeader header;
+    SDL_zero(header);
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.version = CHECKPOINT_VERSION;
+    header.parts = (sim->reservations ? CHECKPOINT_RESERVATIONS : 0) | (sim->events ? CHECKPOINT_EVENTS : 0) |
+                   (sim->ctm ? CHECKPOINT_CTM : 0);
+    fillCheckpointSizes(header.sizes);
+    header.stateHash = hashSimulation(sim);
+    header.hasTrace = sim->trace != NULL;
+    header.traceChecksum = sim->trace ? sim->trace->checksum : 0;
+    header.followModel = (Uint32)sim->followModel;
+    writeCheckpoint(w, &header, sizeof(header));  // Rewritten with bodyHash at the end
+    w->hash = 14695981039346656037ULL;
+
+    writeCheckpoint(w, sim->lights, sizeof(sim->lights));
+    writeCheckpoint(w, &sim->currentGreen, sizeof(sim->currentGreen));
+    writeCheckpoint(w, &sim->tick, sizeof(sim->tick));
+    writeCheckpoint(w, &sim->lastSwitchTick, sizeof(sim->lastSwitchTick));
+    writeCheckpoint(w, &sim->signalPhase, sizeof(sim->signalPhase));
+    writeCheckpoint(w, &sim->phaseTicks, sizeof(sim->phaseTicks));
+    writeCheckpoint(w, sim->lanes.servedTick, 4 * sizeof(Uint64));
+    writeCheckpoint(w, sim->lanes.heap.order, 4 * sizeof(Uint64));
+    writeCheckpoint(w, &sim->lanes.nextOrder, sizeof(sim->lanes.nextOrder));
+    writeCheckpoint(w, &sim->lanes.priorityActive, sizeof(sim->lanes.priorityActive));
+    writeCheckpoint(w, &sim->lastPollTick, sizeof(sim->lastPollTick));
+    writeCheckpoint(w, &sim->nextSpawnTick, sizeof(sim->nextSpawnTick));
+    writeCheckpoint(w, &sim->rngState, sizeof(sim->rngState));
+    writeCheckpoint(w, &sim->nextVehicleId, sizeof(sim->nextVehicleId));
+    writeCheckpoint(w, &sim->stats, sizeof(sim->stats));
+    const Queue *roadQueues[4] = {sim->vehicleQueueA, sim->vehicleQueueB, sim->vehicleQueueC, sim->vehicleQueueD};
+    for (int road = 0; road < 4; road++) {
+        for (int i = 0; i < 3; i++) {
+            writeQueue(w, &roadQueues[road][i]);
+        }
+    }
+
+    if (sim->reservations) {
+        writeCheckpoint(w, sim->reservations, sizeof(ReservationTable));
+    }
+    if (sim->events) {
+        // The struct as is, then what its pointers point to
+        const EventEngine *engine = sim->events;
+        int capacity = engine->queue.capacity;
+        writeCheckpoint(w, engine, sizeof(EventEngine));
+        writeCheckpoint(w, engine->queue.heap, capacity * sizeof(int));
+        writeCheckpoint(w, engine->queue.position, capacity * sizeof(int));
+        writeCheckpoint(w, engine->queue.key, capacity * sizeof(double));
+        writeCheckpoint(w, engine->queue.order, capacity * sizeof(Uint64));
+        writeCheckpoint(w, engine->vehicles, engine->vehicleCapacity * sizeof(EventVehicle));
+        for (int road = 0; road < 4; road++) {
+            writeCheckpoint(w, engine->line[road], engine->lineCapacity[road] * sizeof(int));
+        }
+    }
+    if (sim->ctm) {
+        const CtmJunction *ctm = sim->ctm;
+        writeCheckpoint(w, ctm->backlog, sizeof(ctm->backlog));
+        writeCheckpoint(w, &ctm->leaving, sizeof(ctm->leaving));
+        for (int road = 0; road < 4; road++) {
+            const CtmLink *links[3] = {&ctm->approach[road], &ctm->crossing[road], &ctm->freeLane[road]};
+            for (int l = 0; l < 3; l++) {
+                writeCheckpoint(w, links[l]->vehicles, links[l]->cells * sizeof(float));
+            }
+        }
+    }
+    header.bodyHash = w->hash;
+    if (!w->ok) return;
+    if (!w->fp) {
+        memcpy(w->buffer, &header, sizeof(header));
+    }
+    else if (fseek(w->fp, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, w->fp) != 1) {
+        w->ok = 0;
+    }
+}
+
+// Write the complete state of sim to filename. Returns 0 on failure.
+static int saveCheckpoint(const Simulation *sim, const char *filename) {
+    CheckpointWriter w = {fopen(filename, "wb"), 1, 0};
+    if (!w.fp) {
+        printf("Error opening %s for writing.\n", filename);
+        return 0;
+    }
+    writeSimulationState(sim, &w);
+    if (fclose(w.fp) != 0) w.ok = 0;
+    if (!w.ok) printf("Error writing %s.\n", filename);
+    return w.ok;
+}
+
+// Replace the state of sim with the checkpoint image in data, called name in messages.
+// The engine, car-following model and reservations follow the image; everything else set
+// on the command line is kept.
+static int readSimulationState(Simulation *sim, const Uint8 *data, size_t size, const char *name) {
+    CheckpointReader r = {data, size, 0, 1};
+    CheckpointHeader header;
+    Uint32 sizes[4];
+    fillCheckpointSizes(sizes);
+    readCheckpoint(&r, &header, sizeof(header));
+    if (!r.ok || memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != CHECKPOINT_VERSION) {
+        printf("%s is not a checkpoint.\n", name);
+        return 0;
+    }
+    if (memcmp(header.sizes, sizes, sizeof(sizes)) != 0) {
+        printf("%s was written by a different build of the simulator.\n", name);
+        return 0;
+    }
+    if (hashBytes(14695981039346656037ULL, data + r.offset, size - r.offset) != header.bodyHash) {
+        printf("%s is damaged or incomplete.\n", name);
+        return 0;
+    }
+
+    // Start from empty engines of the kind the file holds
+    releaseReservationTable(sim->reservations);
+    destroyEventEngine(sim->events);
+    destroyCtmJunction(sim->ctm);
+    sim->reservations = (header.parts & CHECKPOINT_RESERVATIONS) ? createReservationTable() : NULL;
+    sim->events = NULL;
+    sim->ctm = (header.parts & CHECKPOINT_CTM) ? createCtmJunction() : NULL;
+    sim->followModel = (int)header.followModel;
+
+    readCheckpoint(&r, sim->lights, sizeof(sim->lights));
+    readCheckpoint(&r, &sim->currentGreen, sizeof(sim->currentGreen));
+    readCheckpoint(&r, &sim->tick, sizeof(sim->tick));
+    readCheckpoint(&r, &sim->lastSwitchTick, sizeof(sim->lastSwitchTick));
+    readCheckpoint(&r, &sim->signalPhase, sizeof(sim->signalPhase));
+    readCheckpoint(&r, &sim->phaseTicks, sizeof(sim->phaseTicks));
+    readCheckpoint(&r, sim->lanes.servedTick, 4 * sizeof(Uint64));
+    readCheckpoint(&r, sim->lanes.heap.order, 4 * sizeof(Uint64));
+    readCheckpoint(&r, &sim->lanes.nextOrder, sizeof(sim->lanes.nextOrder));
+    readCheckpoint(&r, &sim->lanes.priorityActive, sizeof(sim->lanes.priorityActive));
+    readCheckpoint(&r, &sim->lastPollTick, sizeof(sim->lastPollTick));
+    readCheckpoint(&r, &sim->nextSpawnTick, sizeof(sim->nextSpawnTick));
+    readCheckpoint(&r, &sim->rngState, sizeof(sim->rngState));
+    readCheckpoint(&r, &sim->nextVehicleId, sizeof(sim->nextVehicleId));
+    readCheckpoint(&r, &sim->stats, sizeof(sim->stats));
+    Queue *roadQueues[4] = {sim->vehicleQueueA, sim->vehicleQueueB, sim->vehicleQueueC, sim->vehicleQueueD};
+    for (int road = 0; road < 4; road++) {
+        for (int i = 0; i < 3; i++) {
+            readQueue(&r, &roadQueues[road][i]);
+        }
+    }
+
+    if (sim->reservations) {
+        readCheckpoint(&r, sim->reservations, sizeof(ReservationTable));
+        SDL_SetAtomicInt(&sim->reservations->refs, 1);
+    }
+    if (header.parts & CHECKPOINT_EVENTS) {
+        EventEngine *engine = (EventEngine *)calloc(1, sizeof(EventEngine));
+        readCheckpoint(&r, engine, sizeof(EventEngine));
+        int capacity = engine->queue.capacity, size = engine->queue.size;
+        initHeap(&engine->queue);
+        engine->vehicles = NULL;
+        for (int road = 0; road < 4; road++) {
+            engine->line[road] = NULL;
+        }
+        sim->events = engine;  // Freed with the simulation even if the rest is bad
+        if (!checkpointHasRoom(&r, capacity, 2 * sizeof(int) + sizeof(double) + sizeof(Uint64))) {
+            r.ok = 0;
+        }
+        else {
+            growHeap(&engine->queue, capacity);
+            readCheckpoint(&r, engine->queue.heap, capacity * sizeof(int));
+            readCheckpoint(&r, engine->queue.position, capacity * sizeof(int));
+            readCheckpoint(&r, engine->queue.key, capacity * sizeof(double));
+            readCheckpoint(&r, engine->queue.order, capacity * sizeof(Uint64));
+            engine->queue.size = SDL_clamp(size, 0, capacity);
+        }
+        if (!checkpointHasRoom(&r, engine->vehicleCapacity, sizeof(EventVehicle))) {
+            engine->vehicleCapacity = 0;
+            r.ok = 0;
+        }
+        engine->vehicles = (EventVehicle *)malloc(SDL_max(engine->vehicleCapacity, 1) * sizeof(EventVehicle));
+        readCheckpoint(&r, engine->vehicles, engine->vehicleCapacity * sizeof(EventVehicle));
+        for (int road = 0; road < 4; road++) {
+            if (!checkpointHasRoom(&r, engine->lineCapacity[road], sizeof(int))) {
+                engine->lineCapacity[road] = 0;
+                r.ok = 0;
+            }
+            engine->line[road] = (int *)malloc(SDL_max(engine->lineCapacity[road], 1) * sizeof(int));
+            readCheckpoint(&r, engine->line[road], engine->lineCapacity[road] * sizeof(int));
+        }
+    }
+    if (sim->ctm) {
+        CtmJunction *ctm = sim->ctm;
+        readCheckpoint(&r, ctm->backlog, sizeof(ctm->backlog));
+        readCheckpoint(&r, &ctm->leaving, sizeof(ctm->leaving));
+        for (int road = 0; road < 4; road++) {
+            CtmLink *links[3] = {&ctm->approach[road], &ctm->crossing[road], &ctm->freeLane[road]};
+            for (int l = 0; l < 3; l++) {
+                readCheckpoint(&r, links[l]->vehicles, links[l]->cells * sizeof(float));
+            }
+        }
+    }
+    // The lane scheduler's queue counts are not saved; they are read off the engine
+    for (int road = 0; road < 4; road++) {
+        sim->lanes.waiting[road] = waitingOnLane2(sim, road);
+    }
+    rebuildLaneHeap(&sim->lanes);
+    if (!r.ok || r.offset != r.size || hashSimulation(sim) != header.stateHash) {
+        printf("%s is damaged or incomplete.\n", name);
+        return 0;
+    }
+    if (sim->trace) {
+        // Carry on the checksum chain, and skip the part of a reference trace already run
+        ChecksumTrace *trace = sim->trace;
+        trace->tick = sim->tick;
+        if (header.hasTrace) {
+            trace->checksum = header.traceChecksum;
+        }
+        else if (trace->reference) {
+            printf("%s was saved without --deterministic, so it cannot be compared with a trace.\n", name);
+            fclose(trace->reference);
+            trace->reference = NULL;
+        }
+        unsigned long long refTick = 0, refChecksum;
+        while (trace->reference && refTick < sim->tick &&
+               fscanf(trace->reference, "%llu %llx", &refTick, &refChecksum) == 2) {
+        }
+    }
+    return 1;
+}
+
+// Replace the state of sim with the checkpoint in filename. Returns 0 on failure, leaving
+// sim as it was: the file is read into a fork, which takes sim's place only once it checks out.
+static int loadCheckpoint(Simulation *sim, const char *filename) {
+    MappedFile map;
+    if (!mapFile(&map, filename)) {
+        printf("Error opening %s for reading.\n", filename);
+        return 0;
+    }
+    Simulation loaded;
+    forkSimulation(&loaded, sim);  // Keeps the settings a checkpoint does not hold
+    loaded.trace = sim->trace;     // Only moved on once the state has checked out
+    int ok = readSimulationState(&loaded, map.data, map.size, filename);
+    unmapFile(&map);
+    if (!ok) {
+        loaded.trace = NULL;
+        freeSimulation(&loaded);
+        return 0;
+    }
+    loaded.useLaneFiles = sim->useLaneFiles;
+    loaded.pool = sim->pool;
+    loaded.grid = sim->grid;
+    loaded.rewind = sim->rewind;
+    sim->trace = NULL;
+    sim->grid = NULL;
+    sim->rewind = NULL;
+    freeSimulation(sim);
+    *sim = loaded;
+    return 1;
+}
+
+// Drop the oldest keyframe, and the logged arrivals only a rewind to it would replay
+static void dropOldestKeyframe(RewindBuffer *rb) {
+    rb->used -= rb->keyframes[0].size;
+    free(rb->keyframes[0].data);
+    rb->keyframeCount--;
+    memmove(rb->keyframes, rb->keyframes + 1, rb->keyframeCount * sizeof(Keyframe));
+    int stale = 0;
+    while (stale < rb->arrivalCount && rb->arrivals[stale].tick < rb->keyframes[0].tick) {
+        stale++;
+    }
+    rb->arrivalCount -= stale;
+    memmove(rb->arrivals, rb->arrivals + stale, rb->arrivalCount * sizeof(LoggedArrival));
+    rb->replayIndex = SDL_max(rb->replayIndex - stale, 0);
+    rb->replayEnd = SDL_max(rb->replayEnd - stale, 0);
+    rb->used -= stale * sizeof(LoggedArrival);
+}
+
+// Call whenever the window clock has moved: keep a keyframe every interval ticks of new
+// ground, then forget the oldest history until it fits in the memory budget
+static void recordRewind(Simulation *sim) {
+    RewindBuffer *rb = sim->rewind;
+    if (!rb) return;
+    if (sim->tick > rb->liveTick) {
+        rb->liveTick = sim->tick;
+    }
+    if (rb->keyframeCount > 0 && sim->tick < rb->keyframes[rb->keyframeCount - 1].tick + rb->interval) return;
+
+    CheckpointWriter w = {NULL, 1, 0};
+    writeSimulationState(sim, &w);
+    if (rb->keyframeCount == rb->keyframeCapacity) {
+        rb->keyframeCapacity = rb->keyframeCapacity ? rb->keyframeCapacity * 2 : 16;
+        rb->keyframes = (Keyframe *)realloc(rb->keyframes, rb->keyframeCapacity * sizeof(Keyframe));
+    }
+    Keyframe *keyframe = &rb->keyframes[rb->keyframeCount++];
+    keyframe->tick = sim->tick;
+    keyframe->data = (Uint8 *)realloc(w.buffer, w.length);
+    keyframe->size = w.length;
+    rb->used += w.length;
+    while (rb->used > rb->budget && rb->keyframeCount > 1) {
+        dropOldestKeyframe(rb);
+    }
+}
+
+// Take the simulation back to targetTick, or to the oldest tick still held: restore the
+// last keyframe at or before it and step forward from there, replaying logged arrivals.
+// Stepping is deterministic, so this is exactly the state the junction was in at that
+// tick, and carrying on re-simulates the same future. Returns 0 without any history.
+static int rewindSimulation(Simulation *sim, Uint64 targetTick) {
+    RewindBuffer *rb = sim->rewind;
+    if (!rb || rb->keyframeCount == 0) return 0;
+    if (sim->tick > rb->liveTick) {
+        rb->liveTick = sim->tick;
+    }
+    int k = rb->keyframeCount - 1;
+    while (k > 0 && rb->keyframes[k].tick > targetTick) {
+        k--;
+    }
+    if (targetTick < rb->keyframes[k].tick) {
+        targetTick = rb->keyframes[k].tick;
+    }
+    if (sim->trace) {
+        // Trace files follow one pass through time; only the checksum chain carries on
+        if (sim->trace->out) fclose(sim->trace->out);
+        if (sim->trace->reference) fclose(sim->trace->reference);
+        sim->trace->out = NULL;
+        sim->trace->reference = NULL;
+    }
+    if (!readSimulationState(sim, rb->keyframes[k].data, rb->keyframes[k].size, "Rewind keyframe")) return 0;
+    rb->replayIndex = 0;
+    rb->replayEnd = rb->arrivalCount;
+    while (rb->replayIndex < rb->arrivalCount && rb->arrivals[rb->replayIndex].tick < sim->tick) {
+        rb->replayIndex++;
+    }
+    while (sim->tick < targetTick) {
+        if (!skipIdleTicks(sim, targetTick)) {
+            stepSimulation(sim);
+        }
+    }
+    return 1;
+}
+
+// What-if rollouts: the next light change as planned, or brought forward to now, 5, 10
+// or 15 s from now, each run ahead from its own fork of the current state
+#define WHAT_IF_BRANCHES 5
+#define WHAT_IF_STEP_MS 5000
+
+typedef struct {
+    Simulation *branches;
+    Uint64 endTick;
+} WhatIf;
+
+// Thread pool task: run one fork to the end of the rollout
+static void advanceForkTask(void *context, int index) {
+    WhatIf *whatIf = (WhatIf *)context;
+    Simulation *sim = &whatIf->branches[index];
+    while (sim->tick < whatIf->endTick) {
+        if (!skipIdleTicks(sim, whatIf->endTick)) {
+            stepSimulation(sim);
+        }
+    }
+    if (sim->events) {
+        materialiseEvents(sim);
+    }
+    if (sim->ctm) {
+        materialiseCtm(sim);
+    }
+}
+
+// Advance count forks to endTick side by side, one fork at a time per pool thread
+static void advanceForks(Simulation *branches, int count, Uint64 endTick, ThreadPool *pool) {
+    WhatIf whatIf = {branches, endTick};
+    runParallel(pool, advanceForkTask, &whatIf, count);
+}
+
+// Move the next light change to tick, no later than the whole current phase from now.
+// lastSwitchTick may wrap below zero; only differences from it are used.
+static void setNextSwitch(Simulation *sim, Uint64 tick) {
+    tick = SDL_clamp(tick, sim->tick, sim->tick + sim->phaseTicks);
+    sim->lastSwitchTick = tick - sim->phaseTicks;
+    if (sim->events) {
+        scheduleEvent(sim->events, EVENT_SIGNAL, (double)tick);
+    }
+}
+
+// Roll each choice for the next light change forward for durationSeconds and compare.
+// setNextSwitch can pull a choice onto another one; such a fork is dropped rather than
+// run twice under two labels.
+static void runWhatIf(const Simulation *sim, double durationSeconds, ThreadPool *pool) {
+    Simulation branches[WHAT_IF_BRANCHES];
+    Uint64 after[WHAT_IF_BRANCHES];  // Ticks from now to the change each fork applies
+    int count = 0;
+    Uint64 endTick = sim->tick + (Uint64)(durationSeconds * SIM_TICKS_PER_SECOND);
+    for (int b = 0; b < WHAT_IF_BRANCHES; b++) {
+        forkSimulation(&branches[count], sim);
+        SDL_zero(branches[count].stats);
+        if (b > 0) {
+            setNextSwitch(&branches[count], sim->tick + msToTicks((Uint64)(b - 1) * WHAT_IF_STEP_MS));
+        }
+        after[count] = nextSignalTick(&branches[count]) - sim->tick;
+        int duplicate = 0;
+        for (int k = 0; k < count; k++) {
+            if (after[k] == after[count]) duplicate = 1;
+        }
+        if (duplicate) {
+            freeSimulation(&branches[count]);
+        }
+        else {
+            count++;
+        }
+    }
+    Uint64 startTime = SDL_GetTicksNS();
+    advanceForks(branches, count, endTick, pool);
+    printf("What-if:             next light change, %.0f s ahead (%d forks, %.3f s)\n", durationSeconds,
+           count, (double)(SDL_GetTicksNS() - startTime) / SDL_NS_PER_SECOND);
+    for (int b = 0; b < count; b++) {
+        const SimulationStats *s = &branches[b].stats;
+        char label[32];
+        if (after[b] == 0) {
+            snprintf(label, sizeof(label), "%s", b > 0 ? "now" : "planned, now");
+        }
+        else {
+            snprintf(label, sizeof(label), "%sin %.1f s", b > 0 ? "" : "planned, ", (double)after[b] / SIM_TICKS_PER_SECOND);
+        }
+        printf("  %-19s departed %llu, mean time %.2f s, still queued %d\n", label,
+               (unsigned long long)s->departed, s->departed ? s->totalTravelTime / s->departed : 0.0,
+               countQueuedVehicles(&branches[b]));
+        freeSimulation(&branches[b]);
+    }
+}
+
+// Parameter sweeps: many independent headless runs from the same starting state, one per
+// configuration, spread over the thread pool. Every run uses the same seed, so differences
+// between rows come from the parameters rather than from the traffic drawn.
+#define SWEEP_PARAMETERS 5
+#define SWEEP_MAX_RUNS 1000000
+
+static const char *sweepNames[SWEEP_PARAMETERS] = {"green", "threshold", "spawn", "capacity", "service"};
+
+typedef struct {
+    double low[SWEEP_PARAMETERS], high[SWEEP_PARAMETERS], step[SWEEP_PARAMETERS];
+    int randomCount;        // > 0: draw this many configurations instead of the full grid
+} SweepSpec;
+
+typedef struct {
+    double value[SWEEP_PARAMETERS];
+    Uint64 seed;            // Generator state the run starts from
+    SimulationStats stats;
+    int ctm;                // No per-vehicle times, so no percentile
+} SweepRun;
+
+typedef struct {
+    const Simulation *base;
+    SweepRun *runs;
+    double durationSeconds;
+} Sweep;
+
+// Parse "name=value" or "name=low:high[:step]" items separated by commas into spec, whose
+// entries start at the base simulation's settings
+static int parseSweepSpec(const char *text, SweepSpec *spec) {
+    const char *entry = text;
+    while (*entry) {
+        const char *end = strchr(entry, ',');
+        size_t length = end ? (size_t)(end - entry) : strlen(entry);
+        char item[64], name[16];
+        double low, high, step = 1.0;
+        int fields = 0;
+        if (length < sizeof(item)) {
+            memcpy(item, entry, length);
+            item[length] = '\0';
+            fields = sscanf(item, "%15[a-z]=%lf:%lf:%lf", name, &low, &high, &step);
+        }
+        int p = 0;
+        while (fields >= 2 && p < SWEEP_PARAMETERS && strcmp(name, sweepNames[p]) != 0) {
+            p++;
+        }
+        if (fields < 2 || p == SWEEP_PARAMETERS) {
+            printf("--sweep: expected name=value or name=low:high[:step] with name green, threshold, spawn,\n"
+                   "         capacity or service\n");
+            return 0;
+        }
+        if (fields == 2) high = low;
+        double least = (p == 1 || p == 4) ? 0.0 : (p == 3 ? 1.0 : 0.001);
+        if (low < least || high < low || step <= 0.0) {
+            printf("--sweep: bad range for %s\n", name);
+            return 0;
+        }
+        spec->low[p] = low;
+        spec->high[p] = high;
+        spec->step[p] = step;
+        if (!end) break;
+        entry = end + 1;
+    }
+    return 1;
+}
+
+// Settings of sim as sweep parameter values
+static void sweepBaseValues(const Simulation *sim, double values[SWEEP_PARAMETERS]) {
+    values[0] = (double)sim->greenTicks / SIM_TICKS_PER_SECOND;
+    values[1] = sim->priorityThreshold;
+    values[2] = (double)sim->spawnInterval / SIM_TICKS_PER_SECOND;
+    values[3] = sim->vehicleQueueA[0].limit;
+    values[4] = (double)sim->serviceTicks / SIM_TICKS_PER_SECOND;
+}
+
+// Values along parameter p of a grid sweep
+static int sweepSteps(const SweepSpec *spec, int p) {
+    return (int)floor((spec->high[p] - spec->low[p]) / spec->step[p] + 1e-9) + 1;
+}
+
+// Thread pool task: run one configuration from a fork of the base state
+static void runSweepTask(void *context, int index) {
+    Sweep *sweep = (Sweep *)context;
+    SweepRun *run = &sweep->runs[index];
+    Simulation sim;
+    forkSimulation(&sim, sweep->base);
+    SDL_zero(sim.stats);
+    sim.rngState = run->seed;
+    sim.greenTicks = SDL_max((Uint64)(run->value[0] * SIM_TICKS_PER_SECOND), 1);
+    sim.priorityThreshold = (int)run->value[1];
+    sim.spawnInterval = SDL_max((Uint64)(run->value[2] * SIM_TICKS_PER_SECOND), 1);
+    setLaneCapacity(&sim, (int)run->value[3]);
+    sim.serviceTicks = (Uint64)(run->value[4] * SIM_TICKS_PER_SECOND);
+    retimeSignal(&sim);
+    Uint64 endTick = sim.tick + (Uint64)(sweep->durationSeconds * SIM_TICKS_PER_SECOND);
+    if (sim.events) {
+        runEvents(&sim, endTick);
+    }
+    while (sim.tick < endTick) {
+        if (!skipIdleTicks(&sim, endTick)) {
+            stepSimulation(&sim);
+        }
+    }
+    run->stats = sim.stats;
+    run->ctm = sim.ctm != NULL;
+    freeSimulation(&sim);
+}
+
+// Run every configuration of spec for durationSeconds from the state of base and write a
+// CSV row for each to filename. The pool hands runs out one at a time, so fast and slow
+// configurations balance across threads.
+static int runSweep(const Simulation *base, const SweepSpec *spec, Uint64 seed, double durationSeconds,
+             const char *filename, ThreadPool *pool) {
+    double count = 1.0;
+    for (int p = 0; p < SWEEP_PARAMETERS; p++) {
+        count *= sweepSteps(spec, p);
+    }
+    if (spec->randomCount > 0) count = spec->randomCount;
+    if (count > SWEEP_MAX_RUNS) {
+        printf("--sweep: %.0f configurations is more than %d\n", count, SWEEP_MAX_RUNS);
+        return 1;
+    }
+    FILE *fp = fopen(filename, "w");
+    if (!fp) {
+        printf("Error opening %s for writing.\n", filename);
+        return 1;
+    }
+
+    int runCount = (int)count;
+    SweepRun *runs = (SweepRun *)calloc(runCount, sizeof(SweepRun));
+    Uint64 rng = hashWord(14695981039346656037ULL, seed);  // Small seeds give poor first draws
+    for (int i = 0; i < runCount; i++) {
+        int rest = i;
+        for (int p = 0; p < SWEEP_PARAMETERS; p++) {
+            double value;
+            if (spec->randomCount > 0) {
+                value = spec->low[p] + (spec->high[p] - spec->low[p]) * SDL_randf_r(&rng);
+            }
+            else {
+                value = spec->low[p] + spec->step[p] * (rest % sweepSteps(spec, p));
+                rest /= sweepSteps(spec, p);
+            }
+            runs[i].value[p] = (p == 1 || p == 3) ? floor(value + 0.5) : value;  // Vehicle counts
+        }
+        runs[i].seed = seed;
+    }
+
+    printf("Sweep:               %d configurations of %.0f s on %s\n", runCount, durationSeconds, filename);
+    Uint64 startTime = SDL_GetTicksNS();
+    Sweep sweep = {base, runs, durationSeconds};
+    runParallel(pool, runSweepTask, &sweep, runCount);
+    double wallSeconds = (double)(SDL_GetTicksNS() - startTime) / SDL_NS_PER_SECOND;
+
+    fprintf(fp, "green_s,threshold,spawn_s,capacity,service_s,arrived,rejected,departed,throughput_per_hour,"
+                "mean_time_s,p95_time_s,max_queue\n");
+    for (int i = 0; i < runCount; i++) {
+        const SimulationStats *s = &runs[i].stats;
+        fprintf(fp, "%g,%d,%g,%d,%g,%llu,%llu,%llu,%.1f,%.3f,", runs[i].value[0], (int)runs[i].value[1],
+                runs[i].value[2], (int)runs[i].value[3], runs[i].value[4], (unsigned long long)s->arrived,
+                (unsigned long long)s->rejected, (unsigned long long)s->departed,
+                s->departed * 3600.0 / durationSeconds, s->departed ? s->totalTravelTime / s->departed : 0.0);
+        if (!runs[i].ctm) {
+            fprintf(fp, "%.3f", travelTimePercentile(s, 0.95));
+        }
+        fprintf(fp, ",%d\n", s->maxQueueLength);
+    }
+    int ok = fclose(fp) == 0;
+    free(runs);
+    printf("Wall-clock time:     %.3f s (%.1f configurations per second)\n", wallSeconds,
+           wallSeconds > 0.0 ? runCount / wallSeconds : 0.0);
+    if (!ok) printf("Error writing %s.\n", filename);
+    return ok ? 0 : 1;
+}
+
+// Ensembles: replications of one scenario that differ only in their random stream, folded
+// into running statistics as they finish. Nothing per run is kept beyond the current batch.
+#define ENSEMBLE_METRICS 4
+#define ENSEMBLE_MIN_RUNS 5          // Replications before the confidence interval is trusted
+#define ENSEMBLE_RUNS_PER_THREAD 2   // Batch size per thread; runs past the stopping point are dropped
+#define ENSEMBLE_EXACT_RUNS 20       // 1 / 0.05: replications kept for exact 5th and 95th percentiles
+
+// Welford's online mean and variance
+typedef struct {
+    Uint64 count;
+    double mean, m2;
+} RunningStat;
+
+static void addRunningStat(RunningStat *stat, double x) {
+    stat->count++;
+    double delta = x - stat->mean;
+    stat->mean += delta / stat->count;
+    stat->m2 += delta * (x - stat->mean);
+}
+
+static double runningStdDev(const RunningStat *stat) {
+    return stat->count > 1 ? sqrt(stat->m2 / (stat->count - 1)) : 0.0;
+}
+
+// Two-sided 95% Student t value for count - 1 degrees of freedom, and half the width of
+// the confidence interval of the mean
+static double confidenceHalfWidth(const RunningStat *stat) {
+    static const double t975[30] = {12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+                                    2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+                                    2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042};
+    if (stat->count < 2) return INFINITY;
+    Uint64 df = stat->count - 1;
+    double t = df <= 30 ? t975[df - 1] : (df <= 60 ? 2.000 : (df <= 120 ? 1.980 : 1.960));
+    return t * runningStdDev(stat) / sqrt((double)stat->count);
+}
+
+// P-square streaming quantile (Jain and Chlamtac): five markers whose heights track the
+// minimum, p/2, p, (1+p)/2 quantiles and maximum, adjusted by a parabolic fit per sample
+typedef struct {
+    double p;
+    Uint64 count;
+    double height[5];
+    double position[5];     // Actual marker positions, 1-based
+    double desired[5];      // Where the markers should be
+} P2Quantile;
+
+static void initP2Quantile(P2Quantile *q, double p) {
+    SDL_zerop(q);
+    q->p = p;
+}
+
+static int compareDoubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void addP2Quantile(P2Quantile *q, double x) {
+    double *h = q->height, *n = q->position;
+    if (q->count < 5) {
+        h[q->count++] = x;
+        if (q->count == 5) {
+            qsort(h, 5, sizeof(double), compareDoubles);
+            for (int i = 0; i < 5; i++) {
+                n[i] = i + 1;
+            }
+            q->desired[0] = 1.0;
+            q->desired[1] = 1.0 + 2.0 * q->p;
+            q->desired[2] = 1.0 + 4.0 * q->p;
+            q->desired[3] = 3.0 + 2.0 * q->p;
+            q->desired[4] = 5.0;
+        }
+        return;
+    }
+    int k;  // Cell h[k] <= x < h[k + 1] that x falls in
+    if (x < h[0]) {
+        h[0] = x;
+        k = 0;
+    }
+    else if (x >= h[4]) {
+        h[4] = x;
+        k = 3;
+    }
+    else {
+        k = 0;
+        while (x >= h[k + 1]) k++;
+    }
+    const double increment[5] = {0.0, q->p / 2.0, q->p, (1.0 + q->p) / 2.0, 1.0};
+    for (int i = 0; i < 5; i++) {
+        if (i > k) n[i] += 1.0;
+        q->desired[i] += increment[i];
+    }
+    for (int i = 1; i <= 3; i++) {
+        double d = q->desired[i] - n[i];
+        if ((d >= 1.0 && n[i + 1] - n[i] > 1.0) || (d <= -1.0 && n[i - 1] - n[i] < -1.0)) {
+            int s = d >= 0.0 ? 1 : -1;
+            double parabolic = h[i] + s / (n[i + 1] - n[i - 1]) *
+                               ((n[i] - n[i - 1] + s) * (h[i + 1] - h[i]) / (n[i + 1] - n[i]) +
+                                (n[i + 1] - n[i] - s) * (h[i] - h[i - 1]) / (n[i] - n[i - 1]));
+            if (h[i - 1] < parabolic && parabolic < h[i + 1]) {
+                h[i] = parabolic;
+            }
+            else {
+                h[i] += s * (h[i + s] - h[i]) / (n[i + s] - n[i]);
+            }
+            n[i] += s;
+        }
+    }
+    q->count++;
+}
+
+static double p2QuantileValue(const P2Quantile *q) {
+    if (q->count >= 5) return q->height[2];
+    if (q->count == 0) return 0.0;
+    double sorted[5];  // Too few samples for the markers: nearest rank
+    memcpy(sorted, q->height, q->count * sizeof(double));
+    qsort(sorted, q->count, sizeof(double), compareDoubles);
+    return sorted[(int)(q->p * (q->count - 1) + 0.5)];
+}
+
+typedef struct {
+    const char *name;
+    RunningStat stat;
+    P2Quantile low, median, high;   // 5th, 50th and 95th percentiles across replications
+    double values[ENSEMBLE_EXACT_RUNS];  // The first replications' values, for small ensembles
+} EnsembleMetric;
+
+// A percentile of an ensemble metric. P-square's markers only approach the quantile they
+// track after many samples, so until there are 1 / min(p, 1 - p) replications (20 for the
+// 5th and 95th percentiles) it is taken exactly, by nearest rank over every value. Only
+// that many are kept; past them the P-square estimate is used.
+static double ensembleQuantile(EnsembleMetric *metric, const P2Quantile *q) {
+    double tail = SDL_min(q->p, 1.0 - q->p);
+    if (q->count == 0 || q->count > ENSEMBLE_EXACT_RUNS || (double)q->count * tail >= 1.0) {
+        return p2QuantileValue(q);
+    }
+    qsort(metric->values, q->count, sizeof(double), compareDoubles);
+    return metric->values[(int)(q->p * (q->count - 1) + 0.5)];
+}
+
+// Run up to maxRuns replications of base for durationSeconds, each from its own random
+// stream, stopping once every metric's 95% confidence interval is within relativeWidth of
+// its mean. Replications are folded in in order, so the result does not depend on threads.
+static int runEnsemble(const Simulation *base, Uint64 seed, int maxRuns, double relativeWidth, double durationSeconds,
+                ThreadPool *pool) {
+    const char *names[ENSEMBLE_METRICS] = {"Throughput (/h)", "Mean time (s)", "95th pct time (s)", "Longest queue"};
+    EnsembleMetric metrics[ENSEMBLE_METRICS];
+    int metricCount = base->ctm ? ENSEMBLE_METRICS - 1 : ENSEMBLE_METRICS;  // CTM has no percentile
+    for (int m = 0; m < ENSEMBLE_METRICS; m++) {
+        metrics[m].name = names[m];
+        SDL_zero(metrics[m].stat);
+        initP2Quantile(&metrics[m].low, 0.05);
+        initP2Quantile(&metrics[m].median, 0.5);
+        initP2Quantile(&metrics[m].high, 0.95);
+    }
+    if (base->ctm) {
+        metrics[2] = metrics[3];
+    }
+
+    int batch = (pool ? pool->threadCount + 1 : 1) * ENSEMBLE_RUNS_PER_THREAD;
+    SweepRun *runs = (SweepRun *)calloc(batch, sizeof(SweepRun));
+    double parameters[SWEEP_PARAMETERS];
+    sweepBaseValues(base, parameters);
+    Sweep sweep = {base, runs, durationSeconds};
+    Uint64 startTime = SDL_GetTicksNS();
+    int done = 0, converged = 0;
+    while (done < maxRuns && !converged) {
+        int count = SDL_min(batch, maxRuns - done);
+        for (int i = 0; i < count; i++) {
+            memcpy(runs[i].value, parameters, sizeof(parameters));
+            runs[i].seed = hashWord(hashWord(14695981039346656037ULL, seed), (Uint64)(done + i));
+        }
+        runParallel(pool, runSweepTask, &sweep, count);
+        for (int i = 0; i < count && !converged; i++) {
+            const SimulationStats *s = &runs[i].stats;
+            double values[ENSEMBLE_METRICS] = {s->departed * 3600.0 / durationSeconds,
+                                               s->departed ? s->totalTravelTime / s->departed : 0.0,
+                                               travelTimePercentile(s, 0.95), (double)s->maxQueueLength};
+            if (base->ctm) values[2] = values[3];
+            converged = ++done >= ENSEMBLE_MIN_RUNS;
+            for (int m = 0; m < metricCount; m++) {
+                if (done <= ENSEMBLE_EXACT_RUNS) metrics[m].values[done - 1] = values[m];
+                addRunningStat(&metrics[m].stat, values[m]);
+                addP2Quantile(&metrics[m].low, values[m]);
+                addP2Quantile(&metrics[m].median, values[m]);
+                addP2Quantile(&metrics[m].high, values[m]);
+                if (confidenceHalfWidth(&metrics[m].stat) > relativeWidth * fabs(metrics[m].stat.mean)) {
+                    converged = 0;
+                }
+            }
+        }
+    }
+    free(runs);
+    double wallSeconds = (double)(SDL_GetTicksNS() - startTime) / SDL_NS_PER_SECOND;
+
+    printf("Ensemble:            %d replications of %.0f s, %s\n", done, durationSeconds,
+           converged ? "95% confidence intervals within target" : "stopped at --ensemble limit");
+    printf("Wall-clock time:     %.3f s\n", wallSeconds);
+    printf("%-19s %10s %10s %10s %10s %10s %10s\n", "Metric", "Mean", "95% CI +-", "Std dev", "5th pct", "Median",
+           "95th pct");
+    for (int m = 0; m < metricCount; m++) {
+        EnsembleMetric *metric = &metrics[m];
+        printf("%-19s %10.2f %10.2f %10.2f %10.2f %10.2f %10.2f\n", metric->name, metric->stat.mean,
+               done > 1 ? confidenceHalfWidth(&metric->stat) : 0.0, runningStdDev(&metric->stat),
+               ensembleQuantile(metric, &metric->low), ensembleQuantile(metric, &metric->median),
+               ensembleQuantile(metric, &metric->high));
+    }
+    return 0;
+}
+
+// Road network: junctions joined by one-way links. A link is a FIFO of vehicles that reach
+// its stop line a fixed free-flow time after entering, then cross one at a time on green at
+// the saturation headway, provided the next link has room. Sides without a link to another
+// junction get a source link feeding vehicles in and a sink taking them out.
+#define NETWORK_BLOCK_LENGTH 400.0f      // Link length between neighbouring grid junctions
+#define NETWORK_ENTRY_LENGTH 400.0f      // Length of source links
+#define NETWORK_ENTRY_INTERVAL_MS 20000  // Mean time between vehicles on each source link
+#define NETWORK_HEADWAY_TICKS ((Uint64)(DISTANCE_BETWEEN_VEHICLES * SIM_TICKS_PER_SECOND / VEHICLE_SPEED))
+#define NETWORK_OUTSIDE -1               // Link end outside the network
+#define NETWORK_REMOTE -2                // Link end at a junction owned by another process
+#define NETWORK_REBALANCE_TICKS 600      // Ticks between repartitions of a parallel run
+
+// Sides of a junction, clockwise from the top of the screen
+#define SIDE_NORTH 0
+#define SIDE_EAST 1
+#define SIDE_SOUTH 2
+#define SIDE_WEST 3
+
+typedef struct {
+    Uint64 enteredTick;  // Tick the vehicle entered the network
+    Uint64 readyTick;    // Tick it reaches the stop line of its current link
+    int exitSide;        // Side it leaves the next junction by, -1 until chosen
+    int destination;     // Sink it is routed to, -1 to turn at random
+} NetVehicle;
+
+typedef struct {
+    int from, to;            // Junction indices (from = NETWORK_OUTSIDE for a source link)
+    int remote;              // Global id of the junction at a NETWORK_REMOTE end, else -1
+    int side;                // Side of the downstream junction the link arrives on
+    Uint64 travelTicks;      // Free-flow time from entry to the stop line
+    int capacity;            // Vehicles the link can hold
+    NetVehicle *ring;        // FIFO of capacity slots, front at head; none if to is remote
+    int head, count;
+    int departed;            // Taken from the front this tick by the downstream junction
+    NetVehicle incoming;     // Handed over this tick by the upstream junction
+    SDL_AtomicInt handoff;   // 1 while incoming holds a vehicle; may cross threads
+    Uint64 nextRelease;      // Earliest tick the front may cross the stop line
+    Uint64 nextArrival;      // Source links: tick of the next vehicle from outside
+} NetLink;
+
+typedef struct {
+    float x, y;
+    int in[4];               // Link arriving on each side
+    int out[4];              // Link leaving by each side, -1 = to the outside
+    Uint64 greenTicks;       // Length of each green phase; sides turn green clockwise
+    Uint64 offset;           // Shifts this junction's cycle, for coordinating neighbours
+    Uint64 rngState;         // Turning choices and source arrivals at this junction
+    // Totals for this junction, summed for reports
+    Uint64 arrived, rejected, departed;
+    Uint64 travelTicks;
+} NetNode;
+
+#define ROUTE_NONE 0xF  // Next-hop entry for a sink that cannot be reached
+
+// Next-hop routes to the network's exits. Destinations are only the sinks (junction sides
+// with no outgoing link), so the table holds junctions x sinks four-bit entries rather
+// than junctions x junctions, and a vehicle's turn at each junction is one lookup.
+typedef struct {
+    int *sinkNode;           // Sink d leaves junction sinkNode[d] by side sinkSide[d]
+    Uint8 *sinkSide;
+    int sinkCount;
+    Uint8 *nextHop;          // Entry n * sinkCount + d, two per byte: side to leave n by
+} RouteTable;
+
+// A process holds junctions firstNode .. firstNode + nodeCount - 1 of the totalNodes in the
+// network (all of them unless the run is distributed), plus the links touching them
+typedef struct {
+    NetNode *nodes;
+    NetLink *links;
+    int nodeCount, linkCount;
+    int linkCapacity;
+    int firstNode, totalNodes;
+    Uint64 tick;
+    Uint64 entryInterval;    // Mean ticks between vehicles on a source link
+    RouteTable *routes;      // NULL: vehicles turn at random
+} Network;
+
+// What to build: a file if given, otherwise a grid
+typedef struct {
+    const char *file;
+    int columns, rows;
+    Uint64 seed;
+    Uint64 entryInterval;
+    int rank, ranks;         // This process's share of a distributed run; 0 of 1 otherwise
+    int routes;              // Route vehicles to sinks with a next-hop table
+} NetworkSpec;
+
+// Side of (x0, y0) on which (x1, y1) lies, by the dominant axis
+static int sideTowards(float x0, float y0, float x1, float y1) {
+    float dx = x1 - x0, dy = y1 - y0;
+    if (fabsf(dx) > fabsf(dy)) {
+        return dx > 0.0f ? SIDE_EAST : SIDE_WEST;
+    }
+    return dy > 0.0f ? SIDE_SOUTH : SIDE_NORTH;
+}
+
+// First junction id of process `rank` when totalNodes are shared among `ranks` processes
+static int firstJunctionOf(int totalNodes, int rank, int ranks) {
+    return (int)((Sint64)totalNodes * rank / ranks);
+}
+
+static int ownerOfJunction(int totalNodes, int ranks, int id) {
+    int rank = (int)((Sint64)id * ranks / totalNodes);
+    while (rank + 1 < ranks && firstJunctionOf(totalNodes, rank + 1, ranks) <= id) rank++;
+    while (rank > 0 && firstJunctionOf(totalNodes, rank, ranks) > id) rank--;
+    return rank;
+}
+
+static int ownsJunction(const Network *net, int id) {
+    return id >= net->firstNode && id < net->firstNode + net->nodeCount;
+}
+
+// Set up this process's share of a network of totalNodes junctions, without links
+static void initNetwork(Network *net, int totalNodes, int rank, int ranks) {
+    int nodeCount = firstJunctionOf(totalNodes, rank + 1, ranks) - firstJunctionOf(totalNodes, rank, ranks);
+    net->nodes = (NetNode *)calloc(nodeCount, sizeof(NetNode));
+    net->nodeCount = nodeCount;
+    net->firstNode = firstJunctionOf(totalNodes, rank, ranks);
+    net->totalNodes = totalNodes;
+    net->links = NULL;
+    net->linkCount = 0;
+    net->linkCapacity = 0;
+    net->tick = 0;
+    net->entryInterval = 0;
+    net->routes = NULL;
+    for (int n = 0; n < nodeCount; n++) {
+        for (int side = 0; side < 4; side++) {
+            net->nodes[n].in[side] = -1;
+            net->nodes[n].out[side] = -1;
+        }
+        net->nodes[n].greenTicks = msToTicks(LIGHT_SWITCH_INTERVAL_MS);
+    }
+}
+
+static void freeRouteTable(RouteTable *routes) {
+    if (!routes) return;
+    free(routes->sinkNode);
+    free(routes->sinkSide);
+    free(routes->nextHop);
+    free(routes);
+}
+
+static void freeNetwork(Network *net) {
+    for (int i = 0; i < net->linkCount; i++) {
+        free(net->links[i].ring);
+    }
+    freeRouteTable(net->routes);
+    net->routes = NULL;
+    free(net->links);
+    free(net->nodes);
+    net->links = NULL;
+    net->nodes = NULL;
+    net->linkCount = net->nodeCount = 0;
+}
+
+// Add a link leaving junction `from` (or NETWORK_OUTSIDE) by outSide and arriving on `side`
+// of junction `to`; both are global ids. Only links touching this process's junctions are
+// kept, with the other end NETWORK_REMOTE if it belongs elsewhere. Returns 0 if a side
+// is already taken.
+static int addNetLink(Network *net, int from, int to, int side, int outSide, float length) {
+    NetNode *source = (from != NETWORK_OUTSIDE && ownsJunction(net, from)) ? &net->nodes[from - net->firstNode] : NULL;
+    NetNode *target = ownsJunction(net, to) ? &net->nodes[to - net->firstNode] : NULL;
+    if (!source && !target) return 1;
+    if ((target && target->in[side] >= 0) || (source && source->out[outSide] >= 0)) return 0;
+    if (net->linkCount == net->linkCapacity) {
+        net->linkCapacity = net->linkCapacity ? net->linkCapacity * 2 : 64;
+        net->links = (NetLink *)realloc(net->links, net->linkCapacity * sizeof(NetLink));
+    }
+    NetLink *link = &net->links[net->linkCount];
+    SDL_zerop(link);
+    link->from = source ? from - net->firstNode : (from == NETWORK_OUTSIDE ? NETWORK_OUTSIDE : NETWORK_REMOTE);
+    link->to = target ? to - net->firstNode : NETWORK_REMOTE;
+    link->remote = link->from == NETWORK_REMOTE ? from : (link->to == NETWORK_REMOTE ? to : -1);
+    link->side = side;
+    link->travelTicks = (Uint64)(length / VEHICLE_SPEED * SIM_TICKS_PER_SECOND);
+    link->capacity = (int)(length / DISTANCE_BETWEEN_VEHICLES);
+    if (link->capacity < 1) link->capacity = 1;
+    if (target) {
+        link->ring = (NetVehicle *)malloc(link->capacity * sizeof(NetVehicle));
+        target->in[side] = net->linkCount;
+    }
+    if (source) {
+        source->out[outSide] = net->linkCount;
+    }
+    net->linkCount++;
+    return 1;
+}
+
+// Give every side without an incoming link a source link fed every entryInterval ticks on
+// average. Each junction's stream is seeded from its global id, so it draws the same
+// numbers whichever process owns it.
+static void finishNetwork(Network *net, Uint64 seed, Uint64 entryInterval) {
+    net->entryInterval = entryInterval;
+    for (int n = 0; n < net->nodeCount; n++) {
+        NetNode *node = &net->nodes[n];
+        node->rngState = seed + (Uint64)(net->firstNode + n) * 0x9E3779B97F4A7C15ULL;
+        for (int side = 0; side < 4; side++) {
+            if (node->in[side] < 0) {
+                addNetLink(net, NETWORK_OUTSIDE, net->firstNode + n, side, 0, NETWORK_ENTRY_LENGTH);
+                net->links[node->in[side]].nextArrival = SDL_rand_r(&node->rngState, (Sint32)net->entryInterval);
+            }
+        }
+    }
+}
+
+// Junctions on a cols x rows grid, with a link each way between neighbours. Only the rows
+// around this process's share are visited.
+static int createGridNetwork(Network *net, const NetworkSpec *spec) {
+    int cols = spec->columns, rows = spec->rows;
+    initNetwork(net, cols * rows, spec->rank, spec->ranks);
+    for (int i = 0; i < net->nodeCount; i++) {
+        int n = net->firstNode + i;
+        net->nodes[i].x = n % cols * NETWORK_BLOCK_LENGTH;
+        net->nodes[i].y = n / cols * NETWORK_BLOCK_LENGTH;
+    }
+    int first = SDL_max(net->firstNode - cols, 0);
+    int last = SDL_min(net->firstNode + net->nodeCount + cols, cols * rows);
+    for (int n = first; n < last; n++) {
+        int r = n / cols, c = n % cols;
+        if (c > 0) addNetLink(net, n - 1, n, SIDE_WEST, SIDE_EAST, NETWORK_BLOCK_LENGTH);
+        if (c < cols - 1) addNetLink(net, n + 1, n, SIDE_EAST, SIDE_WEST, NETWORK_BLOCK_LENGTH);
+        if (r > 0) addNetLink(net, n - cols, n, SIDE_NORTH, SIDE_SOUTH, NETWORK_BLOCK_LENGTH);
+        if (r < rows - 1) addNetLink(net, n + cols, n, SIDE_SOUTH, SIDE_NORTH, NETWORK_BLOCK_LENGTH);
+    }
+    finishNetwork(net, spec->seed, spec->entryInterval);
+    return 1;
+}
+
+// Read a network file:
+//   node <id> <x> <y> [<green ms> <offset ms>]   (ids 0 .. count-1, count given first)
+//   link <from> <to> [<length>]                   (length defaults to the straight distance)
+// after a first line "nodes <count>". Lines starting with # are ignored. Only the positions
+// of other processes' junctions are kept, and only while loading.
+static int loadNetwork(Network *net, const NetworkSpec *spec) {
+    const char *filename = spec->file;
+    FILE *fp = fopen(filename, "r");
+    if (!fp) {
+        printf("Error opening %s for reading.\n", filename);
+        return 0;
+    }
+    char line[256];
+    int count = 0;
+    int lineNumber = 0;
+    int ok = 1;
+    float *position = NULL;  // x, y of every junction
+    net->nodes = NULL;
+    while (ok && fgets(line, sizeof(line), fp)) {
+        lineNumber++;
+        int id, from, to;
+        float x, y, length;
+        double greenMs, offsetMs;
+        if (line[0] == '#' || line[0] == '\n') continue;
+        if (!net->nodes) {
+            if (sscanf(line, "nodes %d", &count) != 1 || count <= 0) {
+                printf("%s:%d: expected \"nodes <count>\"\n", filename, lineNumber);
+                ok = 0;
+            }
+            else if (count < spec->ranks) {
+                printf("%s: %d junctions cannot be shared among %d processes\n", filename, count, spec->ranks);
+                ok = 0;
+            }
+            else {
+                initNetwork(net, count, spec->rank, spec->ranks);
+                position = (float *)calloc(2 * (size_t)count, sizeof(float));
+            }
+        }
+        else if (sscanf(line, "node %d %f %f", &id, &x, &y) == 3) {
+            if (id < 0 || id >= count) {
+                printf("%s:%d: node id %d out of range\n", filename, lineNumber, id);
+                ok = 0;
+                continue;
+            }
+            position[2 * id] = x;
+            position[2 * id + 1] = y;
+            if (!ownsJunction(net, id)) continue;
+            NetNode *node = &net->nodes[id - net->firstNode];
+            node->x = x;
+            node->y = y;
+            if (sscanf(line, "node %*d %*f %*f %lf %lf", &greenMs, &offsetMs) == 2 && greenMs > 0.0) {
+                node->greenTicks = msToTicks((Uint64)greenMs);
+                node->offset = msToTicks((Uint64)offsetMs);
+            }
+        }
+        else if (sscanf(line, "link %d %d", &from, &to) == 2) {
+            if (from < 0 || from >= count || to < 0 || to >= count || from == to) {
+                printf("%s:%d: bad link %d -> %d\n", filename, lineNumber, from, to);
+                ok = 0;
+                continue;
+            }
+            float ax = position[2 * from], ay = position[2 * from + 1];
+            float bx = position[2 * to], by = position[2 * to + 1];
+            if (sscanf(line, "link %*d %*d %f", &length) != 1) {
+                length = sqrtf((ax - bx) * (ax - bx) + (ay - by) * (ay - by));
+            }
+            if (!addNetLink(net, from, to, sideTowards(bx, by, ax, ay), sideTowards(ax, ay, bx, by), length)) {
+                printf("%s:%d: junction side already has a link\n", filename, lineNumber);
+                ok = 0;
+            }
+        }
+        else {
+            printf("%s:%d: cannot parse line\n", filename, lineNumber);
+            ok = 0;
+        }
+    }
+    fclose(fp);
+    free(position);
+    if (ok && !net->nodes) {
+        printf("%s: no nodes\n", filename);
+        ok = 0;
+    }
+    if (!ok) {
+        if (net->nodes) freeNetwork(net);
+        return 0;
+    }
+    finishNetwork(net, spec->seed, spec->entryInterval);
+    return 1;
+}
+
+// Half the vehicles go straight on, a quarter turn each way; no U-turns
+static int chooseExitSide(NetNode *node, int side) {
+    int r = SDL_rand_r(&node->rngState, 4);
+    if (r < 2) return (side + 2) % 4;
+    return (r == 2) ? (side + 1) % 4 : (side + 3) % 4;
+}
+
+static inline int routeSide(const RouteTable *routes, int n, int d) {
+    size_t i = (size_t)n * routes->sinkCount + d;
+    return (routes->nextHop[i / 2] >> (4 * (i % 2))) & 0xF;
+}
+
+static void setRouteSide(RouteTable *routes, int n, int d, int side) {
+    size_t i = (size_t)n * routes->sinkCount + d;
+    int shift = 4 * (int)(i % 2);
+    routes->nextHop[i / 2] = (Uint8)((routes->nextHop[i / 2] & ~(0xF << shift)) | side << shift);
+}
+
+// Shortest free-flow routes from every junction to every sink, by one Dijkstra search per
+// sink over the links in reverse. Built once; lookups never search.
+static RouteTable *createRouteTable(const Network *net) {
+    RouteTable *routes = (RouteTable *)calloc(1, sizeof(RouteTable));
+    for (int n = 0; n < net->nodeCount; n++) {
+        for (int side = 0; side < 4; side++) {
+            routes->sinkCount += net->nodes[n].out[side] < 0;
+        }
+    }
+    routes->sinkNode = (int *)malloc(routes->sinkCount * sizeof(int));
+    routes->sinkSide = (Uint8 *)malloc(routes->sinkCount);
+    routes->sinkCount = 0;
+    for (int n = 0; n < net->nodeCount; n++) {
+        for (int side = 0; side < 4; side++) {
+            if (net->nodes[n].out[side] >= 0) continue;
+            routes->sinkNode[routes->sinkCount] = n;
+            routes->sinkSide[routes->sinkCount++] = (Uint8)side;
+        }
+    }
+    size_t bytes = ((size_t)net->nodeCount * routes->sinkCount + 1) / 2;
+    routes->nextHop = (Uint8 *)malloc(bytes);
+    memset(routes->nextHop, ROUTE_NONE << 4 | ROUTE_NONE, bytes);
+
+    double *distance = (double *)malloc(net->nodeCount * sizeof(double));
+    IndexedHeap heap;
+    initHeap(&heap);
+    growHeap(&heap, net->nodeCount);
+    for (int d = 0; d < routes->sinkCount; d++) {
+        for (int n = 0; n < net->nodeCount; n++) {
+            distance[n] = HUGE_VAL;
+        }
+        int sink = routes->sinkNode[d];
+        distance[sink] = 0.0;
+        setRouteSide(routes, sink, d, routes->sinkSide[d]);
+        setHeapKey(&heap, sink, 0.0, (Uint64)sink);
+        for (int m = popHeap(&heap); m >= 0; m = popHeap(&heap)) {
+            for (int side = 0; side < 4; side++) {
+                int in = net->nodes[m].in[side];
+                const NetLink *link = &net->links[in];
+                if (link->from < 0) continue;
+                double via = distance[m] + (double)link->travelTicks;
+                if (via >= distance[link->from]) continue;
+                distance[link->from] = via;
+                for (int outSide = 0; outSide < 4; outSide++) {
+                    if (net->nodes[link->from].out[outSide] == in) setRouteSide(routes, link->from, d, outSide);
+                }
+                setHeapKey(&heap, link->from, via, (Uint64)link->from);
+            }
+        }
+    }
+    freeHeap(&heap);
+    free(distance);
+    return routes;
+}
+
+// Pick a sink for a vehicle entering junction n on `side`: any reachable one other than
+// straight back out where it came in. Falls back to random turns if none is drawn.
+static int chooseDestination(const Network *net, NetNode *node, int n, int side) {
+    const RouteTable *routes = net->routes;
+    if (!routes || routes->sinkCount == 0) return -1;
+    for (int tries = 0; tries < 8; tries++) {
+        int d = SDL_rand_r(&node->rngState, routes->sinkCount);
+        if (routeSide(routes, n, d) != ROUTE_NONE && !(routes->sinkNode[d] == n && routes->sinkSide[d] == side)) {
+            return d;
+        }
+    }
+    return -1;
+}
+
+// First half of a tick for one junction: let the front vehicle of the green link cross.
+// It only reads the state other junctions leave alone during this phase (link counts are
+// as at the start of the tick) and writes the links it owns, so junctions can run in any
+// order or in parallel.
+static void dischargeJunction(Network *net, int n, Uint64 tick) {
+    NetNode *node = &net->nodes[n];
+    int side = (int)((tick + node->offset) / node->greenTicks % 4);
+    NetLink *link = &net->links[node->in[side]];
+    if (link->count == 0 || tick < link->nextRelease) return;
+    NetVehicle *v = &link->ring[link->head];
+    if (v->readyTick > tick) return;
+
+    if (v->exitSide < 0) {
+        v->exitSide = v->destination >= 0 ? routeSide(net->routes, n, v->destination) : chooseExitSide(node, side);
+    }
+    int outLink = node->out[v->exitSide];
+    if (outLink >= 0) {
+        NetLink *next = &net->links[outLink];
+        if (next->count >= next->capacity) return;  // Blocked; try again next tick
+        next->incoming = *v;
+        next->incoming.readyTick = tick + next->travelTicks;
+        next->incoming.exitSide = -1;
+        SDL_SetAtomicInt(&next->handoff, 1);
+    }
+    else {
+        node->departed++;
+        node->travelTicks += tick - v->enteredTick;
+    }
+    link->head = (link->head + 1) % link->capacity;
+    link->departed = 1;
+    link->nextRelease = tick + NETWORK_HEADWAY_TICKS;
+}
+
+static void pushNetVehicle(NetLink *link, NetVehicle v) {
+    link->ring[(link->head + link->count) % link->capacity] = v;
+    link->count++;
+}
+
+// Second half of a tick for one junction: settle its incoming links with what left the
+// front and what was handed over at the rear, and feed its source links
+static void settleJunction(Network *net, int n, Uint64 tick) {
+    NetNode *node = &net->nodes[n];
+    for (int side = 0; side < 4; side++) {
+        NetLink *link = &net->links[node->in[side]];
+        link->count -= link->departed;
+        link->departed = 0;
+        if (SDL_GetAtomicInt(&link->handoff)) {
+            pushNetVehicle(link, link->incoming);
+            SDL_SetAtomicInt(&link->handoff, 0);
+        }
+        if (link->from == NETWORK_OUTSIDE && tick >= link->nextArrival) {
+            if (link->count < link->capacity) {
+                NetVehicle v = {tick, tick + link->travelTicks, -1, chooseDestination(net, node, n, side)};
+                pushNetVehicle(link, v);
+                node->arrived++;
+            }
+            else {
+                node->rejected++;
+            }
+            link->nextArrival = tick + 1 + SDL_rand_r(&node->rngState, (Sint32)(2 * net->entryInterval));
+        }
+    }
+}
+
+static void stepNetwork(Network *net) {
+    for (int n = 0; n < net->nodeCount; n++) {
+        dischargeJunction(net, n, net->tick);
+    }
+    for (int n = 0; n < net->nodeCount; n++) {
+        settleJunction(net, n, net->tick);
+    }
+    net->tick++;
+}
+
+// Barrier for a fixed group of threads that all stay busy between rounds; spins briefly,
+// then yields so an oversubscribed machine still makes progress
+typedef struct {
+    SDL_AtomicInt waiting;  // Threads arrived in the current round
+    SDL_AtomicInt round;    // Completed rounds
+    int count;
+} SpinBarrier;
+
+static void waitAtBarrier(SpinBarrier *barrier) {
+    int round = SDL_GetAtomicInt(&barrier->round);
+    if (SDL_AddAtomicInt(&barrier->waiting, 1) == barrier->count - 1) {
+        SDL_SetAtomicInt(&barrier->waiting, 0);
+        SDL_AddAtomicInt(&barrier->round, 1);
+        return;
+    }
+    for (int spins = 0; SDL_GetAtomicInt(&barrier->round) == round; spins++) {
+        if (spins < 1000) {
+            SDL_CPUPauseInstruction();
+        }
+        else {
+            SDL_Delay(0);
+        }
+    }
+}
+
+// Junctions split into one region per thread. order holds the junctions in recursive
+// coordinate bisection order, so any run of it is spatially compact; region p is
+// order[start[p] .. start[p + 1]). Links between regions are the only shared state.
+typedef struct {
+    Network *net;
+    int *order;
+    int *start;
+    int regions;
+    Uint64 endTick;         // Regions run on their own up to this tick
+    SpinBarrier barrier;
+} NetworkPartition;
+
+typedef struct {
+    float key;
+    int node;
+} BisectionKey;
+
+static int compareBisectionKeys(const void *a, const void *b) {
+    const BisectionKey *ka = (const BisectionKey *)a, *kb = (const BisectionKey *)b;
+    if (ka->key != kb->key) return ka->key < kb->key ? -1 : 1;
+    return ka->node - kb->node;
+}
+
+// Order junctions by splitting the set at the median of its longer side, recursively
+static void bisectJunctions(const Network *net, int *order, int count, BisectionKey *scratch) {
+    if (count <= 2) return;
+    float minX = net->nodes[order[0]].x, maxX = minX;
+    float minY = net->nodes[order[0]].y, maxY = minY;
+    for (int i = 1; i < count; i++) {
+        const NetNode *node = &net->nodes[order[i]];
+        minX = SDL_min(minX, node->x);
+        maxX = SDL_max(maxX, node->x);
+        minY = SDL_min(minY, node->y);
+        maxY = SDL_max(maxY, node->y);
+    }
+    int alongX = (maxX - minX) >= (maxY - minY);
+    for (int i = 0; i < count; i++) {
+        scratch[i].key = alongX ? net->nodes[order[i]].x : net->nodes[order[i]].y;
+        scratch[i].node = order[i];
+    }
+    qsort(scratch, count, sizeof(BisectionKey), compareBisectionKeys);
+    for (int i = 0; i < count; i++) {
+        order[i] = scratch[i].node;
+    }
+    bisectJunctions(net, order, count / 2, scratch);
+    bisectJunctions(net, order + count / 2, count - count / 2, scratch);
+}
+
+static void initNetworkPartition(NetworkPartition *part, Network *net, int regions) {
+    part->net = net;
+    part->regions = regions;
+    part->order = (int *)malloc(net->nodeCount * sizeof(int));
+    part->start = (int *)calloc(regions + 1, sizeof(int));
+    for (int n = 0; n < net->nodeCount; n++) {
+        part->order[n] = n;
+    }
+    BisectionKey *scratch = (BisectionKey *)malloc(net->nodeCount * sizeof(BisectionKey));
+    bisectJunctions(net, part->order, net->nodeCount, scratch);
+    free(scratch);
+    SDL_SetAtomicInt(&part->barrier.waiting, 0);
+    SDL_SetAtomicInt(&part->barrier.round, 0);
+    part->barrier.count = regions;
+}
+
+static void freeNetworkPartition(NetworkPartition *part) {
+    free(part->order);
+    free(part->start);
+}
+
+// Cut the bisection order into regions of equal weight. A junction weighs one plus the
+// vehicles on its incoming links, so busy areas are shared among more threads.
+static void balanceNetworkPartition(NetworkPartition *part) {
+    const Network *net = part->net;
+    double total = 0.0;
+    for (int n = 0; n < net->nodeCount; n++) {
+        total += 1.0;
+        for (int side = 0; side < 4; side++) {
+            total += net->links[net->nodes[n].in[side]].count;
+        }
+    }
+    double sum = 0.0;
+    int region = 1;
+    part->start[0] = 0;
+    for (int i = 0; i < net->nodeCount && region < part->regions; i++) {
+        const NetNode *node = &net->nodes[part->order[i]];
+        sum += 1.0;
+        for (int side = 0; side < 4; side++) {
+            sum += net->links[node->in[side]].count;
+        }
+        while (region < part->regions && sum >= total * region / part->regions) {
+            part->start[region++] = i + 1;
+        }
+    }
+    while (region <= part->regions) {
+        part->start[region++] = net->nodeCount;
+    }
+}
+
+// Thread pool task: advance one region to endTick, meeting the others at the barrier
+// after each phase. Vehicles cross into other regions only through link handoffs.
+static void runNetworkRegion(void *context, int region) {
+    NetworkPartition *part = (NetworkPartition *)context;
+    Network *net = part->net;
+    const int *mine = part->order + part->start[region];
+    int count = part->start[region + 1] - part->start[region];
+    for (Uint64 tick = net->tick; tick < part->endTick; tick++) {
+        for (int i = 0; i < count; i++) {
+            dischargeJunction(net, mine[i], tick);
+        }
+        waitAtBarrier(&part->barrier);
+        for (int i = 0; i < count; i++) {
+            settleJunction(net, mine[i], tick);
+        }
+        waitAtBarrier(&part->barrier);
+    }
+}
+
+// Advance the network to endTick on the pool, rebalancing regions every
+// NETWORK_REBALANCE_TICKS. Results do not depend on the number of threads.
+static void runNetwork(Network *net, Uint64 endTick, ThreadPool *pool) {
+    if (!pool) {
+        while (net->tick < endTick) {
+            stepNetwork(net);
+        }
+        return;
+    }
+    NetworkPartition part;
+    initNetworkPartition(&part, net, pool->threadCount + 1);
+    while (net->tick < endTick) {
+        balanceNetworkPartition(&part);
+        part.endTick = SDL_min(net->tick + NETWORK_REBALANCE_TICKS, endTick);
+        runParallel(pool, runNetworkRegion, &part, part.regions);
+        net->tick = part.endTick;
+    }
+    freeNetworkPartition(&part);
+}
+
+// Fingerprint of every junction's totals and the vehicles on its incoming links, to compare
+// runs. Junctions are hashed separately and summed, so the shares of a distributed run add
+// up to the hash of the whole network.
+static Uint64 hashNetwork(const Network *net) {
+    Uint64 sum = 0;
+    for (int n = 0; n < net->nodeCount; n++) {
+        const NetNode *node = &net->nodes[n];
+        Uint64 hash = 14695981039346656037ULL;  // FNV-1a over 64-bit words
+        Uint64 words[5] = {(Uint64)(net->firstNode + n), node->arrived, node->rejected, node->departed, node->travelTicks};
+        for (int w = 0; w < 5; w++) {
+            hash = (hash ^ words[w]) * 1099511628211ULL;
+        }
+        for (int side = 0; side < 4; side++) {
+            const NetLink *link = &net->links[node->in[side]];
+            for (int k = 0; k < link->count; k++) {
+                const NetVehicle *v = &link->ring[(link->head + k) % link->capacity];
+                hash = (hash ^ v->enteredTick) * 1099511628211ULL;
+                hash = (hash ^ v->readyTick) * 1099511628211ULL;
+            }
+        }
+        sum += hash;
+    }
+    return sum;
+}
+
+// Figures for a summary; every field adds up across the processes of a distributed run
+typedef struct {
+    Uint64 junctions, links;
+    Uint64 arrived, rejected, departed, travelTicks;
+    Uint64 inNetwork;
+    Uint64 hash;
+} NetworkTotals;
+
+#define NETWORK_TOTALS_WORDS 8  // Fields of NetworkTotals
+
+static void sumNetwork(const Network *net, NetworkTotals *totals) {
+    SDL_zerop(totals);
+    totals->junctions = net->nodeCount;
+    for (int n = 0; n < net->nodeCount; n++) {
+        totals->arrived += net->nodes[n].arrived;
+        totals->rejected += net->nodes[n].rejected;
+        totals->departed += net->nodes[n].departed;
+        totals->travelTicks += net->nodes[n].travelTicks;
+    }
+    for (int i = 0; i < net->linkCount; i++) {
+        if (net->links[i].to == NETWORK_REMOTE) continue;  // Counted by the process it leads to
+        totals->links++;
+        totals->inNetwork += net->links[i].count;
+    }
+    totals->hash = hashNetwork(net);
+}
+
+static void printNetworkSummary(const NetworkTotals *totals, Uint64 tick, double wallSeconds) {
+    double simSeconds = (double)tick / SIM_TICKS_PER_SECOND;
+    printf("Junctions:           %llu (%llu links)\n", (unsigned long long)totals->junctions,
+           (unsigned long long)totals->links);
+    printf("Simulated time:      %.1f s (%llu ticks)\n", simSeconds, (unsigned long long)tick);
+    printf("Wall-clock time:     %.3f s (%.0fx real time)\n", wallSeconds,
+           wallSeconds > 0.0 ? simSeconds / wallSeconds : 0.0);
+    printf("Vehicles arrived:    %llu\n", (unsigned long long)totals->arrived);
+    printf("Vehicles rejected:   %llu (source link full)\n", (unsigned long long)totals->rejected);
+    printf("Vehicles departed:   %llu (%.1f per hour)\n", (unsigned long long)totals->departed,
+           simSeconds > 0.0 ? totals->departed * 3600.0 / simSeconds : 0.0);
+    printf("Still in network:    %llu\n", (unsigned long long)totals->inNetwork);
+    printf("Mean time in system: %.2f s\n",
+           totals->departed ? (double)totals->travelTicks / totals->departed / SIM_TICKS_PER_SECOND : 0.0);
+    printf("State hash:          %016llx\n", (unsigned long long)totals->hash);
+}
+
+static int buildNetwork(Network *net, const NetworkSpec *spec) {
+    if (spec->file) {
+        if (!loadNetwork(net, spec)) return 0;
+    }
+    else if (spec->columns * spec->rows < spec->ranks) {
+        printf("%d junctions cannot be shared among %d processes\n", spec->columns * spec->rows, spec->ranks);
+        return 0;
+    }
+    else {
+        createGridNetwork(net, spec);
+    }
+    if (spec->routes) {
+        net->routes = createRouteTable(net);
+    }
+    return 1;
+}
+
+// Run the same network on 1, 2, 4, ... threads and all cores, and report the speed-up.
+// Every run must end in the same state.
+static int runNetworkScaling(const NetworkSpec *spec, double durationSeconds) {
+    int cores = SDL_GetNumLogicalCPUCores();
+    Uint64 endTick = (Uint64)(durationSeconds * SIM_TICKS_PER_SECOND);
+    double baseSeconds = 0.0;
+    Uint64 baseHash = 0;
+    int matches = 1;
+    printf("Threads  Wall (s)  Speed-up  Efficiency  Result\n");
+    for (int threads = 1; threads <= cores; threads = (threads * 2 > cores && threads < cores) ? cores : threads * 2) {
+        Network net;
+        if (!buildNetwork(&net, spec)) return 1;
+        ThreadPool *pool = createThreadPool(threads);
+        Uint64 startTime = SDL_GetTicksNS();
+        runNetwork(&net, endTick, pool);
+        double seconds = (double)(SDL_GetTicksNS() - startTime) / SDL_NS_PER_SECOND;
+        destroyThreadPool(pool);
+        Uint64 hash = hashNetwork(&net);
+        freeNetwork(&net);
+        if (threads == 1) {
+            baseSeconds = seconds;
+            baseHash = hash;
+        }
+        matches &= hash == baseHash;
+        printf("%7d  %8.3f  %8.2f  %9.0f%%  %016llx%s\n", threads, seconds, baseSeconds / seconds,
+               100.0 * baseSeconds / seconds / threads, (unsigned long long)hash, hash == baseHash ? "" : " MISMATCH");
+    }
+    return matches ? 0 : 1;
+}
+
+static int runNetworkHeadless(Network *net, double durationSeconds, ThreadPool *pool) {
+    Uint64 endTick = (Uint64)(durationSeconds * SIM_TICKS_PER_SECOND);
+    Uint64 startTime = SDL_GetTicksNS();
+    runNetwork(net, endTick, pool);
+    double wallSeconds = (double)(SDL_GetTicksNS() - startTime) / SDL_NS_PER_SECOND;
+    NetworkTotals totals;
+    sumNetwork(net, &totals);
+    printNetworkSummary(&totals, net->tick, wallSeconds);
+    return 0;
+}
+
+// Distributed runs: each process owns a contiguous range of junction ids and holds only
+// those junctions and the links touching them, so its memory follows its share rather than
+// the whole network. Every tick it sends its neighbours the vehicles it handed to their
+// junctions after the discharge phase, and the counts of the links they feed after the
+// settle phase, then waits for theirs. Nothing runs ahead of the data it depends on, so
+// the result is exactly that of a single process.
+#define NETWORK_BASE_PORT TRAFFICSIM_NETWORK_BASE_PORT  // Default port of process 0; process r listens on base + r
+#define NETWORK_CONNECT_TIMEOUT_MS 30000  // How long to wait for the other processes to start
+#define NETWORK_HANDOFF_BYTES 20          // Link index and two ticks per vehicle handed over
+
+typedef struct {
+    char host[256];
+    char port[16];
+} NetAddress;
+
+// Another process of the run and the links shared with it. Both ends list the shared links
+// in the same order (downstream junction, then side), so messages refer to them by index.
+typedef struct {
+    NetSocket socket;
+    int *ghosts, ghostCount;      // Our links into its junctions (to = NETWORK_REMOTE)
+    int *inbound, inboundCount;   // Our links fed from its junctions (from = NETWORK_REMOTE)
+    Uint8 *out;                   // Message being sent: 4-byte length, then payload
+    int outLength, outCapacity, sent;
+    Uint8 *in;                    // Message being received, in the same format
+    int inCapacity, received, expecting;
+} NetPeer;
+
+typedef struct {
+    int rank, ranks;
+    NetPeer *peers;               // Indexed by rank; our own entry is unused
+} Cluster;
+
+typedef struct {
+    Sint64 key;                   // Global downstream junction * 4 + side
+    int link;
+} BoundaryLink;
+
+static int compareBoundaryLinks(const void *a, const void *b) {
+    const BoundaryLink *la = (const BoundaryLink *)a, *lb = (const BoundaryLink *)b;
+    return (la->key > lb->key) - (la->key < lb->key);
+}
+
+static int socketWouldBlock(void) {
+#ifdef _WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+}
+
+static void setSocketNonBlocking(NetSocket s) {
+#ifdef _WIN32
+    u_long on = 1;
+    ioctlsocket(s, FIONBIO, &on);
+#else
+    fcntl(s, F_SETFL, fcntl(s, F_GETFL, 0) | O_NONBLOCK);
+#endif
+    int noDelay = 1;  // Messages are small and every one is waited for
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char *)&noDelay, sizeof(noDelay));
+}
+
+// Parse "host:port,host:port,..." into one address per process, or default to localhost
+static int parsePeerAddresses(const char *list, NetAddress *addresses, int ranks) {
+    for (int r = 0; r < ranks; r++) {
+        snprintf(addresses[r].host, sizeof(addresses[r].host), "127.0.0.1");
+        snprintf(addresses[r].port, sizeof(addresses[r].port), "%d", NETWORK_BASE_PORT + r);
+    }
+    if (!list) return 1;
+    const char *entry = list;
+    for (int r = 0; r < ranks; r++) {
+        const char *end = strchr(entry, ',');
+        size_t length = end ? (size_t)(end - entry) : strlen(entry);
+        const char *colon = NULL;
+        for (size_t i = 0; i < length; i++) {
+            if (entry[i] == ':') colon = entry + i;
+        }
+        size_t hostLength = colon ? (size_t)(colon - entry) : 0;
+        size_t portLength = colon ? length - hostLength - 1 : 0;
+        if (!colon || hostLength == 0 || hostLength >= sizeof(addresses[r].host) ||
+            portLength == 0 || portLength >= sizeof(addresses[r].port)) {
+            printf("--peers: expected host:port for process %d\n", r);
+            return 0;
+        }
+        memcpy(addresses[r].host, entry, hostLength);
+        addresses[r].host[hostLength] = '\0';
+        memcpy(addresses[r].port, colon + 1, portLength);
+        addresses[r].port[portLength] = '\0';
+        if (!end) {
+            if (r != ranks - 1) {
+                printf("--peers lists %d addresses for %d processes\n", r + 1, ranks);
+                return 0;
+            }
+            return 1;
+        }
+        entry = end + 1;
+    }
+    printf("--peers lists more than %d addresses\n", ranks);
+    return 0;
+}
+
+static NetSocket openListener(const NetAddress *address) {
+    struct addrinfo hints, *found;
+    SDL_zero(hints);
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if (getaddrinfo(NULL, address->port, &hints, &found) != 0) return INVALID_SOCKET;
+    NetSocket s = socket(found->ai_family, found->ai_socktype, found->ai_protocol);
+    int reuse = 1;
+    if (s != INVALID_SOCKET) {
+        setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char *)&reuse, sizeof(reuse));
+        if (bind(s, found->ai_addr, (int)found->ai_addrlen) != 0 || listen(s, SOMAXCONN) != 0) {
+            closeNetSocket(s);
+            s = INVALID_SOCKET;
+        }
+    }
+    freeaddrinfo(found);
+    return s;
+}
+
+// Keep trying until the other process is listening or the deadline passes
+static NetSocket connectToPeer(const NetAddress *address, Uint64 deadline) {
+    struct addrinfo hints, *found;
+    SDL_zero(hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    while (SDL_GetTicks() < deadline) {
+        if (getaddrinfo(address->host, address->port, &hints, &found) == 0) {
+            for (struct addrinfo *a = found; a; a = a->ai_next) {
+                NetSocket s = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+                if (s == INVALID_SOCKET) continue;
+                if (connect(s, a->ai_addr, (int)a->ai_addrlen) == 0) {
+                    freeaddrinfo(found);
+                    return s;
+                }
+                closeNetSocket(s);
+            }
+            freeaddrinfo(found);
+        }
+        SDL_Delay(100);
+    }
+    return INVALID_SOCKET;
+}
+
+// Blocking transfer of a few bytes while connections are set up
+static int sendBytes(NetSocket s, const void *data, int length) {
+    for (int done = 0; done < length; ) {
+        int n = send(s, (const char *)data + done, length - done, 0);
+        if (n <= 0) return 0;
+        done += n;
+    }
+    return 1;
+}
+
+static int receiveBytes(NetSocket s, void *data, int length) {
+    for (int done = 0; done < length; ) {
+        int n = recv(s, (char *)data + done, length - done, 0);
+        if (n <= 0) return 0;
+        done += n;
+    }
+    return 1;
+}
+
+static void writeWord32(Uint8 *p, Uint32 value) {
+    for (int i = 0; i < 4; i++) p[i] = (Uint8)(value >> (8 * i));
+}
+
+static Uint32 readWord32(const Uint8 *p) {
+    return (Uint32)p[0] | (Uint32)p[1] << 8 | (Uint32)p[2] << 16 | (Uint32)p[3] << 24;
+}
+
+static void writeWord64(Uint8 *p, Uint64 value) {
+    writeWord32(p, (Uint32)value);
+    writeWord32(p + 4, (Uint32)(value >> 32));
+}
+
+static Uint64 readWord64(const Uint8 *p) {
+    return (Uint64)readWord32(p) | (Uint64)readWord32(p + 4) << 32;
+}
+
+// Start a message to a peer, with room for `length` bytes of payload
+static Uint8 *beginMessage(NetPeer *peer, int length) {
+    if (4 + length > peer->outCapacity) {
+        peer->outCapacity = 4 + length;
+        peer->out = (Uint8 *)realloc(peer->out, peer->outCapacity);
+    }
+    peer->outLength = 4;
+    peer->sent = 0;
+    return peer->out + 4;
+}
+
+static void finishMessage(NetPeer *peer, int length) {
+    peer->outLength = 4 + length;
+    writeWord32(peer->out, (Uint32)length);
+}
+
+static int messageLength(const NetPeer *peer) {
+    return (int)readWord32(peer->in);
+}
+
+// Send every begun message and receive one from every peer expecting one, all at once so
+// that large messages cannot leave two processes blocked sending to each other
+static int exchangeMessages(Cluster *cluster) {
+    for (;;) {
+        fd_set readable, writable;
+        FD_ZERO(&readable);
+        FD_ZERO(&writable);
+        NetSocket highest = 0;
+        int pending = 0;
+        for (int r = 0; r < cluster->ranks; r++) {
+            NetPeer *peer = &cluster->peers[r];
+            if (r == cluster->rank) continue;
+            if (peer->sent < peer->outLength) {
+                FD_SET(peer->socket, &writable);
+                highest = SDL_max(highest, peer->socket);
+                pending = 1;
+            }
+            if (peer->expecting && (peer->received < 4 || peer->received < 4 + messageLength(peer))) {
+                FD_SET(peer->socket, &readable);
+                highest = SDL_max(highest, peer->socket);
+                pending = 1;
+            }
+        }
+        if (!pending) return 1;
+        if (select((int)highest + 1, &readable, &writable, NULL, NULL) < 0) {
+            if (socketWouldBlock()) continue;
+            printf("Waiting for other processes failed\n");
+            return 0;
+        }
+        for (int r = 0; r < cluster->ranks; r++) {
+            NetPeer *peer = &cluster->peers[r];
+            if (r == cluster->rank) continue;
+            if (FD_ISSET(peer->socket, &writable)) {
+                int n = send(peer->socket, (const char *)peer->out + peer->sent, peer->outLength - peer->sent, 0);
+                if (n < 0 && !socketWouldBlock()) {
+                    printf("Lost connection to process %d\n", r);
+                    return 0;
+                }
+                if (n > 0) peer->sent += n;
+            }
+            if (FD_ISSET(peer->socket, &readable)) {
+                int wanted = peer->received < 4 ? 4 - peer->received : 4 + messageLength(peer) - peer->received;
+                if (peer->received + wanted > peer->inCapacity) {
+                    peer->inCapacity = peer->received + wanted;
+                    peer->in = (Uint8 *)realloc(peer->in, peer->inCapacity);
+                }
+                int n = recv(peer->socket, (char *)peer->in + peer->received, wanted, 0);
+                if (n == 0 || (n < 0 && !socketWouldBlock())) {
+                    printf("Lost connection to process %d\n", r);
+                    return 0;
+                }
+                if (n > 0) peer->received += n;
+            }
+        }
+    }
+}
+
+// Clear all messages before filling in the next round
+static void resetMessages(Cluster *cluster) {
+    for (int r = 0; r < cluster->ranks; r++) {
+        cluster->peers[r].outLength = 0;
+        cluster->peers[r].sent = 0;
+        cluster->peers[r].received = 0;
+        cluster->peers[r].expecting = 0;
+    }
+}
+
+static int isNeighbour(const NetPeer *peer) {
+    return peer->ghostCount > 0 || peer->inboundCount > 0;
+}
+
+// Connect every pair of processes: each listens on its own address, connects to those of
+// lower rank and accepts those of higher rank
+static int connectCluster(Cluster *cluster, const NetAddress *addresses) {
+#ifdef _WIN32
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
+        printf("Could not start Windows sockets\n");
+        return 0;
+    }
+#else
+    signal(SIGPIPE, SIG_IGN);  // A peer that exits shows up as an error from send instead
+#endif
+    NetSocket listener = openListener(&addresses[cluster->rank]);
+    if (listener == INVALID_SOCKET) {
+        printf("Could not listen on port %s\n", addresses[cluster->rank].port);
+        return 0;
+    }
+    Uint64 deadline = SDL_GetTicks() + NETWORK_CONNECT_TIMEOUT_MS;
+    Uint8 rankBytes[4];
+    writeWord32(rankBytes, (Uint32)cluster->rank);
+    for (int r = 0; r < cluster->rank; r++) {
+        NetSocket s = connectToPeer(&addresses[r], deadline);
+        if (s == INVALID_SOCKET || !sendBytes(s, rankBytes, 4)) {
+            printf("Could not reach process %d at %s:%s\n", r, addresses[r].host, addresses[r].port);
+            closeNetSocket(listener);
+            return 0;
+        }
+        cluster->peers[r].socket = s;
+    }
+    for (int accepted = 0; accepted < cluster->ranks - 1 - cluster->rank; accepted++) {
+        fd_set readable;
+        FD_ZERO(&readable);
+        FD_SET(listener, &readable);
+        Uint64 now = SDL_GetTicks();
+        struct timeval wait = {(long)((deadline > now ? deadline - now : 0) / 1000), 0};
+        NetSocket s = INVALID_SOCKET;
+        if (select((int)listener + 1, &readable, NULL, NULL, &wait) > 0) {
+            s = accept(listener, NULL, NULL);
+        }
+        if (s == INVALID_SOCKET || !receiveBytes(s, rankBytes, 4) || (int)readWord32(rankBytes) <= cluster->rank ||
+            (int)readWord32(rankBytes) >= cluster->ranks || cluster->peers[readWord32(rankBytes)].socket != INVALID_SOCKET) {
+            printf("Not every process of higher rank connected\n");
+            if (s != INVALID_SOCKET) closeNetSocket(s);
+            closeNetSocket(listener);
+            return 0;
+        }
+        cluster->peers[readWord32(rankBytes)].socket = s;
+    }
+    closeNetSocket(listener);
+    for (int r = 0; r < cluster->ranks; r++) {
+        if (r != cluster->rank) setSocketNonBlocking(cluster->peers[r].socket);
+    }
+    return 1;
+}
+
+static void freeCluster(Cluster *cluster) {
+    for (int r = 0; r < cluster->ranks; r++) {
+        NetPeer *peer = &cluster->peers[r];
+        if (peer->socket != INVALID_SOCKET) closeNetSocket(peer->socket);
+        free(peer->ghosts);
+        free(peer->inbound);
+        free(peer->out);
+        free(peer->in);
+    }
+    free(cluster->peers);
+#ifdef _WIN32
+    WSACleanup();
+#endif
+}
+
+// Sort the links to and from other processes into per-peer lists, in the shared order
+static void findBoundaryLinks(Cluster *cluster, const Network *net) {
+    BoundaryLink *boundary = (BoundaryLink *)malloc((net->linkCount + 1) * sizeof(BoundaryLink));
+    int count = 0;
+    for (int i = 0; i < net->linkCount; i++) {
+        const NetLink *link = &net->links[i];
+        if (link->to == NETWORK_REMOTE) {
+            boundary[count].key = (Sint64)link->remote * 4 + link->side;
+            boundary[count++].link = i;
+        }
+        else if (link->from == NETWORK_REMOTE) {
+            boundary[count].key = (Sint64)(net->firstNode + link->to) * 4 + link->side;
+            boundary[count++].link = i;
+        }
+    }
+    qsort(boundary, count, sizeof(BoundaryLink), compareBoundaryLinks);
+    for (int k = 0; k < count; k++) {
+        const NetLink *link = &net->links[boundary[k].link];
+        NetPeer *peer = &cluster->peers[ownerOfJunction(net->totalNodes, cluster->ranks, link->remote)];
+        if (link->to == NETWORK_REMOTE) {
+            peer->ghosts = (int *)realloc(peer->ghosts, (peer->ghostCount + 1) * sizeof(int));
+            peer->ghosts[peer->ghostCount++] = boundary[k].link;
+        }
+        else {
+            peer->inbound = (int *)realloc(peer->inbound, (peer->inboundCount + 1) * sizeof(int));
+            peer->inbound[peer->inboundCount++] = boundary[k].link;
+        }
+    }
+    free(boundary);
+}
+
+// Check that every process built the same network from the same options
+static int checkCluster(Cluster *cluster, const Network *net, const NetworkSpec *spec, Uint64 endTick) {
+    Uint64 settings[4] = {(Uint64)net->totalNodes, spec->seed, spec->entryInterval, endTick};
+    resetMessages(cluster);
+    for (int r = 0; r < cluster->ranks; r++) {
+        NetPeer *peer = &cluster->peers[r];
+        if (r == cluster->rank) continue;
+        Uint8 *data = beginMessage(peer, 48);
+        for (int w = 0; w < 4; w++) {
+            writeWord64(data + 8 * w, settings[w]);
+        }
+        writeWord64(data + 32, (Uint64)peer->ghostCount);
+        writeWord64(data + 40, (Uint64)peer->inboundCount);
+        finishMessage(peer, 48);
+        peer->expecting = 1;
+    }
+    if (!exchangeMessages(cluster)) return 0;
+    for (int r = 0; r < cluster->ranks; r++) {
+        const NetPeer *peer = &cluster->peers[r];
+        if (r == cluster->rank) continue;
+        int same = messageLength(peer) == 48;
+        for (int w = 0; same && w < 4; w++) {
+            same = readWord64(peer->in + 4 + 8 * w) == settings[w];
+        }
+        if (!same || readWord64(peer->in + 36) != (Uint64)peer->inboundCount ||
+            readWord64(peer->in + 44) != (Uint64)peer->ghostCount) {
+            printf("Process %d has a different network; give every process the same options and --seed\n", r);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// One tick of this process's share, meeting its neighbours after each phase
+static int stepDistributedNetwork(Network *net, Cluster *cluster) {
+    Uint64 tick = net->tick;
+    for (int n = 0; n < net->nodeCount; n++) {
+        dischargeJunction(net, n, tick);
+    }
+    resetMessages(cluster);
+    for (int r = 0; r < cluster->ranks; r++) {
+        NetPeer *peer = &cluster->peers[r];
+        if (r == cluster->rank || !isNeighbour(peer)) continue;
+        Uint8 *data = beginMessage(peer, peer->ghostCount * NETWORK_HANDOFF_BYTES);
+        int length = 0;
+        for (int k = 0; k < peer->ghostCount; k++) {
+            NetLink *link = &net->links[peer->ghosts[k]];
+            if (!SDL_GetAtomicInt(&link->handoff)) continue;
+            writeWord32(data + length, (Uint32)k);
+            writeWord64(data + length + 4, link->incoming.enteredTick);
+            writeWord64(data + length + 12, link->incoming.readyTick);
+            length += NETWORK_HANDOFF_BYTES;
+            SDL_SetAtomicInt(&link->handoff, 0);
+        }
+        finishMessage(peer, length);
+        peer->expecting = 1;
+    }
+    if (!exchangeMessages(cluster)) return 0;
+    for (int r = 0; r < cluster->ranks; r++) {
+        const NetPeer *peer = &cluster->peers[r];
+        if (r == cluster->rank || !isNeighbour(peer)) continue;
+        const Uint8 *data = peer->in + 4;
+        for (int offset = 0; offset + NETWORK_HANDOFF_BYTES <= messageLength(peer); offset += NETWORK_HANDOFF_BYTES) {
+            Uint32 k = readWord32(data + offset);
+            if (k >= (Uint32)peer->inboundCount) continue;
+            NetLink *link = &net->links[peer->inbound[k]];
+            link->incoming.enteredTick = readWord64(data + offset + 4);
+            link->incoming.readyTick = readWord64(data + offset + 12);
+            link->incoming.exitSide = -1;
+            link->incoming.destination = -1;
+            SDL_SetAtomicInt(&link->handoff, 1);
+        }
+    }
+
+    for (int n = 0; n < net->nodeCount; n++) {
+        settleJunction(net, n, tick);
+    }
+    resetMessages(cluster);
+    for (int r = 0; r < cluster->ranks; r++) {
+        NetPeer *peer = &cluster->peers[r];
+        if (r == cluster->rank || !isNeighbour(peer)) continue;
+        Uint8 *data = beginMessage(peer, peer->inboundCount * 4);
+        for (int k = 0; k < peer->inboundCount; k++) {
+            writeWord32(data + 4 * k, (Uint32)net->links[peer->inbound[k]].count);
+        }
+        finishMessage(peer, peer->inboundCount * 4);
+        peer->expecting = 1;
+    }
+    if (!exchangeMessages(cluster)) return 0;
+    for (int r = 0; r < cluster->ranks; r++) {
+        const NetPeer *peer = &cluster->peers[r];
+        if (r == cluster->rank || !isNeighbour(peer)) continue;
+        if (messageLength(peer) != peer->ghostCount * 4) {
+            printf("Bad message from process %d\n", r);
+            return 0;
+        }
+        for (int k = 0; k < peer->ghostCount; k++) {
+            net->links[peer->ghosts[k]].count = (int)readWord32(peer->in + 4 + 4 * k);
+        }
+    }
+    net->tick++;
+    return 1;
+}
+
+// Add up every process's totals at process 0
+static int gatherNetworkTotals(Cluster *cluster, NetworkTotals *totals) {
+    Uint64 *words[NETWORK_TOTALS_WORDS] = {&totals->junctions, &totals->links, &totals->arrived, &totals->rejected,
+                                           &totals->departed, &totals->travelTicks, &totals->inNetwork, &totals->hash};
+    resetMessages(cluster);
+    if (cluster->rank != 0) {
+        Uint8 *data = beginMessage(&cluster->peers[0], 8 * NETWORK_TOTALS_WORDS);
+        for (int w = 0; w < NETWORK_TOTALS_WORDS; w++) {
+            writeWord64(data + 8 * w, *words[w]);
+        }
+        finishMessage(&cluster->peers[0], 8 * NETWORK_TOTALS_WORDS);
+        return exchangeMessages(cluster);
+    }
+    for (int r = 1; r < cluster->ranks; r++) {
+        cluster->peers[r].expecting = 1;
+    }
+    if (!exchangeMessages(cluster)) return 0;
+    for (int r = 1; r < cluster->ranks; r++) {
+        if (messageLength(&cluster->peers[r]) != 8 * NETWORK_TOTALS_WORDS) {
+            printf("Bad totals from process %d\n", r);
+            return 0;
+        }
+        for (int w = 0; w < NETWORK_TOTALS_WORDS; w++) {
+            *words[w] += readWord64(cluster->peers[r].in + 4 + 8 * w);
+        }
+    }
+    return 1;
+}
+
+// Run this process's share of a distributed network; process 0 prints the summary
+static int runDistributedNetwork(const NetworkSpec *spec, const char *peerList, double durationSeconds) {
+    Uint64 endTick = (Uint64)(durationSeconds * SIM_TICKS_PER_SECOND);
+    NetAddress *addresses = (NetAddress *)calloc(spec->ranks, sizeof(NetAddress));
+    if (!parsePeerAddresses(peerList, addresses, spec->ranks)) {
+        free(addresses);
+        return 1;
+    }
+    Network net;
+    if (!buildNetwork(&net, spec)) {
+        free(addresses);
+        return 1;
+    }
+    Cluster cluster = {spec->rank, spec->ranks, (NetPeer *)calloc(spec->ranks, sizeof(NetPeer))};
+    for (int r = 0; r < cluster.ranks; r++) {
+        cluster.peers[r].socket = INVALID_SOCKET;
+    }
+    findBoundaryLinks(&cluster, &net);
+    int ok = connectCluster(&cluster, addresses) && checkCluster(&cluster, &net, spec, endTick);
+    free(addresses);
+    if (ok) {
+        printf("Process:             %d of %d (junctions %d to %d)\n", spec->rank, spec->ranks,
+               net.firstNode, net.firstNode + net.nodeCount - 1);
+    }
+    Uint64 startTime = SDL_GetTicksNS();
+    while (ok && net.tick < endTick) {
+        ok = stepDistributedNetwork(&net, &cluster);
+    }
+    double wallSeconds = (double)(SDL_GetTicksNS() - startTime) / SDL_NS_PER_SECOND;
+    NetworkTotals totals;
+    sumNetwork(&net, &totals);
+    ok = ok && gatherNetworkTotals(&cluster, &totals);
+    if (ok && spec->rank == 0) {
+        printNetworkSummary(&totals, net.tick, wallSeconds);
+    }
+    freeCluster(&cluster);
+    freeNetwork(&net);
+    return ok ? 0 : 1;
+}
+
+// Library interface (trafficsim.h): a handle is one junction and the threads it runs on
+struct TrafficSim {
+    Simulation sim;
+    int arrivals;  // TRAFFICSIM_ARRIVALS_*; not part of a checkpoint, so kept here
+};
+
+void trafficSimDefaultConfig(TrafficSimConfig *config) {
+    SDL_zerop(config);
+    config->seed = SDL_GetPerformanceCounter();
+    config->engine = TRAFFICSIM_ENGINE_TICK;
+    config->arrivals = TRAFFICSIM_ARRIVALS_GENERATOR;
+    config->followModel = FOLLOW_SIMPLE;
+    config->greenSeconds = LIGHT_SWITCH_INTERVAL_MS / 1000.0;
+    config->minGreenSeconds = MIN_GREEN_MS / 1000.0;
+    config->serviceSeconds = SERVICE_TIME_MS / 1000.0;
+    config->amberSeconds = AMBER_MS / 1000.0;
+    config->allRedSeconds = ALL_RED_MS / 1000.0;
+    config->spawnSeconds = SPAWN_INTERVAL_MS / 1000.0;
+    config->priorityThreshold = PRIORITY_LANE_THRESHOLD;
+    config->laneCapacity = MAX_NUMBER_OF_VEHICLES;
+    config->threads = 1;
+}
+
+// Point the simulation at its arrival source. With none, the generator never comes due.
+static void applyArrivalSource(TrafficSim *ts) {
+    Simulation *sim = &ts->sim;
+    sim->useLaneFiles = ts->arrivals == TRAFFICSIM_ARRIVALS_LANE_FILES;
+    if (ts->arrivals != TRAFFICSIM_ARRIVALS_NONE) return;
+    sim->nextSpawnTick = (Uint64)-1;
+    if (sim->events && isInHeap(&sim->events->queue, EVENT_ARRIVALS)) {
+        removeFromHeap(&sim->events->queue, EVENT_ARRIVALS);
+    }
+}
+
+// Reject settings that cannot be turned into ticks and lane limits, printing the first one found
+static int isValidConfig(const TrafficSimConfig *config) {
+    const char *names[6] = {"green time", "minimum green", "service time", "amber time",
+                            "all-red time", "spawn interval"};
+    double seconds[6] = {config->greenSeconds, config->minGreenSeconds, config->serviceSeconds,
+                         config->amberSeconds, config->allRedSeconds, config->spawnSeconds};
+    for (int i = 0; i < 6; i++) {
+        if (!(seconds[i] >= 0.0 && seconds[i] * SIM_TICKS_PER_SECOND < 1e18)) {
+            printf("Invalid %s: %g s.\n", names[i], seconds[i]);
+            return 0;
+        }
+    }
+    if (config->laneCapacity <= 0) {
+        printf("Invalid lane capacity: %d.\n", config->laneCapacity);
+        return 0;
+    }
+    if (config->priorityThreshold < 0) {
+        printf("Invalid priority threshold: %d.\n", config->priorityThreshold);
+        return 0;
+    }
+    return 1;
+}
+
+TrafficSim *trafficSimCreate(const TrafficSimConfig *config) {
+    if (!isValidConfig(config)) return NULL;
+    TrafficSim *ts = (TrafficSim *)calloc(1, sizeof(TrafficSim));
+    if (!ts) {
+        printf("Out of memory creating the simulation.\n");
+        return NULL;
+    }
+    Simulation *sim = &ts->sim;
+    initSimulation(sim);
+    sim->rngState = config->seed;
+    sim->greenTicks = SDL_max((Uint64)(config->greenSeconds * SIM_TICKS_PER_SECOND), 1);
+    sim->minGreenTicks = (Uint64)(config->minGreenSeconds * SIM_TICKS_PER_SECOND);
+    sim->serviceTicks = (Uint64)(config->serviceSeconds * SIM_TICKS_PER_SECOND);
+    sim->amberTicks = (Uint64)(config->amberSeconds * SIM_TICKS_PER_SECOND);
+    sim->allRedTicks = (Uint64)(config->allRedSeconds * SIM_TICKS_PER_SECOND);
+    sim->phaseTicks = signalPhaseTicks(sim);
+    setLaneWeight(&sim->lanes, (double)sim->serviceTicks);
+    sim->spawnInterval = SDL_max((Uint64)(config->spawnSeconds * SIM_TICKS_PER_SECOND), 1);
+    sim->priorityThreshold = config->priorityThreshold;
+    setLaneCapacity(sim, config->laneCapacity);
+    if (config->checksums) {
+        sim->trace = createChecksumTrace(config->traceFile, config->compareFile);
+        if (!sim->trace) {
+            freeSimulation(sim);
+            free(ts);
+            return NULL;
+        }
+    }
+    if (config->engine == TRAFFICSIM_ENGINE_EVENT) {
+        enableEventEngine(sim);
+    }
+    else if (config->engine == TRAFFICSIM_ENGINE_CTM) {
+        sim->ctm = createCtmJunction();
+    }
+    else {
+        // The other engines do not move individual vehicles, so these only apply here
+        sim->followModel = config->reservations ? FOLLOW_IDM : config->followModel;
+        if (config->reservations) sim->reservations = createReservationTable();
+        if (config->audit) sim->grid = createSpatialGrid();
+    }
+    ts->arrivals = config->arrivals;
+    applyArrivalSource(ts);
+    sim->pool = createThreadPool(config->threads > 0 ? config->threads : SDL_GetNumLogicalCPUCores());
+    if (config->rewindMemoryMB > 0) {
+        sim->rewind = createRewindBuffer(msToTicks(REWIND_KEYFRAME_MS), (size_t)config->rewindMemoryMB * 1024 * 1024);
+        recordRewind(sim);
+    }
+    return ts;
+}
+
+void trafficSimDestroy(TrafficSim *ts) {
+    if (!ts) return;
+    destroyThreadPool(ts->sim.pool);
+    freeSimulation(&ts->sim);
+    free(ts);
+}
+
+int trafficSimLoad(TrafficSim *ts, const char *filename) {
+    Simulation *sim = &ts->sim;
+    if (!loadCheckpoint(sim, filename)) return 0;
+    applyArrivalSource(ts);
+    if (sim->rewind) {
+        // History from before the load would rewind into a different run
+        RewindBuffer *old = sim->rewind;
+        sim->rewind = createRewindBuffer(old->interval, old->budget);
+        destroyRewindBuffer(old);
+        recordRewind(sim);
+    }
+    return 1;
+}
+
+int trafficSimSave(const TrafficSim *ts, const char *filename) {
+    return saveCheckpoint(&ts->sim, filename);
+}
+
+uint64_t trafficSimAdvance(TrafficSim *ts, uint64_t maxTicks) {
+    Simulation *sim = &ts->sim;
+    if (maxTicks == 0) return 0;
+    Uint64 startTick = sim->tick;
+    Uint64 limitTick = maxTicks < (Uint64)-1 - startTick ? startTick + maxTicks : (Uint64)-1;
+    if (!skipIdleTicks(sim, limitTick)) {
+        stepSimulation(sim);
+    }
+    recordRewind(sim);
+    return sim->tick - startTick;
+}
+
+uint64_t trafficSimStep(TrafficSim *ts, uint64_t ticks) {
+    Simulation *sim = &ts->sim;
+    Uint64 startTick = sim->tick;
+    Uint64 endTick = startTick + ticks;
+    if (sim->events && !sim->trace) {
+        // Jump straight to the end; positions are only worked out when asked for. Ticks at
+        // which injected vehicles are replayed are stepped on their own.
+        while (sim->tick < endTick) {
+            runEvents(sim, sim->rewind ? SDL_min(nextInjectionTick(sim->rewind, sim->tick), endTick) : endTick);
+            if (sim->tick < endTick) stepSimulation(sim);
+        }
+        recordRewind(sim);
+    }
+    // A run compared with a reference stops at the first tick that differs
+    while (sim->tick < endTick && !(sim->trace && sim->trace->divergedTick)) {
+        trafficSimAdvance(ts, endTick - sim->tick);
+    }
+    return sim->tick - startTick;
+}
+
+int trafficSimRewind(TrafficSim *ts, uint64_t tick) {
+    return rewindSimulation(&ts->sim, tick);
+}
+
+int trafficSimIsReplaying(const TrafficSim *ts) {
+    return ts->sim.rewind && ts->sim.tick < ts->sim.rewind->liveTick;
+}
+
+int trafficSimInject(TrafficSim *ts, int road, int lane, float x, float y, float speed) {
+    Simulation *sim = &ts->sim;
+    Queue *roadQueues[4] = {sim->vehicleQueueA, sim->vehicleQueueB, sim->vehicleQueueC, sim->vehicleQueueD};
+    if (road < 1 || road > 4 || lane < 2 || lane > 3 || trafficSimIsReplaying(ts)) return 0;
+    Vehicle v = {0};
+    v.road = road;
+    v.lane = lane;
+    v.x = x;
+    v.y = y;
+    v.speed = speed;
+    if (sim->rewind) {
+        logArrival(sim->rewind, sim->tick, road - 1, v, 1);
+    }
+    Uint64 arrived = sim->stats.arrived;
+    admitVehicle(sim, roadQueues[road - 1], v);
+    updateLaneScheduler(sim);  // The event engine only looks again at its next arrival or departure
+    return sim->stats.arrived > arrived;
+}
+
+uint64_t trafficSimGetTick(const TrafficSim *ts) {
+    return ts->sim.tick;
+}
+
+int trafficSimGetEngine(const TrafficSim *ts) {
+    if (ts->sim.events) return TRAFFICSIM_ENGINE_EVENT;
+    if (ts->sim.ctm) return TRAFFICSIM_ENGINE_CTM;
+    return TRAFFICSIM_ENGINE_TICK;
+}
+
+// Bring the lane queues up to date with the event or cell engine before they are read
+static void materialiseQueues(Simulation *sim) {
+    if (sim->events) {
+        materialiseEvents(sim);
+    }
+    if (sim->ctm) {
+        materialiseCtm(sim);
+    }
+}
+
+void trafficSimGetMetrics(TrafficSim *ts, TrafficSimMetrics *metrics) {
+    Simulation *sim = &ts->sim;
+    const SimulationStats *s = &sim->stats;
+    materialiseQueues(sim);
+    SDL_zerop(metrics);
+    metrics->tick = sim->tick;
+    metrics->arrived = s->arrived;
+    metrics->rejected = s->rejected;
+    metrics->departed = s->departed;
+    metrics->queued = countQueuedVehicles(sim);
+    metrics->maxQueueLength = s->maxQueueLength;
+    metrics->meanTravelTime = s->departed ? s->totalTravelTime / s->departed : 0.0;
+    metrics->p95TravelTime = sim->ctm ? 0.0 : travelTimePercentile(s, 0.95);
+    metrics->reservationDenials = s->reservationDenials;
+    metrics->overlapPairs = s->overlapPairs;
+    if (sim->trace) {
+        metrics->checksum = sim->trace->checksum;
+        metrics->divergedTick = sim->trace->divergedTick;
+    }
+}
+
+int trafficSimGetVehicles(TrafficSim *ts, TrafficSimVehicle *vehicles, int max) {
+    Simulation *sim = &ts->sim;
+    const Queue *roadQueues[4] = {sim->vehicleQueueA, sim->vehicleQueueB, sim->vehicleQueueC, sim->vehicleQueueD};
+    materialiseQueues(sim);
+    int count = 0;
+    for (int road = 0; road < 4; road++) {
+        for (int i = 0; i < 3; i++) {
+            const Queue *q = &roadQueues[road][i];
+            for (int k = 0; k < q->count; k++, count++) {
+                if (count >= max) continue;
+                vehicles[count].x = q->x[q->head + k];
+                vehicles[count].y = q->y[q->head + k];
+                vehicles[count].road = road + 1;
+                vehicles[count].lane = i + 1;
+            }
+        }
+    }
+    return count;
+}
+
+void trafficSimGetLights(const TrafficSim *ts, TrafficSimLight lights[4]) {
+    for (int i = 0; i < 4; i++) {
+        lights[i].x = ts->sim.lights[i].x;
+        lights[i].y = ts->sim.lights[i].y;
+        lights[i].state = ts->sim.lights[i].state;
+    }
+}
+
+void trafficSimPrintSummary(TrafficSim *ts, double wallSeconds) {
+    materialiseQueues(&ts->sim);
+    printSummary(&ts->sim, wallSeconds);
+}
+
+int trafficSimRunSweep(TrafficSim *ts, const char *text, int randomCount, double durationSeconds,
+                       const char *csvFile) {
+    // Every parameter not named stays at the handle's setting
+    const Simulation *sim = &ts->sim;
+    SweepSpec spec;
+    double base[SWEEP_PARAMETERS];
+    sweepBaseValues(sim, base);
+    for (int p = 0; p < SWEEP_PARAMETERS; p++) {
+        spec.low[p] = spec.high[p] = base[p];
+        spec.step[p] = 1.0;
+    }
+    spec.randomCount = randomCount;
+    if (text && !parseSweepSpec(text, &spec)) return 1;
+    return runSweep(sim, &spec, sim->rngState, durationSeconds, csvFile, sim->pool);
+}
+
+int trafficSimRunEnsemble(TrafficSim *ts, int maxRuns, double relativeWidth, double durationSeconds) {
+    return runEnsemble(&ts->sim, ts->sim.rngState, maxRuns, relativeWidth, durationSeconds, ts->sim.pool);
+}
+
+int trafficSimRunWhatIf(TrafficSim *ts, double durationSeconds) {
+    runWhatIf(&ts->sim, durationSeconds, ts->sim.pool);
+    return 0;
+}
+
+const char *trafficSimSelectKernel(const char *requested) {
+    return selectLaneKernel(requested);
+}
+
+void trafficSimDefaultNetworkConfig(TrafficSimNetworkConfig *config) {
+    SDL_zerop(config);
+    config->seed = SDL_GetPerformanceCounter();
+    config->entrySeconds = NETWORK_ENTRY_INTERVAL_MS / 1000.0;
+    config->threads = 1;
+    config->ranks = 1;
+}
+
+// Reject network settings the CLI would not pass on, printing the first one found
+static int isValidNetworkConfig(const TrafficSimNetworkConfig *config, double durationSeconds) {
+    const char *names[2] = {"duration", "entry interval"};
+    double seconds[2] = {durationSeconds, config->entrySeconds};
+    for (int i = 0; i < 2; i++) {
+        if (!(seconds[i] >= 0.0 && seconds[i] * SIM_TICKS_PER_SECOND < 1e18)) {
+            printf("Invalid %s: %g s.\n", names[i], seconds[i]);
+            return 0;
+        }
+    }
+    if (!config->file && (config->columns <= 0 || config->rows <= 0)) {
+        printf("Invalid grid: %d x %d.\n", config->columns, config->rows);
+        return 0;
+    }
+    if (config->ranks < 1 || config->rank < 0 || config->rank >= config->ranks) {
+        printf("Invalid share of a distributed run: %d of %d.\n", config->rank, config->ranks);
+        return 0;
+    }
+    return 1;
+}
+
+int trafficSimRunNetwork(const TrafficSimNetworkConfig *config, double durationSeconds) {
+    if (!isValidNetworkConfig(config, durationSeconds)) return 1;
+    NetworkSpec spec = {config->file, config->columns, config->rows, config->seed,
+                        SDL_max((Uint64)(config->entrySeconds * SIM_TICKS_PER_SECOND), 1),
+                        config->rank, config->ranks, config->routes};
+    if (spec.ranks > 1) {
+        spec.routes = 0;  // The table would need every process to hold the whole network
+        return runDistributedNetwork(&spec, config->peers, durationSeconds);
+    }
+    if (config->scaling) {
+        return runNetworkScaling(&spec, durationSeconds);
+    }
+    Uint64 buildStart = SDL_GetTicksNS();
+    Network net;
+    if (!buildNetwork(&net, &spec)) return 1;
+    if (net.routes) {
+        printf("Routes:              %d sinks, %.1f KB table, built in %.3f s\n", net.routes->sinkCount,
+               (double)net.nodeCount * net.routes->sinkCount / 2 / 1024,
+               (double)(SDL_GetTicksNS() - buildStart) / SDL_NS_PER_SECOND);
+    }
+    int threadCount = config->threads > 0 ? config->threads : SDL_GetNumLogicalCPUCores();
+    printf("Threads:             %d\n", threadCount);
+    ThreadPool *pool = createThreadPool(threadCount);
+    int result = runNetworkHeadless(&net, durationSeconds, pool);
+    destroyThreadPool(pool);
+    freeNetwork(&net);
+    return result;
+}
@@ -0,0 +1,149 @@
+// Traffic junction simulation library. One TrafficSim is one four-way junction with its
+// lights, lanes, arrivals and statistics; it advances only when the caller steps it, so
+// it can be driven by a window, a headless run or other tooling. Different handles may be
+// used from different threads at once; one handle must be used from one thread at a time.
+// Functions that fail print the reason and return 0 or NULL, except the batch runs, which
+// return a process exit status.
+#ifndef TRAFFICSIM_H
+#define TRAFFICSIM_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TRAFFICSIM_TICKS_PER_SECOND 60   // Fixed simulation rate
+#define TRAFFICSIM_NETWORK_BASE_PORT 5600 // Default port of process 0 of a distributed network
+
+#define TRAFFICSIM_ENGINE_TICK 0         // Fixed steps
+#define TRAFFICSIM_ENGINE_EVENT 1        // Discrete events, simple queue model
+#define TRAFFICSIM_ENGINE_CTM 2          // Cell transmission model, no individual vehicles
+
+#define TRAFFICSIM_FOLLOW_SIMPLE 0       // Move at full speed while the gap allows
+#define TRAFFICSIM_FOLLOW_IDM 1          // Intelligent Driver Model
+
+#define TRAFFICSIM_ARRIVALS_GENERATOR 0  // Built-in random generator
+#define TRAFFICSIM_ARRIVALS_LANE_FILES 1 // RoadA.txt .. RoadD.txt written by traffic_generator
+#define TRAFFICSIM_ARRIVALS_NONE 2       // Only vehicles passed to trafficSimInject()
+
+typedef struct TrafficSim TrafficSim;
+
+typedef struct {
+    uint64_t seed;            // Random stream of the generator
+    int engine;               // TRAFFICSIM_ENGINE_*
+    int arrivals;             // TRAFFICSIM_ARRIVALS_*
+    int followModel;          // TRAFFICSIM_FOLLOW_* (tick engine only)
+    int reservations;         // Book space-time cells of the junction box (tick engine, implies IDM)
+    int audit;                // Count overlapping vehicles every tick (tick engine only)
+    double greenSeconds;      // Longest green; every green when serviceSeconds is 0
+    double minGreenSeconds;   // Shortest green
+    double serviceSeconds;    // Green time per waiting vehicle (0 = fixed timing)
+    double amberSeconds;      // Amber after each green
+    double allRedSeconds;     // Every light red between amber and the next green
+    double spawnSeconds;      // Time between generator batches
+    int priorityThreshold;    // Lane A2 vehicles above which road A takes priority
+    int laneCapacity;         // Vehicles a lane holds before arrivals are rejected
+    int threads;              // Threads for the per-road update and batch runs (0 = all cores)
+    int checksums;            // Fold the state after every tick into a rolling checksum
+    const char *traceFile;    // With checksums: write one per tick to this file (NULL = none)
+    const char *compareFile;  // With checksums: stop at the first tick differing from this trace
+    int rewindMemoryMB;       // History kept for trafficSimRewind() (0 = none)
+} TrafficSimConfig;
+
+typedef struct {
+    uint64_t tick;            // Simulated time in ticks
+    uint64_t arrived;         // Vehicles admitted to a lane
+    uint64_t rejected;        // Vehicles dropped because their lane was full
+    uint64_t departed;        // Vehicles that drove off the screen
+    int queued;               // Vehicles on the roads now
+    int maxQueueLength;       // Longest lane queue seen
+    double meanTravelTime;    // Seconds from arrival to departure, over departed vehicles
+    double p95TravelTime;     // 95th percentile of the same (0 for the CTM engine)
+    uint64_t reservationDenials; // Junction crossing requests refused
+    uint64_t overlapPairs;    // Audit: overlapping vehicle pairs, summed over ticks
+    uint64_t checksum;        // Rolling checksum (0 without checksums)
+    uint64_t divergedTick;    // First tick differing from the compare trace (0 = none)
+} TrafficSimMetrics;
+
+// What the junction looks like now, for drawing
+typedef struct {
+    float x, y;               // Top-left corner on the 800 x 800 screen
+    int road, lane;           // Road 1..4 (A..D), lane 2 or 3
+} TrafficSimVehicle;
+
+typedef struct {
+    int x, y;                 // Top-left corner of the light on screen
+    int state;                // 0 = red, 1 = green, 2 = amber
+} TrafficSimLight;
+
+// Several junctions joined by one-way links, simulated headless in one call
+typedef struct {
+    const char *file;         // Network file, or NULL for a grid
+    int columns, rows;        // Grid size
+    uint64_t seed;
+    double entrySeconds;      // Mean time between vehicles on each source link
+    int routes;               // Send vehicles to a random exit by the shortest route
+    int threads;              // 0 = all cores
+    int scaling;              // Time 1, 2, 4 .. all threads and compare instead of one run
+    int rank, ranks;          // Share of a distributed run (0 of 1 = whole network here)
+    const char *peers;        // host:port of every process, or NULL for localhost
+} TrafficSimNetworkConfig;
+
+void trafficSimDefaultConfig(TrafficSimConfig *config);
+// NULL if a time is negative, laneCapacity is below 1, priorityThreshold is negative, a
+// trace file cannot be opened or memory runs out
+TrafficSim *trafficSimCreate(const TrafficSimConfig *config);
+void trafficSimDestroy(TrafficSim *ts);
+
+// Replace the state with a checkpoint; the engine and car-following model follow the file.
+// On failure the handle is left exactly as it was, rewind history included.
+int trafficSimLoad(TrafficSim *ts, const char *filename);
+int trafficSimSave(const TrafficSim *ts, const char *filename);
+
+// Advance by ticks, stopping early only on a difference from the compare trace.
+// Returns the ticks advanced.
+uint64_t trafficSimStep(TrafficSim *ts, uint64_t ticks);
+// Advance by at least one and at most maxTicks ticks: one tick, or a whole stretch in
+// which nothing moves. Returns the ticks advanced.
+uint64_t trafficSimAdvance(TrafficSim *ts, uint64_t maxTicks);
+// Go back to an earlier tick held in the rewind history. Returns 0 without history.
+int trafficSimRewind(TrafficSim *ts, uint64_t tick);
+// Whether the clock is behind the furthest tick reached, after a rewind
+int trafficSimIsReplaying(const TrafficSim *ts);
+
+// Add a vehicle as a lane file line would: road 1..4, lane 2 or 3, position on screen and
+// speed in pixels per second. Returns 1 if it joined its lane, 0 if the lane was full, the
+// road or lane is invalid, or the handle is replaying after a rewind (the history ahead is
+// fixed until the furthest tick reached). Injected vehicles are replayed after a rewind.
+int trafficSimInject(TrafficSim *ts, int road, int lane, float x, float y, float speed);
+
+uint64_t trafficSimGetTick(const TrafficSim *ts);
+int trafficSimGetEngine(const TrafficSim *ts);
+void trafficSimGetMetrics(TrafficSim *ts, TrafficSimMetrics *metrics);
+// Copy up to max vehicles; returns how many there are in total
+int trafficSimGetVehicles(TrafficSim *ts, TrafficSimVehicle *vehicles, int max);
+void trafficSimGetLights(const TrafficSim *ts, TrafficSimLight lights[4]);
+void trafficSimPrintSummary(TrafficSim *ts, double wallSeconds);
+
+// Batch runs from the current state, printing their results.
+// Sweep specs are "name=value" or "name=low:high[:step]" items, comma separated, over
+// green, threshold, spawn, capacity and service; randomCount > 0 draws that many
+// configurations.
+int trafficSimRunSweep(TrafficSim *ts, const char *spec, int randomCount, double durationSeconds,
+                       const char *csvFile);
+int trafficSimRunEnsemble(TrafficSim *ts, int maxRuns, double relativeWidth, double durationSeconds);
+int trafficSimRunWhatIf(TrafficSim *ts, double durationSeconds);
+
+// Selects the lane-advance kernel for every handle: "scalar", "sse", "avx2" or NULL for
+// the best available. Returns the name of the kernel in use.
+const char *trafficSimSelectKernel(const char *requested);
+
+void trafficSimDefaultNetworkConfig(TrafficSimNetworkConfig *config);
+int trafficSimRunNetwork(const TrafficSimNetworkConfig *config, double durationSeconds);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif